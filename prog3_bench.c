@@ -0,0 +1,820 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+
+/* Macros */
+#define MAXMSG 1000       /* the server disconnects participants at or above this length */
+#define MAXEVENTS 64      /* ready sockets handled per loop iteration */
+#define INBUFSIZE 65536   /* bytes an observer reads per recv */
+#define OUTBUFSIZE 65536  /* frames a participant may have waiting for its socket */
+#define HISTSUB 16        /* histogram buckets per power of two */
+#define HISTBUCKETS (64 * HISTSUB)
+#define DRAINMS 500       /* how long observers keep reading after the last send */
+
+/* Protocol v2, see prog3_server.c */
+#define PROTO_HELLO 0xFF
+#define V2HEADER 4        /* network order uint32_t frame length */
+#define V2RECORD 3        /* uint8_t type + network order uint16_t length */
+#define REC_PUBLIC  1
+#define REC_PRIVATE 2
+
+/* Load generator for prog3_server
+ *    Connects synthetic participants and observers, has every participant send
+ *    public (and optionally @private) messages at a fixed rate and measures how
+ *    long each one takes to reach the observers
+ *    Every message carries the time it was due to be sent ("t=<ns>"), so a
+ *    stalled server shows up as latency instead of as a lower send rate
+ *    With -r -1 nothing is sent: the connections are held idle for the run
+ *    (a soak), and -p samples the server's RSS so its memory per connection
+ *    can be read off
+ */
+
+/* hist fields:
+- counts: log-linear buckets, HISTSUB per power of two, so every value is
+kept to within about 6%
+- total: how many values were recorded
+- max: the largest one
+*/
+typedef struct hist{
+  uint64_t counts[HISTBUCKETS];
+  uint64_t total;
+  uint64_t max;
+} hist;
+
+/* benchPart fields:
+- sd: socket
+- index: global participant number, its name is prefix followed by it
+- out: frames waiting for the socket to take them
+- outLen: bytes in out
+- nextSend: when the next message is due, monotonic nanoseconds
+*/
+typedef struct benchPart{
+  int sd;
+  int index;
+  char out[OUTBUFSIZE];
+  int outLen;
+  uint64_t nextSend;
+} benchPart;
+
+/* benchObs fields:
+- sd: socket
+- in: bytes of a frame that has not fully arrived yet
+- inLen: bytes in in
+*/
+typedef struct benchObs{
+  int sd;
+  char in[INBUFSIZE];
+  int inLen;
+} benchObs;
+
+/* worker fields:
+- thread: the thread driving this slice of the connections
+- epfd: its epoll instance
+- seed: rand_r state for picking private recipients
+- parts / partCount: its participants
+- obs / obsCount: its observers
+- sent: messages handed to the socket
+- skipped: messages that were due while the participant's buffer was full
+- received: frames read by its observers
+- bytes: bytes read by its observers
+- latency: send-to-receipt times in microseconds
+*/
+typedef struct worker{
+  pthread_t thread;
+  int epfd;
+  unsigned int seed;
+  benchPart *parts;
+  int partCount;
+  benchObs *obs;
+  int obsCount;
+  long sent;
+  long skipped;
+  long received;
+  long bytes;
+  hist latency;
+} worker;
+
+/* Prototypes --------------------------------------------------------*/
+
+/* dial
+ *    Connects to port and waits for the server's 'Y'
+ *    Exits if the server is full or unreachable
+ */
+int dial(uint16_t port);
+
+/* pickName
+ *    Asks for protocol v2 if -v 2 was given, then sends name as a
+ *    uint8_t length + name and returns the server's answer
+ */
+char pickName(int sd, const char *name);
+
+/* sendText
+ *    Sends text as one message, a v1 frame or a v2 frame of one REC_PUBLIC
+ */
+void sendText(int sd, const char *text);
+
+/* runWorker
+ *    Thread body: paces its participants' messages and reads its observers
+ *    until the run is over
+ */
+void* runWorker(void *arg);
+
+/* queueMessages
+ *    Appends every message participant p is due to send by now to its buffer,
+ *    as v1 frames or as the records of one v2 frame
+ */
+void queueMessages(worker *w, benchPart *p, uint64_t now);
+
+/* flushPart
+ *    Writes participant p's buffered frames until the socket would block
+ */
+void flushPart(benchPart *p);
+
+/* readObs
+ *    Reads observer o until its socket would block, counting every message
+ *    and recording the latency of the ones a participant stamped
+ */
+void readObs(worker *w, benchObs *o);
+
+/* readStamp
+ *    text starts a message one of the participants sent, records its latency
+ */
+void readStamp(worker *w, const char *text, int len, uint64_t now);
+
+/* histRecord / histPercentile
+ *    Log-linear histogram, records a value / returns the value below which
+ *    fraction p of the recorded ones fall
+ */
+void histRecord(hist *h, uint64_t v);
+uint64_t histPercentile(hist *h, double p);
+
+/* nowNs
+ *    Helper function
+ *    Monotonic clock in nanoseconds
+ */
+uint64_t nowNs();
+
+/* serverRss
+ *    Helper function
+ *    Returns the resident set of process -p in kB, -1 if there is no -p or
+ *    it can't be read
+ */
+long serverRss();
+
+/* -------------------------------------------------------------------*/
+
+
+/* Global variables */
+struct sockaddr_in sad;    /* server address, ports filled in per connection */
+int tcpProto;
+int partTotal = 16;        /* synthetic participants */
+int obsTotal = -1;         /* synthetic observers, one per participant by default */
+int rate = 100;            /* messages per second per participant, 0 sends as fast as possible, -1 none */
+int msgSize = 64;          /* message length in bytes */
+int privatePct = 0;        /* percentage of messages sent @ another participant */
+double duration = 10;      /* seconds of sending */
+int threads = 1;
+char *prefix = "b";        /* names are prefix + participant number */
+int version = 1;           /* protocol spoken by every connection */
+int roomTotal = 1;         /* rooms the participants are spread over */
+int serverPid = 0;         /* -p, the server process whose RSS is sampled, 0 for none */
+volatile bool sending = true;
+volatile bool running = true;
+
+int main(int argc, char** argv) {
+  struct hostent *ptrh; 		/* pointer to a host table entry */
+  struct protoent *ptrp; 		/* pointer to a protocol table entry */
+  uint16_t participantPort;
+  uint16_t observerPort;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "c:o:r:s:m:d:t:n:v:g:p:")) != -1) {
+    switch (opt) {
+      case 'c':
+        partTotal = atoi(optarg);
+        break;
+      case 'o':
+        obsTotal = atoi(optarg);
+        break;
+      case 'r':
+        rate = atoi(optarg);
+        break;
+      case 's':
+        msgSize = atoi(optarg);
+        break;
+      case 'm':
+        privatePct = atoi(optarg);
+        break;
+      case 'd':
+        duration = atof(optarg);
+        break;
+      case 't':
+        threads = atoi(optarg);
+        break;
+      case 'n':
+        prefix = optarg;
+        break;
+      case 'v':
+        version = atoi(optarg);
+        break;
+      case 'g':
+        roomTotal = atoi(optarg);
+        break;
+      case 'p':
+        serverPid = atoi(optarg);
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
+
+  if( argc - optind != 3 ) {
+    fprintf(stderr,"Error: Wrong number of arguments\n");
+    fprintf(stderr,"usage:\n");
+    fprintf(stderr,"./bench [-c participants] [-o observers] [-r msgs_per_sec] [-s msg_bytes]\n");
+    fprintf(stderr,"        [-m private_percent] [-d seconds] [-t threads] [-n name_prefix] [-v 1|2]\n");
+    fprintf(stderr,"        [-g rooms] [-p server_pid]\n");
+    fprintf(stderr,"        server_address participant_port observer_port\n");
+    exit(EXIT_FAILURE);
+  }
+  argv += optind - 1;
+
+  if (obsTotal < 0) {
+    obsTotal = partTotal;
+  }
+  if (partTotal < 1 || obsTotal > partTotal || threads < 1 || rate < -1 || duration <= 0 ||
+      privatePct < 0 || privatePct > 100 || version < 1 || version > 2 || roomTotal < 1) {
+    fprintf(stderr,"Error: Bad counts, need 1+ participants, no more observers than participants\n");
+    exit(EXIT_FAILURE);
+  }
+  if (strlen(prefix) + snprintf(NULL, 0, "%d", partTotal - 1) > 10) {
+    fprintf(stderr,"Error: Names would be longer than 10 characters\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // room for the timestamp, and under the server's limit
+  if (msgSize < 24 || msgSize >= MAXMSG) {
+    fprintf(stderr,"Error: Message size must be 24-%d bytes\n", MAXMSG - 1);
+    exit(EXIT_FAILURE);
+  }
+
+  participantPort = atoi(argv[2]);
+  observerPort = atoi(argv[3]);
+  if (participantPort == 0 || observerPort == 0) {
+    fprintf(stderr,"Error: bad port number\n");
+    exit(EXIT_FAILURE);
+  }
+
+  memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
+  sad.sin_family = AF_INET; 					/* set family to Internet */
+  ptrh = gethostbyname(argv[1]);
+  if ( ptrh == NULL ) {
+    fprintf(stderr,"Error: Invalid host: %s\n", argv[1]);
+    exit(EXIT_FAILURE);
+  }
+  memcpy(&sad.sin_addr, ptrh->h_addr, ptrh->h_length);
+  if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0) {
+    fprintf(stderr, "Error: Cannot map \"tcp\" to protocol number");
+    exit(EXIT_FAILURE);
+  }
+  tcpProto = ptrp->p_proto;
+
+  // a soak holds two descriptors per pair
+  struct rlimit fds;
+  if (getrlimit(RLIMIT_NOFILE, &fds) == 0 && fds.rlim_cur < fds.rlim_max) {
+    fds.rlim_cur = fds.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fds);
+  }
+  long rssBefore = serverRss();
+
+  worker *workers = calloc(threads, sizeof(worker));
+  if (workers == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+
+  // deal the connections out round robin, joining every participant before
+  // any observer asks for one
+  for (int i = 0; i < threads; i++) {
+    workers[i].parts = calloc(partTotal / threads + 1, sizeof(benchPart));
+    workers[i].obs = calloc(obsTotal / threads + 1, sizeof(benchObs));
+    workers[i].epfd = epoll_create1(0);
+    if (workers[i].parts == NULL || workers[i].obs == NULL || workers[i].epfd < 0) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+
+  char name[32];
+  for (int i = 0; i < partTotal; i++) {
+    worker *w = &workers[i % threads];
+    benchPart *p = &w->parts[w->partCount++];
+    p->index = i;
+    p->sd = dial(participantPort);
+    snprintf(name, sizeof(name), "%s%d", prefix, i);
+    if (pickName(p->sd, name) != 'Y') {
+      fprintf(stderr, "Error: Server refused participant name %s\n", name);
+      exit(EXIT_FAILURE);
+    }
+    int one = 1;
+    setsockopt(p->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    // participant i talks in room i % rooms, its observer follows it there
+    if (roomTotal > 1) {
+      snprintf(name, sizeof(name), "/join g%d", i % roomTotal);
+      sendText(p->sd, name);
+    }
+  }
+  for (int i = 0; i < obsTotal; i++) {
+    worker *w = &workers[i % threads];
+    benchObs *o = &w->obs[w->obsCount++];
+    o->sd = dial(observerPort);
+    snprintf(name, sizeof(name), "%s%d", prefix, i);
+    if (pickName(o->sd, name) != 'Y') {
+      fprintf(stderr, "Error: Server refused observer for %s\n", name);
+      exit(EXIT_FAILURE);
+    }
+  }
+  printf("connected %d participants and %d observers\n", partTotal, obsTotal);
+  if (rssBefore >= 0) {
+    printf("server RSS %ld kB before connecting, %ld kB now\n", rssBefore, serverRss());
+  }
+  fflush(stdout);
+
+  // everything is registered before any thread starts
+  for (int i = 0; i < threads; i++) {
+    worker *w = &workers[i];
+    for (int k = 0; k < w->partCount + w->obsCount; k++) {
+      struct epoll_event ev;
+      memset(&ev, 0, sizeof(ev));
+      int sd;
+      if (k < w->partCount) {
+        sd = w->parts[k].sd;
+        ev.events = EPOLLOUT | EPOLLET;
+        ev.data.u64 = k;
+      }
+      else {
+        sd = w->obs[k - w->partCount].sd;
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = ((uint64_t)1 << 32) | (k - w->partCount);
+      }
+      fcntl(sd, F_SETFL, fcntl(sd, F_GETFL, 0) | O_NONBLOCK);
+      if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, sd, &ev) < 0) {
+        perror("epoll_ctl");
+        exit(1);
+      }
+    }
+  }
+
+  uint64_t start = nowNs();
+  for (int i = 0; i < threads; i++) {
+    if (pthread_create(&workers[i].thread, NULL, runWorker, &workers[i]) != 0) {
+      fprintf(stderr, "Error: Thread creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  // progress once a second
+  long lastSent = 0;
+  long lastReceived = 0;
+  for (int sec = 1; sec <= (int)duration; sec++) {
+    sleep(1);
+    long sent = 0;
+    long received = 0;
+    for (int i = 0; i < threads; i++) {
+      sent += __atomic_load_n(&workers[i].sent, __ATOMIC_RELAXED);
+      received += __atomic_load_n(&workers[i].received, __ATOMIC_RELAXED);
+    }
+    printf("%3ds  sent %8ld msgs/s  delivered %9ld msgs/s", sec, sent - lastSent, received - lastReceived);
+    long rss = serverRss();
+    if (rss >= 0) {
+      printf("  server RSS %ld kB", rss);
+    }
+    printf("\n");
+    fflush(stdout);
+    lastSent = sent;
+    lastReceived = received;
+  }
+  double rest = duration - (int)duration;
+  if (rest > 0) {
+    usleep(rest * 1000000);
+  }
+
+  sending = false;
+  double elapsed = (nowNs() - start) / 1e9;
+  usleep(DRAINMS * 1000);
+  running = false;
+
+  hist *all = calloc(1, sizeof(hist));
+  if (all == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  long sent = 0;
+  long skipped = 0;
+  long received = 0;
+  long bytes = 0;
+  for (int i = 0; i < threads; i++) {
+    pthread_join(workers[i].thread, NULL);
+    sent += workers[i].sent;
+    skipped += workers[i].skipped;
+    received += workers[i].received;
+    bytes += workers[i].bytes;
+    for (int b = 0; b < HISTBUCKETS; b++) {
+      all->counts[b] += workers[i].latency.counts[b];
+    }
+    all->total += workers[i].latency.total;
+    if (workers[i].latency.max > all->max) {
+      all->max = workers[i].latency.max;
+    }
+  }
+
+  printf("\n%d participants, %d observers, %d rooms, %d threads, %d byte messages, %d%% private, %.2fs\n",
+         partTotal, obsTotal, roomTotal, threads, msgSize, privatePct, elapsed);
+  printf("sent:      %ld msgs, %.0f msgs/s", sent, sent / elapsed);
+  if (skipped > 0) {
+    printf(" (%ld more were due but the socket was full)", skipped);
+  }
+  printf("\ndelivered: %ld msgs, %.0f msgs/s, %.2f MB/s\n", received, received / elapsed, bytes / elapsed / 1e6);
+  printf("latency:   p50 %lu us, p99 %lu us, p999 %lu us, max %lu us (%lu samples)\n",
+         histPercentile(all, 0.50), histPercentile(all, 0.99), histPercentile(all, 0.999),
+         all->max, all->total);
+
+  // what the connections cost the server, still held
+  long rssAfter = serverRss();
+  if (rssBefore >= 0 && rssAfter >= 0) {
+    printf("server RSS: %ld kB before connecting, %ld kB at the end, %ld bytes per connection\n",
+           rssBefore, rssAfter, (rssAfter - rssBefore) * 1024 / (partTotal + obsTotal));
+  }
+  return 0;
+}
+
+int dial(uint16_t port) {
+  struct sockaddr_in addr = sad;
+  addr.sin_port = htons(port);
+
+  int sd = socket(PF_INET, SOCK_STREAM, tcpProto);
+  if (sd < 0) {
+    fprintf(stderr, "Error: Socket creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  if (connect(sd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+    fprintf(stderr,"connect failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  char buf;
+  if (recv(sd, &buf, sizeof(char), MSG_WAITALL) != 1 || buf != 'Y') {
+    fprintf(stderr, "Error: Server is full\n");
+    exit(EXIT_FAILURE);
+  }
+  return sd;
+}
+
+char pickName(int sd, const char *name) {
+  if (version == 2) {
+    char hello[] = {PROTO_HELLO, 2};
+    char reply[2] = {0};
+    send(sd, hello, sizeof(hello), 0);
+    if (recv(sd, reply, sizeof(reply), MSG_WAITALL) != 2 || reply[0] != 'V' || reply[1] != 2) {
+      fprintf(stderr, "Error: Server doesn't speak protocol v2\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  char frame[11];
+  frame[0] = strlen(name);
+  memcpy(frame + 1, name, frame[0]);
+  send(sd, frame, 1 + frame[0], 0);
+
+  char buf = 'N';
+  recv(sd, &buf, sizeof(char), MSG_WAITALL);
+  return buf;
+}
+
+void sendText(int sd, const char *text) {
+  char frame[V2HEADER + V2RECORD + MAXMSG];
+  uint16_t len = strlen(text);
+  int frameLength;
+  if (version == 1) {
+    memcpy(frame, &len, sizeof(uint16_t));
+    memcpy(frame + sizeof(uint16_t), text, len);
+    frameLength = sizeof(uint16_t) + len;
+  }
+  else {
+    uint32_t recordsLength = htonl(V2RECORD + len);
+    uint16_t bodyLength = htons(len);
+    memcpy(frame, &recordsLength, V2HEADER);
+    frame[V2HEADER] = REC_PUBLIC;
+    memcpy(frame + V2HEADER + 1, &bodyLength, sizeof(uint16_t));
+    memcpy(frame + V2HEADER + V2RECORD, text, len);
+    frameLength = V2HEADER + V2RECORD + len;
+  }
+  send(sd, frame, frameLength, 0);
+}
+
+void* runWorker(void *arg) {
+  worker *w = arg;
+  struct epoll_event ready[MAXEVENTS];
+  uint64_t interval = rate > 0 ? 1000000000ull / rate : 0;
+  bool idle = rate < 0;
+
+  // spread the first sends over one interval so they don't all go at once
+  uint64_t now = nowNs();
+  w->seed = w->epfd;
+  for (int i = 0; i < w->partCount; i++) {
+    w->parts[i].nextSend = now + (interval > 0 ? rand_r(&w->seed) % interval : 0);
+  }
+
+  while (running) {
+
+    // sleep until the next message is due
+    int timeout = 100;
+    if (sending && !idle) {
+      now = nowNs();
+      uint64_t next = now + 100000000ull;
+      for (int i = 0; i < w->partCount; i++) {
+        if (w->parts[i].nextSend < next) {
+          next = w->parts[i].nextSend;
+        }
+      }
+      timeout = next > now ? (next - now) / 1000000 : 0;
+    }
+
+    int n = epoll_wait(w->epfd, ready, MAXEVENTS, timeout);
+    for (int e = 0; e < n; e++) {
+      int kind = ready[e].data.u64 >> 32;
+      int k = (uint32_t)ready[e].data.u64;
+      if (kind == 1) {
+        readObs(w, &w->obs[k]);
+      }
+      else {
+        flushPart(&w->parts[k]);
+      }
+    }
+
+    if (sending && !idle) {
+      now = nowNs();
+      for (int i = 0; i < w->partCount; i++) {
+        queueMessages(w, &w->parts[i], now);
+        flushPart(&w->parts[i]);
+      }
+    }
+  }
+  return NULL;
+}
+
+void queueMessages(worker *w, benchPart *p, uint64_t now) {
+  char message[MAXMSG];
+  char to[32];
+  int frameStart = -1;
+
+  while (p->nextSend <= now) {
+    int room = version == 2 ? V2HEADER + V2RECORD + 1 + 10 + msgSize : (int)sizeof(uint16_t) + msgSize;
+    if (p->outLen + room > OUTBUFSIZE) {
+      // flat out there is nothing to catch up on, otherwise the message is lost
+      if (rate > 0) {
+        w->skipped++;
+        p->nextSend += 1000000000ull / rate;
+        continue;
+      }
+      break;
+    }
+
+    // stamped with when it was due, or when it was made if there is no schedule
+    uint64_t stamp = rate > 0 ? p->nextSend : now;
+    int len = 0;
+    int toLength = 0;
+    if (privatePct > 0 && rand_r(&w->seed) % 100 < privatePct && partTotal > 1) {
+      int k = rand_r(&w->seed) % (partTotal - 1);
+      if (k >= p->index) {
+        k++;
+      }
+      toLength = snprintf(to, sizeof(to), "%s%d", prefix, k);
+    }
+
+    // the same msgSize bytes either way, v2 names the recipient outside the text
+    int size = msgSize;
+    if (toLength > 0 && version == 1) {
+      len = snprintf(message, sizeof(message), "@%s ", to);
+    }
+    else if (toLength > 0) {
+      size -= 1 + toLength;
+    }
+    len += snprintf(message + len, sizeof(message) - len, "t=%lu ", stamp);
+    memset(message + len, 'x', size > len ? size - len : 0);
+    len = size > len ? size : len;
+
+    if (version == 1) {
+      uint16_t messageLength = len;
+      memcpy(p->out + p->outLen, &messageLength, sizeof(uint16_t));
+      memcpy(p->out + p->outLen + sizeof(uint16_t), message, len);
+      p->outLen += sizeof(uint16_t) + len;
+    }
+
+    // one frame for everything due now, its length is filled in at the end
+    else {
+      if (frameStart < 0) {
+        frameStart = p->outLen;
+        p->outLen += V2HEADER;
+      }
+      uint16_t bodyLength = htons(len + (toLength > 0 ? 1 + toLength : 0));
+      char *out = p->out + p->outLen;
+      *out++ = toLength > 0 ? REC_PRIVATE : REC_PUBLIC;
+      memcpy(out, &bodyLength, sizeof(uint16_t));
+      out += sizeof(uint16_t);
+      if (toLength > 0) {
+        *out++ = toLength;
+        memcpy(out, to, toLength);
+        out += toLength;
+      }
+      memcpy(out, message, len);
+      p->outLen = out + len - p->out;
+    }
+    __atomic_fetch_add(&w->sent, 1, __ATOMIC_RELAXED);
+    p->nextSend = rate > 0 ? p->nextSend + 1000000000ull / rate : now + 1;
+  }
+
+  if (frameStart >= 0) {
+    uint32_t frameLength = htonl(p->outLen - frameStart - V2HEADER);
+    memcpy(p->out + frameStart, &frameLength, V2HEADER);
+  }
+}
+
+void flushPart(benchPart *p) {
+  int off = 0;
+  while (off < p->outLen) {
+    int n = send(p->sd, p->out + off, p->outLen - off, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "Error: Server closed a participant\n");
+      exit(EXIT_FAILURE);
+    }
+    off += n;
+  }
+  memmove(p->out, p->out + off, p->outLen - off);
+  p->outLen -= off;
+}
+
+void readObs(worker *w, benchObs *o) {
+  while (1) {
+    int n = recv(o->sd, o->in + o->inLen, INBUFSIZE - o->inLen, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
+    }
+    if (n <= 0) {
+      fprintf(stderr, "Error: Server closed an observer\n");
+      exit(EXIT_FAILURE);
+    }
+    o->inLen += n;
+    uint64_t now = nowNs();
+
+    // every complete v2 frame, and every record in it
+    int used = 0;
+    while (version == 2 && o->inLen - used >= V2HEADER) {
+      uint32_t frameLength;
+      memcpy(&frameLength, o->in + used, V2HEADER);
+      frameLength = ntohl(frameLength);
+      if (o->inLen - used < V2HEADER + (int)frameLength) {
+        break;
+      }
+      w->bytes += V2HEADER + frameLength;
+      char *rec = o->in + used + V2HEADER;
+      char *end = rec + frameLength;
+      while (rec + V2RECORD <= end) {
+        uint16_t len;
+        memcpy(&len, rec + 1, sizeof(uint16_t));
+        len = ntohs(len);
+        char *body = rec + V2RECORD;
+        __atomic_fetch_add(&w->received, 1, __ATOMIC_RELAXED);
+
+        // uint8_t length + sender + text, anything else is a notice
+        if ((rec[0] == REC_PUBLIC || rec[0] == REC_PRIVATE) && len > 0 && 1 + (uint8_t)body[0] <= len) {
+          readStamp(w, body + 1 + (uint8_t)body[0], len - 1 - (uint8_t)body[0], now);
+        }
+        rec = body + len;
+      }
+      used += V2HEADER + frameLength;
+    }
+
+    // every complete v1 frame
+    while (version == 1 && o->inLen - used >= (int)sizeof(uint16_t)) {
+      uint16_t len;
+      memcpy(&len, o->in + used, sizeof(uint16_t));
+      if (o->inLen - used < (int)sizeof(uint16_t) + len) {
+        break;
+      }
+      char *body = o->in + used + sizeof(uint16_t);
+      w->bytes += sizeof(uint16_t) + len;
+      __atomic_fetch_add(&w->received, 1, __ATOMIC_RELAXED);
+
+      // "<sender>: t=<ns> ..." from one of ours, anything else is a notice
+      char *text = memmem(body, len, ": t=", 4);
+      if (text != NULL) {
+        readStamp(w, text + 2, body + len - text - 2, now);
+      }
+      used += sizeof(uint16_t) + len;
+    }
+    memmove(o->in, o->in + used, o->inLen - used);
+    o->inLen -= used;
+  }
+}
+
+void readStamp(worker *w, const char *text, int len, uint64_t now) {
+  if (len < 2 || text[0] != 't' || text[1] != '=') {
+    return;
+  }
+  uint64_t sentAt = 0;
+  for (int i = 2; i < len && text[i] >= '0' && text[i] <= '9'; i++) {
+    sentAt = sentAt * 10 + (text[i] - '0');
+  }
+  histRecord(&w->latency, now > sentAt ? (now - sentAt) / 1000 : 0);
+}
+
+void histRecord(hist *h, uint64_t v) {
+  int b;
+  if (v < HISTSUB) {
+    b = v;
+  }
+  else {
+    // the power of two picks the group, the next bits below it the bucket
+    int top = 63 - __builtin_clzll(v);
+    b = (top - 3) * HISTSUB + ((v >> (top - 4)) & (HISTSUB - 1));
+  }
+  h->counts[b]++;
+  h->total++;
+  if (v > h->max) {
+    h->max = v;
+  }
+}
+
+uint64_t histPercentile(hist *h, double p) {
+  uint64_t want = (uint64_t)(p * h->total);
+  uint64_t seen = 0;
+  for (int b = 0; b < HISTBUCKETS; b++) {
+    seen += h->counts[b];
+    if (seen > want) {
+
+      // top of the bucket
+      if (b < HISTSUB) {
+        return b;
+      }
+      int top = b / HISTSUB + 3;
+      uint64_t sub = b % HISTSUB;
+      return ((HISTSUB + sub + 1) << (top - 4)) - 1;
+    }
+  }
+  return h->max;
+}
+
+uint64_t nowNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+long serverRss() {
+  if (serverPid <= 0) {
+    return -1;
+  }
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/%d/status", serverPid);
+  FILE *status = fopen(path, "r");
+  if (status == NULL) {
+    return -1;
+  }
+  char line[256];
+  long rss = -1;
+  while (fgets(line, sizeof(line), status) != NULL) {
+    if (sscanf(line, "VmRSS: %ld kB", &rss) == 1) {
+      break;
+    }
+  }
+  fclose(status);
+  return rss;
+}
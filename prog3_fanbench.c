@@ -0,0 +1,159 @@
+/* fanOut microbenchmark for prog3_server
+ *    Builds the server into the same program and times fanOut handing one
+ *    v1 frame to n observers of one room, in a single shard. The io_uring
+ *    backend is selected so queueFrame only queues, and no socket is touched.
+ *    Between broadcasts the queues are emptied and EVICTBYTES of unrelated
+ *    memory are written, so the client tables come from memory the way they
+ *    do after the rest of an event loop pass. The best of BESTOF runs is
+ *    reported, in nanoseconds per observer
+ *    With -s the room's subscriber list is shuffled first, the order it ends
+ *    up in after connections have come and gone
+ */
+#define main serverMain
+#include "prog3_server.c"
+#undef main
+
+/* Macros */
+#define EVICTBYTES (8 << 20) /* written between broadcasts, more than L2 holds */
+#define BESTOF 7             /* timed runs, the fastest one counts */
+#define BROADCASTS 4000000   /* observer visits per run, at least MINROUNDS broadcasts */
+#define MINROUNDS 20
+
+/* Prototypes --------------------------------------------------------*/
+
+/* addObservers
+ *    Sets up n observer slots and subscribes them to room 0
+ */
+void addObservers(int n);
+
+/* shuffleRoom
+ *    Puts room 0's subscriber list in a random order
+ */
+void shuffleRoom();
+
+/* timeFanOut
+ *    Broadcasts f to room 0 over and over, evicting the tables in between
+ *    Returns the nanoseconds per observer of the fastest of BESTOF runs
+ */
+double timeFanOut(frame *f, char *evict);
+
+/* -------------------------------------------------------------------*/
+
+
+int main(int argc, char** argv) {
+  bool shuffled = false;
+
+  int opt;
+  while ((opt = getopt(argc, argv, "s")) != -1) {
+    switch (opt) {
+      case 's':
+        shuffled = true;
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
+
+  if (argc - optind != 1) {
+    fprintf(stderr,"Error: Wrong number of arguments\n");
+    fprintf(stderr,"usage:\n");
+    fprintf(stderr,"./fanbench [-s] observers\n");
+    exit(EXIT_FAILURE);
+  }
+  int n = atoi(argv[optind]);
+  if (n < 1) {
+    fprintf(stderr,"Error: Need at least one observer\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // one shard, one room, and nothing else the server would set up
+  connMax = n;
+  backend = BACKEND_URING;
+  traceLevel = TRACE_OFF;
+  shardId = 0;
+  me = &shards[0];
+  maxRooms = 1;
+  rooms = calloc(maxRooms, sizeof(room));
+  subs = calloc(maxRooms, sizeof(subscribers));
+  cutRooms = malloc(sizeof(int) * maxRooms);
+  char *evict = malloc(EVICTBYTES);
+  if (rooms == NULL || subs == NULL || cutRooms == NULL || evict == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  initializeSDs();
+
+  // a 40 byte v1 frame
+  char message[38];
+  memset(message, 'x', sizeof(message));
+  frame *f = makeFrame(message, sizeof(message));
+
+  addObservers(n);
+  if (shuffled) {
+    shuffleRoom();
+  }
+  printf("%8d observers %s %6.1f ns per observer\n", n,
+         shuffled ? "shuffled" : "in order", timeFanOut(f, evict));
+  return 0;
+}
+
+void addObservers(int n) {
+  for (int i = 0; i < n; i++) {
+    if (freeObs == -1) {
+      growSlots(observers, obsCold, &oHigh, &freeObs, TAG_OBS);
+    }
+    int j = freeObs;
+    freeObs = obsCold[j].nextFree;
+
+    // a descriptor nothing is written to, io_uring only queues
+    observers[j].sdobs = 1000 + j;
+    observers[j].state = 1;
+    subscribeObs(j, 0);
+  }
+}
+
+void shuffleRoom() {
+  srand(1);
+  int *slots = subs[0].slots;
+  for (int i = subs[0].count - 1; i > 0; i--) {
+    int k = rand() % (i + 1);
+    int t = slots[i];
+    slots[i] = slots[k];
+    slots[k] = t;
+    obsCold[slots[i]].roomPos = i;
+    obsCold[slots[k]].roomPos = k;
+  }
+}
+
+double timeFanOut(frame *f, char *evict) {
+  int n = subs[0].count;
+  int rounds = BROADCASTS / n > MINROUNDS ? BROADCASTS / n : MINROUNDS;
+  double best = 0;
+
+  for (int run = 0; run < BESTOF; run++) {
+    uint64_t total = 0;
+    for (int r = 0; r < rounds; r++) {
+      uint64_t start = monoNs();
+      fanOut(f, 0, -1);
+      total += monoNs() - start;
+
+      // the frames would be written at the end of the pass, here they are
+      // just forgotten
+      for (int i = 0; i < dirtyCount; i++) {
+        client *c = &observers[dirty[i]];
+        c->outCount = 0;
+        c->outHead = 0;
+        c->dirty = false;
+      }
+      dirtyCount = 0;
+      f->refs = 1;
+      memset(evict, r, EVICTBYTES);
+    }
+    double perObserver = (double)total / rounds / n;
+    if (run == 0 || perObserver < best) {
+      best = perObserver;
+    }
+  }
+  return best;
+}
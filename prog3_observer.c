@@ -9,14 +9,74 @@
 #include <netdb.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <stdarg.h>
+#include <errno.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
 #define STDIN 0 // file descriptor for standard input
 #define TIMER 4 // time of how long should timer run for
+#define RINGSIZE (1 << 20) // receive buffer, every complete frame in it is handled per read
+#define OUTSIZE (1 << 16)  // terminal output collected before it is written
+#define OUTLINE 2048       // room left for the longest line before one is added
+
+// protocol v2 with compression, see the server for the wire format
+#define PROTO_HELLO 0xFF
+#define PROTO_COMPRESS 0xFE
+#define COMPRESS_DEFLATE 1
+#define V2RECORD 3
+#define REC_PUBLIC  1
+#define REC_PRIVATE 2
+#define REC_JOIN    3
+#define REC_LEAVE   4
+#define REC_OBSJOIN 5
+#define REC_WARNING 6
+#define REC_DEFLATE 7
+#define ZFLAG_RESET 1
+#define ZCHUNK 8192 // most record bytes one REC_DEFLATE inflates to
+#define ZDICT "Warning: user  doesn't exist...what about there just like know have this that with your from will they when them then been were would could should think good yeah okay thanks " \
+              "the and you for are not but all can get out"
 
 void printMessage();
 void funUsername(int sd);
 
+/* recvAll
+ *    Receives exactly len bytes, exits when the server goes away
+ */
+void recvAll(int sd, void *buf, int len);
+
+/* readMessages
+ *    Prints v1 messages, or v2 frames if v2 is set, until the server goes
+ *    away. Each recv takes as much as the ring has room for, every complete
+ *    frame in it is printed, and the output goes out in one write
+ */
+void readMessages(int sd, bool v2);
+
+/* printRecords
+ *    Prints the len bytes of records at buf the way v1 messages look,
+ *    inflating REC_DEFLATE bodies into more records
+ */
+void printRecords(const char *buf, int len);
+
+/* outPrintf / outWrite / outFlush
+ *    Collect terminal output in out, written to stdout by outFlush (or when
+ *    it fills up)
+ */
+void outPrintf(const char *format, ...);
+void outWrite(const char *data, int len);
+void outFlush();
+
 uint8_t nameLength = 0;
 char name[11];
+bool compressed = false; // -z, speaks v2 and asks for COMPRESS_DEFLATE
+#ifdef USE_ZLIB
+z_stream inflater;
+#endif
+char ring[RINGSIZE];  // ringHead..ringTail is what has arrived and hasn't been printed
+int ringHead = 0;
+int ringTail = 0;
+char out[OUTSIZE];
+int outLen = 0;
 
 void main(int argc, char** argv){
   struct hostent *ptrh; 		/* pointer to a host table entry */
@@ -29,12 +89,32 @@ void main(int argc, char** argv){
   memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
   sad.sin_family = AF_INET; 					/* set family to Internet */
 
-  if( argc != 3 ) {
+  int opt;
+  while ((opt = getopt(argc, argv, "z")) != -1) {
+    switch (opt) {
+      case 'z':
+        compressed = true;
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
+
+  if( argc - optind != 2 ) {
     fprintf(stderr,"Error: Wrong number of arguments\n");
     fprintf(stderr,"usage:\n");
-    fprintf(stderr,"./client server_address server_port\n");
+    fprintf(stderr,"./client [-z] server_address server_port\n");
     exit(EXIT_FAILURE);
   }
+  argv += optind - 1;
+
+#ifndef USE_ZLIB
+  if (compressed) {
+    fprintf(stderr,"Error: -z needs an observer built with -DUSE_ZLIB\n");
+    exit(EXIT_FAILURE);
+  }
+#endif
 
   /* Converts to binary and tests for legal value */
   port = atoi(argv[2]);
@@ -93,6 +173,35 @@ void main(int argc, char** argv){
 
   //need to prompt user for username
   if(*buf == 'Y'){
+
+    // ask for v2 and then compression, before the name
+    if (compressed) {
+      char hello[] = {PROTO_HELLO, 2};
+      send(sd, hello, sizeof(hello), 0);
+      recvAll(sd, buf, 2);
+      if (buf[0] != 'V' || buf[1] != 2) {
+        fprintf(stderr,"Error: Server doesn't speak protocol v2\n");
+        close(sd);
+        exit(1);
+      }
+      char ask[] = {PROTO_COMPRESS, COMPRESS_DEFLATE};
+      send(sd, ask, sizeof(ask), 0);
+      recvAll(sd, buf, 2);
+      if (buf[0] != 'Z') {
+        close(sd);
+        exit(1);
+      }
+      // without it the frames just come uncompressed
+      if (buf[1] != COMPRESS_DEFLATE) {
+        fprintf(stderr,"Server didn't agree to compression\n");
+      }
+#ifdef USE_ZLIB
+      if (inflateInit2(&inflater, -15) != Z_OK) {
+        printf("out of memory\n");
+        exit(1);
+      }
+#endif
+    }
     funUsername(sd);
 
     memset(buf, 0, sizeof(buf)*sizeof(char));
@@ -120,21 +229,10 @@ void main(int argc, char** argv){
     }
 
   }
-  //sending/receiving messages now
-  while(1){
-    uint16_t messageLength;
-    n = recv(sd, &messageLength, sizeof(uint16_t), 0); // this works
-    if (n <= 0){
-      //printf("I AM CLOSING THIS SOCKET IN OBSERVER TWO\n");
-      close(sd);
-      exit(1);
-    }
 
-    memset(buf, 0, sizeof(buf)*sizeof(char));
-    n = recv(sd, buf, sizeof(char)*messageLength, 0); // but for some reason this doesn't??
-
-    printf("%s\n", buf);
-  }
+  //receiving messages now
+  fflush(stdout);
+  readMessages(sd, compressed);
 }
 
 void funUsername(int sd) {
@@ -189,3 +287,179 @@ void funUsername(int sd) {
 
   //if we are about to disconnected change the state to 2
 }
+
+void recvAll(int sd, void *buf, int len) {
+  int got = 0;
+  while (got < len) {
+    int n = recv(sd, (char *)buf + got, len - got, 0);
+    if (n <= 0) {
+      close(sd);
+      exit(1);
+    }
+    got += n;
+  }
+}
+
+void readMessages(int sd, bool v2) {
+  int header = v2 ? sizeof(uint32_t) : sizeof(uint16_t);
+
+  while (1) {
+
+    // the partial frame left at the end wraps back to the front
+    if (ringHead == ringTail) {
+      ringHead = ringTail = 0;
+    }
+    else if (ringTail > RINGSIZE / 2) {
+      memmove(ring, ring + ringHead, ringTail - ringHead);
+      ringTail -= ringHead;
+      ringHead = 0;
+    }
+    int n = recv(sd, ring + ringTail, RINGSIZE - ringTail, 0);
+    if (n <= 0) {
+      outFlush();
+      close(sd);
+      exit(1);
+    }
+    ringTail += n;
+
+    // every frame that is all there
+    while (ringTail - ringHead >= header) {
+      uint32_t frameLength;
+      if (v2) {
+        memcpy(&frameLength, ring + ringHead, sizeof(uint32_t));
+        frameLength = ntohl(frameLength);
+      }
+      else {
+        uint16_t messageLength;
+        memcpy(&messageLength, ring + ringHead, sizeof(uint16_t));
+        frameLength = messageLength;
+      }
+      if (frameLength > RINGSIZE / 2 - header) {
+        fprintf(stderr,"Error: Frame of %u bytes from server is too big\n", frameLength);
+        exit(1);
+      }
+      if (ringTail - ringHead < header + (int)frameLength) {
+        break;
+      }
+      const char *body = ring + ringHead + header;
+      if (v2) {
+        printRecords(body, frameLength);
+      }
+      else {
+        if (outLen + (int)frameLength + 1 > OUTSIZE) {
+          outFlush();
+        }
+        outWrite(body, frameLength);
+        outWrite("\n", 1);
+      }
+      ringHead += header + frameLength;
+    }
+    outFlush();
+  }
+}
+
+void outPrintf(const char *format, ...) {
+  if (OUTSIZE - outLen < OUTLINE) {
+    outFlush();
+  }
+  va_list args;
+  va_start(args, format);
+  int n = vsnprintf(out + outLen, OUTSIZE - outLen, format, args);
+  va_end(args);
+  if (n > 0) {
+    outLen += n < OUTSIZE - outLen ? n : OUTSIZE - outLen - 1;
+  }
+}
+
+void outWrite(const char *data, int len) {
+  while (len > 0) {
+    if (outLen == OUTSIZE) {
+      outFlush();
+    }
+    int room = OUTSIZE - outLen < len ? OUTSIZE - outLen : len;
+    memcpy(out + outLen, data, room);
+    outLen += room;
+    data += room;
+    len -= room;
+  }
+}
+
+void outFlush() {
+  int done = 0;
+  while (done < outLen) {
+    int n = write(STDOUT_FILENO, out + done, outLen - done);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      exit(1);
+    }
+    done += n;
+  }
+  outLen = 0;
+}
+
+void printRecords(const char *buf, int len) {
+  int p = 0;
+  while (p + V2RECORD <= len) {
+    uint8_t type = buf[p];
+    uint16_t bodyLength;
+    memcpy(&bodyLength, buf + p + 1, sizeof(uint16_t));
+    bodyLength = ntohs(bodyLength);
+    if (p + V2RECORD + bodyLength > len) {
+      break;
+    }
+    const char *body = buf + p + V2RECORD;
+    p += V2RECORD + bodyLength;
+
+    switch (type) {
+      case REC_PUBLIC:
+      case REC_PRIVATE: {
+        uint8_t senderLength = bodyLength > 0 ? (uint8_t)body[0] : 0;
+        if (senderLength > 10 || 1 + senderLength > bodyLength) {
+          break;
+        }
+        outPrintf("%c%*s%.*s: %.*s\n", type == REC_PUBLIC ? '>' : '-', 11 - senderLength, "",
+               senderLength, body + 1, bodyLength - 1 - senderLength, body + 1 + senderLength);
+        break;
+      }
+      case REC_JOIN:
+        outPrintf("User %.*s has joined\n", bodyLength, body);
+        break;
+      case REC_LEAVE:
+        outPrintf("User %.*s has left\n", bodyLength, body);
+        break;
+      case REC_OBSJOIN:
+        outPrintf("A new observer has joined\n");
+        break;
+      case REC_WARNING:
+        outPrintf("%.*s\n", bodyLength, body);
+        break;
+#ifdef USE_ZLIB
+      case REC_DEFLATE: {
+        if (bodyLength < 1) {
+          break;
+        }
+        if (body[0] & ZFLAG_RESET) {
+          inflateReset(&inflater);
+          inflateSetDictionary(&inflater, (const Bytef *)ZDICT, sizeof(ZDICT) - 1);
+        }
+
+        // every body ends in a sync flush, so it inflates to whole records
+        char plain[ZCHUNK + 1];
+        inflater.next_in = (Bytef *)body + 1;
+        inflater.avail_in = bodyLength - 1;
+        inflater.next_out = (Bytef *)plain;
+        inflater.avail_out = sizeof(plain);
+        int ret = inflate(&inflater, Z_SYNC_FLUSH);
+        if ((ret != Z_OK && ret != Z_BUF_ERROR) || inflater.avail_in != 0) {
+          fprintf(stderr,"Error: Bad compressed data from server\n");
+          exit(1);
+        }
+        printRecords(plain, sizeof(plain) - inflater.avail_out);
+        break;
+      }
+#endif
+    }
+  }
+}
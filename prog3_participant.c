@@ -9,11 +9,42 @@
 #include <netdb.h>
 #include <stdbool.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <fcntl.h>
+#include <time.h>
+#include <errno.h>
 #define STDIN 0 // file descriptor for standard input
 #define TIMER 4 // time of how long should timer run for
+#define MAXMSG 1000           // the server disconnects messages this long or longer
+#define INBUFSIZE (1 << 16)   // input read at once by -n
+#define BATCHMAX 512          // messages per writev, two iovecs each stays within IOV_MAX
 
 void funUsername(int sd);
 
+/* validName
+ *    1 to 10 letters, digits or underscores, what the server accepts
+ */
+bool validName(const char *name);
+
+/* streamMessages
+ *    -n: sends every line read from in as a message, packed BATCHMAX at a
+ *    time into one writev, at most rate per second if rate is set
+ *    Empty lines are skipped, and so are lines too long for the server
+ */
+void streamMessages(int sd, int in, double rate);
+
+/* flushBatch
+ *    Writes the messages collected by streamMessages in one writev
+ */
+void flushBatch(int sd);
+
+char *botName = NULL;   // -n, name to take without asking, and then stream stdin
+char *inputFile = NULL; // -f, stream this file instead of stdin
+double sendRate = 0;    // -r, messages per second, 0 sends as fast as the socket takes them
+uint16_t lengths[BATCHMAX];           // length fields of the batch
+struct iovec batch[2 * BATCHMAX];     // length field and text of each message in the batch
+int batchCount = 0;
+
 void main(int argc, char** argv){
   struct hostent *ptrh; 		/* pointer to a host table entry */
   struct protoent *ptrp; 		/* pointer to a protocol table entry */
@@ -24,10 +55,46 @@ void main(int argc, char** argv){
   int n; 										/* number of characters read */
   memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
   sad.sin_family = AF_INET; 					/* set family to Internet */
-  if( argc != 3 ) {
+
+  int opt;
+  while ((opt = getopt(argc, argv, "n:f:r:")) != -1) {
+    switch (opt) {
+
+      // non-interactive, the name and then lines from stdin (or -f)
+      case 'n':
+        botName = optarg;
+        if (!validName(botName)) {
+          fprintf(stderr,"Error: Bad username %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'f':
+        inputFile = optarg;
+        break;
+      case 'r':
+        sendRate = atof(optarg);
+        if (sendRate < 0) {
+          fprintf(stderr,"Error: Bad rate %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      default:
+        argc = 0;
+        break;
+    }
+  }
+
+  if( argc - optind != 2 || ((inputFile != NULL || sendRate > 0) && botName == NULL) ) {
     fprintf(stderr,"Error: Wrong number of arguments\n");
     fprintf(stderr,"usage:\n");
-    fprintf(stderr,"./client server_address server_port\n");
+    fprintf(stderr,"./client [-n username [-f file] [-r msgs_per_sec]] server_address server_port\n");
+    exit(EXIT_FAILURE);
+  }
+  argv += optind - 1;
+
+  int in = STDIN;
+  if (inputFile != NULL && (in = open(inputFile, O_RDONLY)) < 0) {
+    fprintf(stderr,"Error: Cannot open %s\n", inputFile);
     exit(EXIT_FAILURE);
   }
 
@@ -79,6 +146,20 @@ void main(int argc, char** argv){
     exit(1);
   }
 
+  // the name comes from -n, and anything but 'Y' is the end
+  if(*buf == 'Y' && botName != NULL){
+    uint8_t nameLength = strlen(botName);
+    send(sd, &nameLength, sizeof(uint8_t), 0);
+    send(sd, botName, nameLength, 0);
+    n = recv(sd, &buf, sizeof(char), 0);
+    if (n <= 0 || *buf != 'Y') {
+      fprintf(stderr,"Error: Username %s was not accepted (%c)\n", botName, n > 0 ? *buf : '-');
+      close(sd);
+      exit(1);
+    }
+    streamMessages(sd, in, sendRate);
+  }
+
   //need to prompt user for username
   if(*buf == 'Y'){
     funUsername(sd);
@@ -165,25 +246,7 @@ void funUsername(int sd) {
         //printf("The name length i got was: %d \n", nameLength);
         //printf("the name i received was: %s \n", name);
 
-        bool validLength = true;
-        bool validChar = true;
-
-        //checking for valid length
-        if (nameLength > 10) {
-          validLength = false;
-        }
-        else{
-
-          //checking for valid character
-          for (int i = 0; i < nameLength; i++){
-            char currChar = name[i];
-            if (!(currChar == 95 || (currChar >= 48 && currChar <= 57) || (currChar >= 65 && currChar <= 90) || (currChar >= 97 && currChar <= 122))){
-              validChar = false;
-            }
-          }
-        }
-
-        if(validLength && validChar){
+        if(validName(name)){
           needName = false;
         }
       //}
@@ -196,3 +259,143 @@ void funUsername(int sd) {
   send(sd, name, sizeof(char)*nameLength, 0);
 
 }
+
+bool validName(const char *name) {
+  int nameLength = strlen(name);
+
+  //checking for valid length
+  if (nameLength < 1 || nameLength > 10) {
+    return false;
+  }
+
+  //checking for valid character
+  for (int i = 0; i < nameLength; i++){
+    char currChar = name[i];
+    if (!(currChar == 95 || (currChar >= 48 && currChar <= 57) || (currChar >= 65 && currChar <= 90) || (currChar >= 97 && currChar <= 122))){
+      return false;
+    }
+  }
+  return true;
+}
+
+void streamMessages(int sd, int in, double rate) {
+  char *inBuf = malloc(INBUFSIZE);
+  if (inBuf == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  int inLen = 0;
+  bool tooLong = false;  // the rest of a line that didn't fit is dropped
+  long sent = 0;
+  long skipped = 0;
+  struct timespec start;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  while (1) {
+    int n = read(in, inBuf + inLen, INBUFSIZE - inLen);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+
+    // a last line without a newline still counts
+    if (n <= 0 && inLen > 0 && !tooLong) {
+      inBuf[inLen++] = '\n';
+    }
+    if (n > 0) {
+      inLen += n;
+    }
+
+    // every complete line, the batch points straight into inBuf
+    int p = 0;
+    char *end;
+    while ((end = memchr(inBuf + p, '\n', inLen - p)) != NULL) {
+      char *line = inBuf + p;
+      int lineLength = end - line;
+      p += lineLength + 1;
+      if (lineLength > 0 && line[lineLength - 1] == '\r') {
+        lineLength--;
+      }
+      if (tooLong || lineLength >= MAXMSG) {
+        tooLong = false;
+        skipped++;
+        continue;
+      }
+      if (lineLength == 0) {
+        continue;
+      }
+
+      // not due yet, what is collected goes out and then it waits
+      if (rate > 0) {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double ahead = sent / rate - ((now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9);
+        if (ahead > 0) {
+          flushBatch(sd);
+          struct timespec wait = {(time_t)ahead, (long)((ahead - (time_t)ahead) * 1e9)};
+          nanosleep(&wait, NULL);
+        }
+      }
+
+      lengths[batchCount] = lineLength;
+      batch[2 * batchCount].iov_base = &lengths[batchCount];
+      batch[2 * batchCount].iov_len = sizeof(uint16_t);
+      batch[2 * batchCount + 1].iov_base = line;
+      batch[2 * batchCount + 1].iov_len = lineLength;
+      batchCount++;
+      sent++;
+      if (batchCount == BATCHMAX) {
+        flushBatch(sd);
+      }
+    }
+    flushBatch(sd);
+
+    // a full buffer without a newline is a line no message can hold
+    if (p == 0 && inLen == INBUFSIZE) {
+      tooLong = true;
+      inLen = 0;
+    }
+    else {
+      memmove(inBuf, inBuf + p, inLen - p);
+      inLen -= p;
+    }
+    if (n <= 0) {
+      skipped += tooLong;
+      break;
+    }
+  }
+
+  // waits for the server to have read everything before going away
+  shutdown(sd, SHUT_WR);
+  char drain[64];
+  while (recv(sd, drain, sizeof(drain), 0) > 0);
+  close(sd);
+  fprintf(stderr, "Sent %ld messages, skipped %ld too long for the server\n", sent, skipped);
+  exit(0);
+}
+
+void flushBatch(int sd) {
+  struct iovec *iov = batch;
+  int count = 2 * batchCount;
+  while (count > 0) {
+    ssize_t n = writev(sd, iov, count);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      fprintf(stderr,"Error: Lost the server\n");
+      exit(1);
+    }
+
+    // a short write carries on where it stopped
+    while (count > 0 && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov++;
+      count--;
+    }
+    if (count > 0) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  batchCount = 0;
+}
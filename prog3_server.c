@@ -5,1036 +5,6578 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <limits.h>
 #include <unistd.h>
 #include <signal.h>
 #include <time.h>
 #include <stdbool.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <sys/time.h>
+#include <sys/uio.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#ifndef USE_SELECT
+#include <sys/epoll.h>
+#endif
+#include <endian.h>
+#include <netinet/tcp.h>
+#ifdef USE_ZLIB
+#include <zlib.h>
+#endif
 
 /* Macros */
-#define QLEN 6      /* size of request queue */
-#define MAXSIZE 255 /* maximum number of participants/sockets */
+#define QLEN 1024   /* size of request queue */
+#define CONNMAX 4096 /* default participants (and as many observers) each shard may hold, -c */
+#define CONNLIMIT (1 << 20) /* most -c can ask for */
+#define SLOTCHUNK 256 /* slots set up at a time as a connection table grows */
 #define TIMER 4     /* time of how long should timer run for */
+#define WHEELTICK 10   /* milliseconds per timer wheel tick */
+#define WHEELBITS 8    /* each wheel level has 1 << WHEELBITS slots */
+#define WHEELLEVELS 3  /* 2.56 s per lap of the first level, ~46 hours for all three */
+#define WHEELSLOTS (1 << WHEELBITS)
+#define MAXEVENTS 64 /* ready sockets handled per loop iteration */
+#define MAXMSG 1000  /* participants are disconnected at or above this length */
+#define PARTIALSIZE (V2HEADER + V2RECORD + MAXMSG) /* largest v1 frame, or v2 record and its frame header, that can be cut off */
+#define READBUFSIZE 65536 /* bytes pulled off a socket per recv */
+#define READBUDGET 4 /* recvs per participant per wakeup before the others get a turn */
+#define QUEUEMAX 256 /* default frames an observer may fall behind by */
+#define FLUSHMAX 64  /* queued frames gathered into one writev */
+#define URINGIOV 1024  /* the same for each io_uring writev, IOV_MAX on Linux */
+#define ARENASIZE 16384 /* scratch space for assembling the messages of one frame */
+#define SLABFRAMES 32   /* frames carved out of each malloc by the frame pool */
+#define POOLCLASSES 5   /* frame size classes, see poolSizes */
+#define MAXSHARDS 64    /* most reactor threads -t can ask for */
+#define URINGENTRIES 4096 /* submission queue slots in each shard's io_uring */
+#define RECVBUFS 256      /* provided buffers per shard for io_uring reads, a power of two */
+#define RECVBUFSIZE 8192  /* bytes per provided buffer */
+#define HISTSUB 16        /* histogram buckets per power of two, so values are kept to ~6% */
+#define HISTBUCKETS (45 * HISTSUB) /* values up to 2^48 */
+#define DEFAULTROOM "lobby" /* where every participant starts, it never goes away */
+#define HISTORYMAX 20       /* default broadcasts each room remembers */
+#define HISTORYBYTES 16384  /* default bytes of them each room may hold on to */
+#define LOGSEGMENT (16 << 20) /* bytes of each message log segment file */
+#define LOGINDEXEVERY 64      /* log entries per sparse index entry */
+#define LOGSYNCMS 10          /* group commit interval of the log's sync thread */
+#define LOGSPARES 2           /* segments the sync thread keeps mapped ahead of the one appended to */
+#define LOGSCANMAX 65536      /* log entries a replay reads at most, it starts no further back */
+#define LOGREPLAYMAX 500      /* newest frames "/replay" sends */
+#define REPLAYGAPMS 2000      /* a participant's "/replay"s are at least this far apart */
+#define TRACERING 1024        /* records each thread's trace ring holds, a power of two */
+#define TRACESTR 32           /* bytes of the string a trace record carries, longer ones are cut */
+#define TRACERATE 100         /* records a second each trace call site may make */
+#define TRACEDRAINMS 10       /* how often the trace thread empties the rings */
+#define TRACEOUT 65536        /* bytes the trace thread formats before each write */
+#define TRACELINE 512         /* longest line one record becomes */
+#define MAXPEERS 16           /* most federation links, dialed (-P) and taken (-f) together */
+#define REMOTEUSERS 4         /* users of other nodes the username index makes room for, per local slot */
+#define FEDRETRYMS 1000       /* how long a -P link that is down waits before it is dialed again */
+#define FEDQUEUEMAX (16 << 20) /* bytes a federation link may fall behind by before it is dropped */
+#define FEDREADSIZE 65536     /* bytes of each federation link's input buffer */
+
+/* Wire protocol:
+ *    v1, what every client speaks unless it asks for more: a name is a uint8_t
+ *    length + name, and every message either way is a host order uint16_t
+ *    length + text
+ *    Before its name a client may send PROTO_HELLO and the version it wants,
+ *    and the server answers 'V' and the version it picked (at most PROTO_MAX)
+ *    v2: both ways a frame is a network order uint32_t length + that many
+ *    bytes of records, and a record is a uint8_t REC_ type + network order
+ *    uint16_t length + body. The server coalesces everything an observer gets
+ *    in one pass of the event loop into one frame
+ *    A v2 observer may then send PROTO_COMPRESS and the mode it wants, and
+ *    the server answers 'Z' and the mode it picked (COMPRESS_NONE unless
+ *    built with -DUSE_ZLIB)
+ */
+#define PROTO_HELLO 0xFF    /* a name length no v1 client sends */
+#define PROTO_MAX 2
+#define V2HEADER 4          /* uint32_t frame length */
+#define V2RECORD 3          /* uint8_t type + uint16_t length */
+#define V2FRAMEMAX (1 << 20) /* participants sending bigger frames are disconnected */
+#define V2BATCH 16384       /* frame pool class a v2 observer's records are coalesced into */
+#define PROTO_COMPRESS 0xFE /* also never a v1 name length */
+#define COMPRESS_NONE    0
+#define COMPRESS_DEFLATE 1
+
+/* v2 record types, with their bodies
+ *    participants send REC_PUBLIC (text, an "@name " in front still makes it
+ *    private like in v1) and REC_PRIVATE (uint8_t length + recipient + text)
+ *    observers get REC_PUBLIC and REC_PRIVATE as uint8_t length + sender + text,
+ *    REC_JOIN and REC_LEAVE as the name, REC_OBSJOIN empty and REC_WARNING as text
+ */
+#define REC_PUBLIC  1
+#define REC_PRIVATE 2
+#define REC_JOIN    3
+#define REC_LEAVE   4
+#define REC_OBSJOIN 5
+#define REC_WARNING 6
+#define REC_DEFLATE 7
+
+/* Compression:
+ *    observers that asked for COMPRESS_DEFLATE are the members of the
+ *    deflate group of their room in their shard. Broadcasts for them are collected once into the
+ *    group's pending records and compressed once per ZCHUNK (or whenever one
+ *    member has a record of its own, which goes in uncompressed so the order
+ *    holds), and the same REC_DEFLATE record is copied into every member's
+ *    batch. Its body is a ZFLAG_ byte + raw deflate data ending in a sync
+ *    flush, and inflating every REC_DEFLATE body in order yields plain records
+ *    The stream restarts from ZDICT whenever a member joins or loses queued
+ *    frames to its high-water mark, flagged with ZFLAG_RESET
+ */
+#define ZFLAG_RESET 1  /* reset the inflater and set ZDICT before this body */
+#define ZCHUNK 8192    /* pending record bytes compressed at once, fits one batch compressed */
+#define ZLEVEL 6
+#define ZDICT "Warning: user  doesn't exist...what about there just like know have this that with your from will they when them then been were would could should think good yeah okay thanks " \
+              "the and you for are not but all can get out"
+
+/* What happens when an observer's outbound queue is over its high-water mark */
+#define POLICY_DROP       0 /* drop the oldest queued frame */
+#define POLICY_DISCONNECT 1 /* disconnect the observer */
+
+/* Event loop backend:
+ *    edge-triggered epoll by default, every socket is registered once
+ *    compile with -DUSE_SELECT to fall back to select over persistent readSet
+ *    and writeSet, with maxFd kept current in pollDel, and pollWait scanning the
+ *    ready sets a word at a time
+ *    -b uring picks io_uring at startup instead: multishot accepts and reads into
+ *    a provided buffer ring, and every observer write of a loop pass goes to
+ *    the kernel in the same io_uring_enter that waits for the next completions
+ */
+#define BACKEND_POLL  0 /* epoll, or select with -DUSE_SELECT */
+#define BACKEND_URING 1
+
+/* Tags stored with every registered socket so a wakeup maps straight to its slot */
+#define TAG_PARTLISTEN 0
+#define TAG_OBSLISTEN  1
+#define TAG_PART       2
+#define TAG_OBS        3
+#define TAG_WAKE       4 /* the shard's wake pipe, other shards left it mail */
+#define TAG_OBSWRITE   5 /* io_uring only, a writev to an observer finished */
+#define TAG_IGNORE     6 /* io_uring only, cancellations nobody waits for */
+
+/* Sharding:
+ *    -t N runs N reactor threads, each with its own SO_REUSEPORT listeners,
+ *    connection tables, frame pool and event loop (everything declared
+ *    __thread below), so the kernel spreads connections over the threads
+ *    The username index is shared, and records which shard each participant
+ *    lives on. An observer is moved to its participant's shard when it
+ *    attaches, so everything about one user is handled by one thread
+ *    Anything else crossing shards goes through the target shard's mailbox
+ */
+
+/* Rooms:
+ *    a participant is in one room at a time, DEFAULTROOM until it sends
+ *    "/join name", and its observer follows it around. Public messages and
+ *    join/leave notices only go to the room they were sent in
+ *    Rooms get an id from a shared table for as long as they have
+ *    participants. Every shard keeps its own list of the observers in each
+ *    room, so a broadcast costs one send per member, and only the shards
+ *    flagged in the room's shard mask get mail
+ *    Each room also remembers its last broadcasts, the frames themselves
+ *    with their v2 records, and an observer that attaches or follows its
+ *    participant into the room is sent them first (see replayHistory)
+ */
+
+/* Federation:
+ *    with -f port the server takes federation links from other servers on
+ *    that port, and each -P host:port dials one (again every FEDRETRYMS while
+ *    it is down). Every pair of servers needs one link, dialed by either of
+ *    them, and nothing is passed on: a record goes from the node it happened
+ *    on straight to every other node, once per link, and each node fans it
+ *    out to its own observers like one of its own broadcasts
+ *    Both ways a record is a network order uint16_t length + FED_ type +
+ *    uint64_t wall clock nanoseconds when it left the node it happened on +
+ *    uint8_t length + a + uint8_t length + b + uint16_t length + text
+ *    The username index is also the directory: users of other nodes are in
+ *    it with the link they are reached through, and "@name" goes down that
+ *    one link. A link that comes up starts with a FED_HELLO carrying the
+ *    node's id, then a FED_ONLINE for every local user, and one that goes
+ *    down takes its users out of the index
+ *    Two nodes can let users take the same name before either hears of the
+ *    other's. The claim of the node with the lower id stands everywhere: a
+ *    local user that loses is disconnected (MAIL_EVICT), and a remote claim
+ *    that loses is ignored, since its own node disconnects that user
+ *    The federation thread does all the link I/O. The shards hand it their
+ *    records once per pass (see flushMail), and it mails what arrives to the
+ *    shard the room hashes to or the recipient lives on, one MAIL_REMOTE per
+ *    shard per pass (see deliverRemote)
+ */
+#define FED_ONLINE  1 /* a: user now on the sender */
+#define FED_OFFLINE 2 /* a: user that left it */
+#define FED_JOIN    3 /* a: room, b: user that came into it */
+#define FED_LEAVE   4 /* a: room, b: user that left it */
+#define FED_PUBLIC  5 /* a: room, b: sender, text */
+#define FED_PRIVATE 6 /* a: recipient, b: sender, text, only sent down the recipient's link */
+#define FED_HELLO   7 /* a: the sender's node id in decimal, first on every link */
+#define FEDFIXED (sizeof(uint8_t) + sizeof(uint64_t) + 2 * sizeof(uint8_t) + sizeof(uint16_t))
+#define FEDRECORDMAX (sizeof(uint16_t) + FEDFIXED + 20 + MAXMSG)
+
+/* Message log:
+ *    with -l dir every broadcast is also appended to the log in dir, a run
+ *    of LOGSEGMENT byte segment files (00000000.log, 00000001.log, ...)
+ *    mapped into memory. An append is a memcpy under logLock, and nothing on
+ *    the message path touches the disk: the sync thread msyncs whatever was
+ *    appended every LOGSYNCMS, keeps LOGSPARES segments mapped ahead and
+ *    retires full ones. A broadcast that fills a segment while no spare is
+ *    ready is left out of the log rather than waiting for one
+ *    An entry is a logHeader + the v1 frame + the v2 record, padded to 8
+ *    bytes, and its len is stored last, so a zero len ends the segment
+ *    Every LOGINDEXEVERY-th entry (and the first of each segment) goes in the
+ *    sparse index, kept in memory and in a .idx file next to its segment once
+ *    the entries it points to are synced. On restart the index is read back,
+ *    the last segment is scanned from its last index entry, and the lobby's
+ *    history is refilled from the log. "/replay seconds" sends an observer what
+ *    its room said in that time, found through the index. The shard only
+ *    queues the request: the reader thread does the disk reads and mails the
+ *    entries back (MAIL_REPLAY), where they are turned into frames again
+ */
 
-/* client struct fields:
+/* Metrics:
+ *    every shard keeps its own counters and histograms, and only its own
+ *    thread writes them (COUNT), so the message path takes no lock and no
+ *    locked instruction. The admin thread (-a) and SIGUSR1 sum them up
+ *    whenever someone asks
+ */
+#define COUNT(field, n) __atomic_store_n(&me->stats.field, me->stats.field + (n), __ATOMIC_RELAXED)
+
+/* Trace:
+ *    what the server has to say about itself goes through TRACE, at one of
+ *    the levels below, and -v picks the lowest one that is kept. A call site
+ *    below it costs a compare and a branch. One that is kept copies the call
+ *    site, two numbers and a short string into its thread's trace ring and
+ *    goes on, it never formats, writes or waits: a full ring drops the record,
+ *    and each call site keeps at most TRACERATE records a second
+ *    The trace thread empties every ring each TRACEDRAINMS, formats the
+ *    records against their call site's format (%d, %ld and %lu take a and
+ *    then b, %s takes str) and hands them to stdout in one write
+ */
+#define TRACE_DEBUG 0
+#define TRACE_INFO  1
+#define TRACE_WARN  2
+#define TRACE_OFF   3 /* -v off, nothing is kept */
+#define TRACE(level, fmt, str, a, b) do { \
+    static traceSite traceHere = {fmt, level, 0, 0, 0}; \
+    if ((level) >= traceLevel) { \
+      traceRecord(&traceHere, str, a, b); \
+    } \
+  } while (0)
+
+/* Handshake outcomes, the reply to a name or the deadline passing */
+#define HS_Y       0
+#define HS_T       1
+#define HS_I       2
+#define HS_N       3
+#define HS_TIMEOUT 4
+#define HS_KINDS   5
+
+/* Kinds of mail one shard can leave for another */
+#define MAIL_BROADCAST 0 /* send f to every attached observer */
+#define MAIL_PRIVATE   1 /* send f to the observer of participant name */
+#define MAIL_ADOPT     2 /* observer socket sd asked for participant name, who lives here */
+#define MAIL_REMOTE    3 /* f is records from other nodes for this shard, see deliverRemote */
+#define MAIL_REPLAY    4 /* f is log entries the reader thread found for observer slot sd */
+#define MAIL_EVICT     5 /* participant slot sd, called name, lost its name to another node */
+
+/* client struct fields, what the broadcast path and the readiness scans
+read for every connection, packed into one cache line (the rest is in clientCold):
+- outq: observers only, ring of frames waiting for the socket to be writable,
+allocated the first time a frame can't be written straight away
+- batch: v2 observers only, frame collecting this pass's records, sent by
+flushBatches at the end of the pass
 - sdparts: if participant, tells you what socket you are
 if observer, tells you if you are connected to a participant
 - sdobs: if participant, tells you if you are connected to a participant
 if observer, tells you what socket you are
-- name: tells you your name
 - state: just connected (0)
 active (1)
 not connected (-1)
+- room: participants, id of the room it is in (-1 until it has a name),
+observers, id of the room whose subscribers it is on (-1 if none)
+- outHead: index of the oldest queued frame in outq
+- outCount: how many frames are queued
+- outOffset: bytes of the oldest frame already written
+- outCap: frames outq holds, queueMax except when io_uring had to grow it
+- gen: bumped every time the slot is reset, so io_uring completions meant for
+the socket that had the slot before are recognised and ignored
+- version: protocol version it negotiated, 1 unless it sent PROTO_HELLO
+- compress: observers only, COMPRESS_ mode it negotiated
+- inGroup: attached with COMPRESS_DEFLATE, so broadcasts reach it through
+its shard's deflate group
+- synced: in the group and has had every REC_DEFLATE since the last reset,
+it gets none until the next reset otherwise
+- dirty: io_uring only, frames were queued this pass and it is in dirty[]
+- batched: v2 observers only, opened a batch this pass and is in batched[]
+*/
+
+/* clientCold struct fields, the same slot's state that only its own
+handshake, reads and writes need:
+- name: tells you your name
+- handshake: armed while state is 0, the client is dropped if it hasn't
+picked a name by the time it fires
+- partial: bytes of a frame that has not fully arrived yet,
+allocated the first time a frame is cut off
+- partialLen: how many bytes of partial are in use
+- frameLeft: v2 participants only, bytes of records left in the frame being read
+- backlogged: participants only, used up its read budget with input left,
+so it is in backlog[] for another turn
+- nextFree: while the slot is unused, the next unused slot (-1 ends the list)
+- roomPos: observers only, its index in that room's subscribers
+- obs: participants only, slot of its observer (always in this shard), -1 if none
+- replayAt: participants only, monoMs before which another "/replay" is refused
+- outSending: io_uring only, how many queued frames the writevs in flight cover
+- outPieces: io_uring only, linked writevs in flight that haven't completed
+- outWritten: io_uring only, bytes the completed ones wrote
+- iovCap: io_uring only, entries iov holds
+- iov: io_uring only, the iovecs of that writev, allocated along with outq
 */
+typedef struct frame frame;
+
+/* timer fields:
+- next / pprev: links in its timer wheel slot, pprev is NULL while it isn't armed
+- expires: the wheel tick it fires on
+- tag / slot: the client it belongs to (TAG_PART or TAG_OBS, and its index)
+*/
+typedef struct timer{
+  struct timer *next;
+  struct timer **pprev;
+  uint64_t expires;
+  int tag;
+  int slot;
+} timer;
+
 typedef struct client{
+  frame **outq;
+  frame *batch;
   int sdparts;
   int sdobs;
-  char name[11];
   int state;
-  double time;
-  struct timeval start;
-  struct timeval end;
+  int room;
+  int outHead;
+  int outCount;
+  int outOffset;
+  int outCap;
+  unsigned int gen;
+  int version;
+  int compress;
+  bool inGroup;
+  bool synced;
+  bool dirty;
+  bool batched;
 } client;
 
+typedef struct clientCold{
+  char name[11];
+  timer handshake;
+  char *partial;
+  int partialLen;
+  uint32_t frameLeft;
+  bool backlogged;
+  int nextFree;
+  int roomPos;
+  int obs;
+  uint64_t replayAt;
+  int outSending;
+  int outPieces;
+  int outWritten;
+  int iovCap;
+  struct iovec *iov;
+} clientCold;
+
+/* frame fields:
+- refs: how many observer queues, mailboxes (plus whoever built it) still point at it,
+only changed atomically since shards share frames
+- sizeClass: which pool free list it goes back to
+- owner: the shard whose pool it came from
+- next: links free frames in the pool
+- len: bytes in data
+- record: the same message as a v2 record, for v2 observers, released with it
+- data: uint16_t length followed by the message, written to the socket as is
+(a record or a v2 frame, for the frames made by makeRecord and batchRecord)
+*/
+struct frame{
+  int refs;
+  int sizeClass;
+  int owner;
+  frame *next;
+  int len;
+  frame *record;
+  char data[];
+};
+
+/* nameEntry fields:
+- name: username of an active participant, empty if the slot is free
+- shard: the shard that participant (and its observer) lives on
+- part: index of that participant in the shard's participants
+- obs: index of its observer in the shard's observers, -1 if it has none
+- peer: -1 for this node's participants, for a user of another node the
+federation link it is reached through (shard, part and obs are -1 then)
+*/
+typedef struct nameEntry{
+  char name[11];
+  int shard;
+  int part;
+  int obs;
+  int peer;
+} nameEntry;
+
+/* room fields:
+- name: the room's name, empty while the id is unused
+- members: participants in it, guarded by roomLock
+- gen: bumped every time the id goes to a new room, so mail for one that
+has gone away is recognised
+- shards: bit s is set while shard s has observers in it, changed atomically
+- nextFree: while the id is unused, the next unused id (-1 ends the list)
+- historyLock: guards the history fields, any shard may broadcast to the room
+- history: ring of its last historyMax broadcasts, allocated with the room
+- historyHead / historyCount: index of the oldest one and how many there are
+- historyBytes: bytes of frames and records the ring holds, at most historyBytesMax
+*/
+typedef struct historyEntry historyEntry;
+typedef struct room{
+  char name[11];
+  int members;
+  unsigned int gen;
+  uint64_t shards;
+  int nextFree;
+  pthread_mutex_t historyLock;
+  historyEntry *history;
+  int historyHead;
+  int historyCount;
+  long historyBytes;
+} room;
+
+/* historyEntry fields:
+- f: a broadcast frame, the ring holds a reference to it
+- at: when it was sent, monoMs
+*/
+struct historyEntry{
+  frame *f;
+  uint64_t at;
+};
+
+/* logHeader fields, at the start of every log entry:
+- len: bytes of the whole entry, a multiple of 8, 0 past the last one
+- frameLen / recordLen: bytes of the v1 frame and of the v2 record after it
+- seq: sequence number, one more than the entry before
+- at: when it was broadcast, wall clock milliseconds
+- room: name of the room it went to
+*/
+typedef struct logHeader{
+  uint32_t len;
+  uint16_t frameLen;
+  uint16_t recordLen;
+  uint64_t seq;
+  uint64_t at;
+  char room[11];
+} logHeader;
+
+/* logIndexEntry fields:
+- seq / at: of the entry it points to
+- segment / offset: where that entry is
+*/
+typedef struct logIndexEntry{
+  uint64_t seq;
+  uint64_t at;
+  uint32_t segment;
+  uint32_t offset;
+} logIndexEntry;
+
+/* logSegment fields:
+- number: its place in the log, also its file name
+- fd / idxFd: the segment file and its index file
+- map: the segment, LOGSEGMENT bytes mapped shared
+- synced: bytes of it the sync thread has msynced, only it touches this
+- end: bytes in use once it is full
+- next: links the retired segments, and the spares
+*/
+typedef struct logSegment{
+  int number;
+  int fd;
+  int idxFd;
+  char *map;
+  long synced;
+  long end;
+  struct logSegment *next;
+} logSegment;
+
+/* logRequest fields:
+- shard / obs / gen: the observer slot the entries go to, and its gen when asked
+- room: name of the room they are for
+- since: wall clock milliseconds, older entries are left out
+*/
+typedef struct logRequest{
+  int shard;
+  int obs;
+  unsigned int gen;
+  char room[11];
+  uint64_t since;
+} logRequest;
+
+/* roomEntry fields:
+- name: name of a room, empty if the slot is free
+- id: its index in rooms
+*/
+typedef struct roomEntry{
+  char name[11];
+  int id;
+} roomEntry;
+
+/* subscribers fields:
+- slots: this shard's observers in the room, in no particular order
+- count / cap: how many slots are in use / allocated
+- gen: the room's gen when its first observer here subscribed
+- group: USE_ZLIB only, deflate group of the compressing ones, NULL while
+there are none
+- cutQueued: the group has pending records and the room is in cutRooms
+*/
+typedef struct subscribers{
+  int *slots;
+  int count;
+  int cap;
+  unsigned int gen;
+  struct deflateGroup *group;
+  bool cutQueued;
+} subscribers;
+
+/* mail fields:
+- type: MAIL_BROADCAST, MAIL_PRIVATE, MAIL_ADOPT, MAIL_REMOTE, MAIL_REPLAY or
+MAIL_EVICT
+- f: frame to send (or the records of a MAIL_REMOTE, the log entries of a
+MAIL_REPLAY), the mail holds a reference to it
+- sd: MAIL_ADOPT, the observer socket being handed over, MAIL_REPLAY, the
+observer slot the entries go to, MAIL_EVICT, the participant slot that lost
+its name
+- gen: MAIL_REPLAY only, that slot's gen when the replay was asked for
+- version: MAIL_ADOPT only, the protocol version that observer negotiated
+- compress: MAIL_ADOPT only, the COMPRESS_ mode it negotiated
+- room / roomGen: MAIL_BROADCAST only, the room f is for and its gen when sent
+- name: recipient of a MAIL_PRIVATE, participant asked for by a MAIL_ADOPT,
+username another node took for a MAIL_EVICT
+*/
+typedef struct mail{
+  int type;
+  frame *f;
+  int sd;
+  int version;
+  int compress;
+  int room;
+  unsigned int roomGen;
+  unsigned int gen;
+  char name[11];
+} mail;
+
+/* mailbox fields:
+- items: mail waiting to be delivered, grown when full
+- count: how many are in use
+- cap: how many fit
+*/
+typedef struct mailbox{
+  mail *items;
+  int count;
+  int cap;
+} mailbox;
+
+/* histogram fields:
+- counts: log-linear buckets, values under HISTSUB have one each and every
+power of two above that is split into HISTSUB, see histRecord
+- count / sum: how many values were recorded and their total
+*/
+typedef struct histogram{
+  uint64_t counts[HISTBUCKETS];
+  uint64_t count;
+  uint64_t sum;
+} histogram;
+
+/* metrics fields:
+- participants / observers: live connections, refreshed every pass
+- handshakes: outcomes by HS_ kind, [0] participants and [1] observers
+- refused: connections turned away because the shard was full, same order
+- messagesIn / bytesIn: messages read from participants, bytes counting
+their length fields
+- messagesOut / bytesOut: frames and bytes written to observers
+- dropped: frames shed from queues over their high-water mark
+- sendErrors: writes to observers that failed for any reason but a full socket
+- allocs: mallocs the message path needed (frame pool misses, arena overflow)
+- compressIn / compressOut: record bytes fed to the deflate group and the
+REC_DEFLATE bytes that came out
+- compressNs: nanoseconds spent compressing
+- compressResets: times the deflate stream restarted
+- replayed: broadcasts sent to observers from room history or the log
+- logEntries / logBytes: entries and bytes appended to the message log
+- logDropped: broadcasts left out of the message log, no spare segment was ready
+- fanout: observers in this shard each broadcast went to
+- fanoutTime: nanoseconds fanOut took to hand a broadcast to them
+- queueDepth: frames already queued for an observer when another is sent to it
+- loopTime: nanoseconds spent handling one pass of the event loop
+- logAppendTime: nanoseconds each append to the message log took
+- fedHop: nanoseconds from a record leaving the node it happened on to this
+shard having fanned it out
+*/
+typedef struct metrics{
+  long participants;
+  long observers;
+  long handshakes[2][HS_KINDS];
+  long refused[2];
+  long messagesIn;
+  long bytesIn;
+  long messagesOut;
+  long bytesOut;
+  long dropped;
+  long sendErrors;
+  long allocs;
+  long compressIn;
+  long compressOut;
+  long compressNs;
+  long compressResets;
+  long replayed;
+  long logEntries;
+  long logBytes;
+  long logDropped;
+  histogram fanout;
+  histogram fanoutTime;
+  histogram queueDepth;
+  histogram loopTime;
+  histogram logAppendTime;
+  histogram fedHop;
+} metrics;
+
+/* shard fields:
+- thread: the reactor thread running it
+- wake: pipe, a byte in wake[1] wakes its event loop up
+- lock: guards inbox
+- inbox: mail left by other shards
+- remoteFree: frames from its pool released by other shards, a lock-free stack
+- stats: its metrics, written by its own thread only
+*/
+typedef struct shard{
+  pthread_t thread;
+  int wake[2];
+  pthread_mutex_t lock;
+  mailbox inbox;
+  frame *remoteFree;
+  metrics stats;
+} shard;
+
+#ifdef USE_ZLIB
+/* deflateGroup fields:
+- z: the group's deflate stream, raw deflate with ZDICT as its dictionary
+- members: observers in the group, it is freed when the last one leaves
+- resetPending: the next chunk restarts the stream, see cutShared
+- pending / pendingLen: records waiting to be compressed
+*/
+typedef struct deflateGroup{
+  z_stream z;
+  int members;
+  bool resetPending;
+  char pending[ZCHUNK];
+  int pendingLen;
+} deflateGroup;
+#endif
+
+/* arenaBlock fields:
+- next: the arena's overflow blocks, freed on the next arenaReset
+- data: the block itself
+*/
+typedef struct arenaBlock{
+  struct arenaBlock *next;
+  char data[];
+} arenaBlock;
+
+/* uring fields:
+- fd: the io_uring instance
+- sqHead, sqTail, sqMask, sqArray: the submission ring shared with the kernel
+- sqes: submission queue entries
+- tail: next free submission slot, published to *sqTail on io_uring_enter
+- cqHead, cqTail, cqMask, cqes: the completion ring shared with the kernel
+- bufRing: provided buffers the kernel picks from for reads
+- bufs: memory behind bufRing, RECVBUFS buffers of RECVBUFSIZE
+- bufTail: next free entry of bufRing
+- partListen / obsListen: listening sockets, their multishot accepts are
+re-armed if the kernel ends them
+*/
+typedef struct uring{
+  int fd;
+  unsigned *sqHead;
+  unsigned *sqTail;
+  unsigned *sqMask;
+  unsigned *sqArray;
+  unsigned sqEntries;
+  struct io_uring_sqe *sqes;
+  unsigned tail;
+  unsigned *cqHead;
+  unsigned *cqTail;
+  unsigned *cqMask;
+  struct io_uring_cqe *cqes;
+  struct io_uring_buf_ring *bufRing;
+  char *bufs;
+  unsigned short bufTail;
+  int partListen;
+  int obsListen;
+} uring;
+
+/* loopEvent fields:
+- tag: which kind of socket is ready (TAG_*)
+- slot: index into participants/observers for TAG_PART/TAG_OBS
+- readable: there is input (or EOF) to read
+- writable: observers only, the socket has room for queued frames
+*/
+typedef struct loopEvent{
+  int tag;
+  int slot;
+  bool readable;
+  bool writable;
+} loopEvent;
+
+/* traceSite fields, one per TRACE call site:
+- fmt / level: what it says and how loud
+- window: the second its count is for
+- count: records it made in that second, the ones past TRACERATE are not kept
+- suppressed: records not kept since the last one that was, that one says so
+*/
+typedef struct traceSite{
+  const char *fmt;
+  int level;
+  uint64_t window;
+  int count;
+  long suppressed;
+} traceSite;
+
+/* traceEntry fields, one record waiting in a trace ring:
+- site: the call site, for its format and level
+- at: monoNs when it was made
+- a / b / str: the arguments, str copied and cut to TRACESTR - 1 bytes
+- suppressed: records of the same site that were not kept before this one
+- shard: the shard that made it, -1 for the other threads
+*/
+typedef struct traceEntry{
+  traceSite *site;
+  uint64_t at;
+  long a;
+  long b;
+  long suppressed;
+  int shard;
+  char str[TRACESTR];
+} traceEntry;
+
+/* traceRing fields, one per thread that has traced, single producer and
+single consumer:
+- tail: next record its thread writes, only that thread moves it
+- head: next record the trace thread reads, only that thread moves it
+- dropped / suppressed: records it lost to a full ring / to TRACERATE,
+written by its own thread only
+- next: the list of every ring, see traceAttach
+- entries: the records, tail - head of them from head on
+*/
+typedef struct traceRing{
+  unsigned tail __attribute__((aligned(64)));
+  long dropped;
+  long suppressed;
+  unsigned head __attribute__((aligned(64)));
+  struct traceRing *next;
+  traceEntry entries[TRACERING];
+} traceRing;
+
+/* fedBuf fields, bytes collected for or by the federation thread:
+- data: the bytes, grown as needed
+- len / cap: how many are in use / allocated
+*/
+typedef struct fedBuf{
+  char *data;
+  int len;
+  int cap;
+} fedBuf;
+
+/* fedRecord fields, one record from another node, decoded (see Federation):
+- type: FED_ type
+- sentAt: wall clock nanoseconds it left the node it happened on
+- a / b / text: its fields, each ending in a NUL
+*/
+typedef struct fedRecord{
+  uint8_t type;
+  uint64_t sentAt;
+  char a[11];
+  char b[11];
+  char text[MAXMSG];
+} fedRecord;
+
+/* peer fields, one federation link, only the federation thread touches them:
+- sd: its socket, -1 while it is down
+- addr: where a -P link is dialed
+- dialed: a -P link, dialed again when it goes down, otherwise the slot is
+free once it does
+- connecting: a dial is in progress, the link is up once sd is writable
+- up: records flow both ways
+- retryAt: monoMs when a -P link that is down is dialed next
+- out / outSent: records waiting to be written, outSent bytes of them already were
+- in / inLen: bytes read that don't make up a whole record yet
+- node: the id from its FED_HELLO, 0 until that has arrived
+*/
+typedef struct peer{
+  int sd;
+  struct sockaddr_in addr;
+  bool dialed;
+  bool connecting;
+  bool up;
+  uint64_t retryAt;
+  fedBuf out;
+  int outSent;
+  char in[FEDREADSIZE];
+  int inLen;
+  uint32_t node;
+} peer;
+
 /* Prototypes --------------------------------------------------------*/
 
-// sets default values for participants and observers array
+// reserves address space for connMax participants and as many observers,
+// and the per-slot arrays that go with them
 void initializeSDs();
 
+/* growSlots
+ *    Sets up the next SLOTCHUNK slots of a table (participants or observers,
+ *    tag says which, with its cold half) and threads them onto its free list.
+ *    The tables are reserved up front and only touched as they grow, so slots
+ *    never move and memory follows the connections actually held
+ */
+void growSlots(client *table, clientCold *cold, int *high, int *freeHead, int tag);
+
+/* reserveTable
+ *    Address space for connMax entries of size bytes, backed on first touch
+ */
+void* reserveTable(size_t size);
+
 /* connectingPart
  *    A participant is attempting to connect
+ *    Accepts it and hands it to admitPart
+ *    Returns the slot, connMax if it was refused, -1 if nobody was waiting
  */
 int connectingPart(int sdpart, struct sockaddr_in cad, int alen);
 
 /* connectingObs:
  *   An observer is attempting to connect
+ *   Same as connectingPart, for the observer table
  */
 int connectingObs(int sdobs, struct sockaddr_in cad, int alen);
 
+/* admitPart
+ *    Gives an accepted participant socket the first slot off the free list,
+ *    O(1) however full the table is, and registers it with the event loop
+ *    Returns the slot, connMax if the table was full or the event loop
+ *    can't watch sd (sd is then closed)
+ */
+int admitPart(int sd);
+
+/* admitObs
+ *    Same as admitPart, for the observer table
+ */
+int admitObs(int sd);
+
+/* refuseSpare
+ *    The process is out of descriptors, so the connection waiting on listener
+ *    can't even be accepted to be told no. Closes spareFd for long enough to
+ *    accept and refuse it (role 0 for participants, 1 for observers)
+ *    Returns connMax if one was refused, -1 if not
+ */
+int refuseSpare(int listener, int role);
+
 /* usernamePart
- *    Prompts participant for a username
+ *    Handles one username frame from a participant
  *    Inputted username must be:
  *       consists of lower/uppercase letters, numbers, and underscores
  *       between 1-10 characters long
  *    If already taken username, the user is reprompted to enter again
  *    If no username inputted in time, the server disconnects the participant
 */
-void usernamePart(int sdpart, int j, fd_set readfds);
+void usernamePart(int j, const char *nameBuf, uint8_t nameLength);
 
 /* usernameObs
+*   Handles one username frame from an observer
 *   Inputted username must match that of an active participant
 *   Server disconnects the observer if:
 *      name is not inputted in time
 *      name does not match that of an active participant
 */
-void usernameObs(int sdobs, int j, fd_set readfds);
+void usernameObs(int j, const char *nameBuf, uint8_t nameLength);
 
 /* doMessage
+ *    Handles one complete message frame from an active participant
  *    Handles private, public, new observer, participant joining/leaving
- *    Handles active participant disconnecting
- *    Prepends messages using concat method
- *    Limits messages to 1000 characters
+ *    Encodes public and private messages once with makeMessage
  */
-void doMessage(int j, fd_set readfds);
+void doMessage(int j, const char *body, uint16_t messageLength);
 
 /* disconnectPart
  *    If a participant disconnects, all observers are informed
  *    Affiliated observer is also disconnected
  */
-void disconnectPart(int j, fd_set readfds);
+void disconnectPart(int j);
 
 /* disconnectObs
  *    If an observer disconnects, no message is printed
  *    The observer can reconnect with the same username
  */
-void disconnectObs(int j, fd_set readfds);
+void disconnectObs(int j);
 
-/* resetObsSD
- *    Invoked when an observer disconnects
- *    If an active participant disconnects, the affiliated observer disconnects as well
- *    Resets default values for observer array
+/* dropPart
+ *    Participant j closed its socket, before or after picking a name
  */
-void resetObsSD(int j);
+void dropPart(int j);
+
+/* handlePart / handleObs
+ *    Called when a participant/observer socket is ready
+ *    Reads until the socket would block (edge-triggered epoll requires it),
+ *    runs the handlers for every complete frame and keeps the cut-off tail
+ *    in partial for the next wakeup
+ *    A participant that still has input after READBUDGET reads is put on the
+ *    backlog so one busy sender can't hold up everyone else
+ *    A peer that closes is disconnected once its buffered frames are handled
+ */
+void handlePart(int j);
+void handleObs(int j);
+
+/* parsePart / parseObs
+ *    Framing state machine over buffered input
+ *    Participants: PROTO_HELLO + version or uint8_t length + name while state is 0,
+ *                  uint16_t length + message once active (v1),
+ *                  or v2 frames of records, see doRecord
+ *    Observers:    PROTO_HELLO + version or uint8_t length + name while state
+ *                  is 0, nothing after
+ *    Returns how many bytes were consumed by complete frames
+ */
+int parsePart(int j, int sd, const char *buf, int len);
+int parseObs(int j, int sd, const char *buf, int len);
 
-/* resetPartSD
- *    Invoked when a participant disconnects
- *    Resets default values for participant array
+/* negotiate
+ *    Client c on socket sd asked for protocol version wanted
+ *    Settles on the highest one both speak and answers 'V' and that version
  */
-void resetPartSD(int j);
+void negotiate(client *c, int sd, uint8_t wanted);
 
-/* concat
- *    Helper function
- *    Concatenates three strings for message printing
+/* negotiateCompress
+ *    Client c on socket sd asked for COMPRESS_ mode wanted, answers 'Z' and
+ *    the mode it gets. Only v2 observers get anything but COMPRESS_NONE
  */
-char* concat(const char *str1, const char *str2, const char *str3);
+void negotiateCompress(client *c, int sd, uint8_t wanted, bool observer);
 
-/* -------------------------------------------------------------------*/
+/* doRecord
+ *    Handles one v2 record from participant j, REC_PUBLIC and REC_PRIVATE
+ *    become the same messages v1 sends, anything else is a protocol error
+ *    and disconnects the participant
+ */
+void doRecord(int j, uint8_t type, const char *body, uint16_t bodyLength);
 
+/* restorePartial / stashPartial
+ *    Helper functions
+ *    restorePartial moves a cut-off frame from a client to the front of readBuf,
+ *    stashPartial keeps the len bytes at buf until more input arrives
+ */
+int restorePartial(clientCold *c);
+void stashPartial(clientCold *c, const char *buf, int len);
 
-/* Global variables */
-client participants[MAXSIZE];
-int pSize = 0;
-client observers[MAXSIZE];
-int oSize = 0;
+/* setNonBlocking
+ *    Helper function
+ *    Every socket is non-blocking so no single client can stall the loop
+ */
+void setNonBlocking(int sd);
 
-int main(int argc, char** argv) {
-  srand(time(0));
-  struct protoent *ptrp;  	/* pointer to a protocol table entry */
-  struct sockaddr_in sad; 	/* structure to hold server's address */
-  struct sockaddr_in cad; 	/* structure to hold client's address */
-  int sdpart, sdobs;         /* socket descriptors */
-  int alen;               	/* length of address */
-  int optval = 1;         	/* boolean value when we set socket option */
-  uint16_t participantPort;
-  uint16_t observerPort;    /* protocol port number */
+/* allocFrame
+ *    Takes an empty frame with room for size bytes of data
+ *    Frames come out of size-classed free lists that are refilled SLABFRAMES
+ *    at a time, so steady traffic does no mallocs at all
+ *    The caller holds one reference and releases it once it has been sent
+ */
+frame* allocFrame(int size);
 
-  if( argc != 3 ) {
-    fprintf(stderr,"Error: Wrong number of arguments\n");
-    fprintf(stderr,"usage:\n");
-    fprintf(stderr,"./server server_port\n");
-    exit(EXIT_FAILURE);
-  }
+/* makeFrame
+ *    Encodes a message once for v1: uint16_t length followed by the message
+ */
+frame* makeFrame(const char *message, uint16_t messageLength);
 
-  participantPort = atoi(argv[1]);
-  observerPort = atoi(argv[2]);
+/* makeRecord
+ *    Encodes a message once as a v2 record of type, which the caller hangs
+ *    off the v1 frame of the same message. name and text can each be NULL,
+ *    when there are both the name gets a uint8_t length in front
+ */
+frame* makeRecord(uint8_t type, const char *name, const char *text);
 
-  //creates and does the port stuff for the particpant port
-  memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
-  sad.sin_family = AF_INET;
-  sad.sin_addr.s_addr = INADDR_ANY;
+/* makeMessage
+ *    Encodes a chat message from name once, straight into its frames: the v1
+ *    frame (">" or "-", name padded to 11, ": ", text) and the REC_PUBLIC or
+ *    REC_PRIVATE record hanging off it
+ */
+frame* makeMessage(uint8_t type, const char *name, const char *text);
 
-  /* Tests for illegal value, sets port number */
-  if (participantPort > 0) {
-    sad.sin_port = htons(participantPort);
-  }
-  else {
-    fprintf(stderr,"Error: Bad port number %s\n",argv[1]);
-    exit(EXIT_FAILURE);
-  }
-  /* Map TCP transport protocol name to protocol number */
-  if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0) {
-    fprintf(stderr, "Error: Cannot map \"tcp\" to protocol number");
-    exit(EXIT_FAILURE);
-  }
-  /* Creates a socket and returns a socket descriptor named sd. */
-  sdpart = socket(AF_INET, SOCK_STREAM, ptrp->p_proto);
-  if (sdpart < 0) {
-    fprintf(stderr, "Error: Socket creation failed\n");
-    exit(EXIT_FAILURE);
-  }
-  /* Allow reuse of port - avoid "Bind failed" issues */
-  if( setsockopt(sdpart, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ) {
-    fprintf(stderr, "Error Setting socket option failed\n");
-    exit(EXIT_FAILURE);
-  }
-  /* Bind a local address to the socket. */
-  if (bind(sdpart, (struct sockaddr *) &sad, sizeof(sad)) < 0) {
-    fprintf(stderr,"Error: Bind failed\n");
-    exit(EXIT_FAILURE);
-  }
-  /* Specify size of request queue. */
-  if (listen(sdpart, QLEN) < 0) {
-    fprintf(stderr,"Error: Listen failed\n");
-    exit(EXIT_FAILURE);
-  }
+/* releaseFrame
+ *    Drops one reference, the frame goes back to its pool when the last one goes
+ */
+void releaseFrame(frame *f);
 
-  //creates and does the port stuff for the observer port
-  memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
-  sad.sin_family = AF_INET;
-  sad.sin_addr.s_addr = INADDR_ANY;
+/* sendFrame
+ *    Sends frame f to observer j, as is for v1 and as f's record batched
+ *    with the rest of the pass for v2
+ */
+void sendFrame(int j, frame *f);
+
+/* queueFrame
+ *    Sends frame f to observer j as is, taking a reference while it is queued
+ *    Writes straight to the socket when nothing is queued, whatever doesn't fit
+ *    is queued and written by flushObs once the socket is writable
+ *    Past the high-water mark the oldest frame is dropped or the observer is
+ *    disconnected, depending on queuePolicy
+ */
+void queueFrame(int j, frame *f);
 
-  /* Tests for illegal value, sets port number */
-  if (observerPort > 0) {
-    sad.sin_port = htons(observerPort);
-  }
-  else {
-    fprintf(stderr,"Error: Bad port number %s\n",argv[2]);
-    exit(EXIT_FAILURE);
-  }
-  /* Map TCP transport protocol name to protocol number */
-  if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0) {
-    fprintf(stderr, "Error: Cannot map \"tcp\" to protocol number");
-    exit(EXIT_FAILURE);
-  }
-  /* Creates a socket and returns a socket descriptor named sd. */
-  sdobs = socket(AF_INET, SOCK_STREAM, ptrp->p_proto);
-  if (sdobs < 0) {
-    fprintf(stderr, "Error: Socket creation failed\n");
-    exit(EXIT_FAILURE);
-  }
-  /* Allow reuse of port - avoid "Bind failed" issues */
-  if( setsockopt(sdobs, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ) {
-    fprintf(stderr, "Error Setting socket option failed\n");
-    exit(EXIT_FAILURE);
-  }
-  /* Bind a local address to the socket. */
-  if (bind(sdobs, (struct sockaddr *) &sad, sizeof(sad)) < 0) {
-    fprintf(stderr,"Error: Bind failed\n");
-    exit(EXIT_FAILURE);
-  }
-  /* Specify size of request queue. */
-  if (listen(sdobs, QLEN) < 0) {
-    fprintf(stderr,"Error: Listen failed\n");
-    exit(EXIT_FAILURE);
-  }
+/* batchRecord / closeBatch / flushBatches
+ *    batchRecord copies record rec into v2 observer j's batch, starting a new
+ *    batch if it is full. closeBatch writes the frame length in front of
+ *    observer j's batch and queues it as one frame, flushBatches does that
+ *    for every batch at the end of the pass
+ */
+void batchRecord(int j, frame *rec);
+void closeBatch(int j);
+void flushBatches();
 
-  fd_set readfds;
-  int status;
-  int max = sdobs;
-  int n;
+/* joinShared / leaveShared
+ *    Observer j joins or leaves the deflate group of its room, a join
+ *    restarts the group's stream so the new member can start inflating
+ */
+void joinShared(int j);
+void leaveShared(int j);
+
+/* shareRecord / cutShared
+ *    shareRecord adds record rec to what room's deflate group has pending.
+ *    cutShared compresses that once and copies the REC_DEFLATE record into
+ *    every synced member's batch. It is called at the end of the pass, when
+ *    the pending records fill ZCHUNK, before a member gets a record of its
+ *    own and before one moves to another room
+ */
+void shareRecord(int room, frame *rec);
+void cutShared(int room);
 
-  // Initialize participants and observers
-  initializeSDs();
+/* loseShared
+ *    Observer j lost queued frames, so it skips the deflate group's chunks
+ *    until the stream restarts
+ */
+void loseShared(int j);
 
-  while(1){
+/* shedFrames
+ *    Observer j is n frames over its high-water mark, applies queuePolicy
+ *    Returns true if queued frames were dropped to make room, false if
+ *    nothing could be dropped or the observer was disconnected
+ */
+bool shedFrames(int j, int n);
 
-    status = 0;
-    FD_ZERO(&readfds);
-    FD_SET(sdpart, &readfds);
-    FD_SET(sdobs, &readfds);
-    max = sdobs;
+/* flushObs
+ *    Writes queued frames to observer j until its socket would block,
+ *    up to FLUSHMAX of them per writev
+ */
+void flushObs(int j);
 
-    for (int i=0; i<MAXSIZE; i++){
-      FD_SET(participants[i].sdparts, &readfds);
-      if(participants[i].sdparts > max){
-        max = participants[i].sdparts;
-      }
-      FD_SET(observers[i].sdobs, &readfds);
-      if(observers[i].sdobs > max){
-        max = observers[i].sdobs;
-      }
-    }
+/* retireFrames
+ *    n bytes of observer j's queue were written, releases every frame that
+ *    went out completely and remembers how far into the next one it got
+ */
+void retireFrames(int j, int n);
 
-    printf("max+1: %d\n", max+1);
-    status = select (max+1, &readfds, NULL, NULL, NULL);
-    printf("status:%d\n", status);
+/* broadcastFrame
+ *    Sends frame f to every observer in room room except slot except (-1 for
+ *    none) in this shard, and leaves it in the mail of every other shard with
+ *    observers in the room
+ */
+void broadcastFrame(frame *f, int room, int except);
 
-    if (status == -1) {
-      //printf("I AM -1, max = %d\n", max);
-      perror("select");
-      strerror(errno);
-      exit(1);
-    }
+/* fanOut
+ *    Sends frame f to this shard's observers in room except slot except,
+ *    the deflate group's members through shareRecord
+ */
+void fanOut(frame *f, int room, int except);
 
-    // someone closed
-    else if (status == 0) {
-      printf("someone closed\n");
-      exit(1);
-    }
+/* findObsSlot
+ *    Helper function
+ *    Returns the slot of the observer attached to local participant name, -1 if
+ *    there is none
+ *    The shard that slot belongs to goes in *obsShard
+ */
+int findObsSlot(const char *name, int *obsShard);
 
-    // game logic
-    else {
-      int j;
+/* Shards -------------------------------------------------------------*/
 
-      // A participant is connecting
-      if (FD_ISSET(sdpart, &readfds)) {
-        j =  connectingPart(sdpart, cad, alen);
-      }
+/* runShard
+ *    Thread body of one reactor: opens its listeners and runs its event loop
+ */
+void* runShard(void *arg);
 
-      // An observer is connecting
-      else if (FD_ISSET(sdobs, &readfds)) {
-        j = connectingObs(sdobs, cad, alen);
-      }
+/* openListener
+ *    Creates, binds and listens on a non-blocking socket for port
+ *    SO_REUSEPORT is set when there are several shards, so each has its own
+ */
+int openListener(uint16_t port);
 
-      // Messages
-      else{
-        for(int i = 0; i < MAXSIZE; i++){
-          if(FD_ISSET(participants[i].sdparts, &readfds)){
+/* postMail
+ *    Queues mail for shard target, taking a reference to f if there is one
+ *    Nothing is handed over until flushMail, so one lock and one wakeup cover
+ *    everything a pass of the event loop has for that shard
+ *    Returns the mail so the caller can fill in anything else it carries
+ */
+mail* postMail(int target, int type, frame *f, int sd, const char *name);
 
-            // Connected participants need a username
-            if (participants[i].state == 0) {
-              usernamePart(participants[i].sdparts, j, readfds);
-            }
+/* flushMail
+ *    Moves everything postMail queued into the other shards' inboxes,
+ *    waking a shard up when its inbox goes from empty to not empty, and
+ *    everything federate queued to the federation thread
+ */
+void flushMail();
 
-            // Sending a message
-            else {
-              doMessage(i, readfds);
-            }
-          }
+/* drainMail
+ *    Called when the wake pipe is readable
+ *    Takes the whole inbox in one go and delivers it
+ */
+void drainMail();
 
-          // Observer is trying to send something to server
-          // The observer never sends anything to server
-          if(FD_ISSET(observers[i].sdobs, &readfds)){
-
-            // Getting a username to associate with participant
-            if(observers[i].state == 0){
-              usernameObs(observers[i].sdobs, j, readfds);
-            }
-            else{
-              //someone quit
-              printf("an observer quit\n");
-              for (int k = 0; k < MAXSIZE; k++) {
-                if (0 == strcmp(participants[k].name, observers[i].name) ) {
-                  close(observers[i].sdobs);
-                  participants[k].sdobs = 0;
-                  printf("CLOSING ACTIVE PARTICIPANT'S OBSERVER SOCKET\n");
-                  FD_CLR(observers[i].sdobs, &readfds);
-                  oSize--;
-                  resetObsSD(i);
-                  k = MAXSIZE;
-
-                }
-              }
-            }
-          }
-        }
-      }
-    } //else
-  }   //while game continues
-} //main
+/* handOffObs
+ *    Observer j asked for participant name, who lives on shard target
+ *    Gives up the slot without closing the socket and mails it to target
+ */
+void handOffObs(int j, int target, const char *name);
 
+/* adoptObs
+ *    Takes in an observer socket speaking protocol version and compress mode,
+ *    handed over by another shard, and finishes attaching it to participant name
+ */
+void adoptObs(int sd, int version, int compress, const char *name);
 
-void doMessage(int j, fd_set readfds) {
-  int n;
-  uint16_t messageLength;
+/* Rooms -------------------------------------------------------------*/
 
-  // Active participant disconnected
-  n = recv(participants[j].sdparts, &messageLength, sizeof(uint16_t), 0);
-  if (n <= 0) {
-    disconnectPart(j, readfds);
-    //disconnectObs(j, readfds);
-
-    // close(participants[j].sdparts);
-    // printf("CLOSING ACTIVE PARTICIPANT SOCKET\n");
-    //
-    // char* username = malloc(sizeof(char) * strlen(participants[j].name));
-    // strcpy(username, participants[j].name);
-    // char* msgToSend = concat("User ", username, " has left");
-    // uint16_t msgLength = strlen(msgToSend);
-    //
-    // // sends in network standard byte order
-    // msgLength = htons(ntohs(msgLength));
-    //
-    // char weWillSendThisMsg[msgLength];
-    // for(int k = 0; k < msgLength; k++){
-    //   weWillSendThisMsg[k] = msgToSend[k];
-    // }
-    //
-    // for (int i = 0; i < MAXSIZE; i++) {
-    //   // send to all observers except for the one affiliated with disconnecting participant
-    //   if(observers[i].sdobs != 0 && observers[i].sdobs != participants[j].sdobs){
-    //     send(observers[i].sdobs, &msgLength, sizeof(uint16_t), 0);
-    //     send(observers[i].sdobs, weWillSendThisMsg, sizeof(char)*msgLength, 0);
-    //   }
-    // }
-    //
-    // for (int i = 0; i < MAXSIZE; i++) {
-    //   if (0 == strcmp(participants[j].name, observers[i].name) ) {
-    //     close(observers[i].sdobs);
-    //     printf("CLOSING ACTIVE PARTICIPANT'S OBSERVER SOCKET\n");
-    //     FD_CLR(observers[i].sdobs, &readfds);
-    //     oSize--;
-    //     resetObsSD(i);
-    //   }
-    // }
-    //
-    // FD_CLR(participants[j].sdparts, &readfds);
-    // pSize--;
-    // resetPartSD(j);
+/* enterRoom
+ *    Counts a participant into room name, creating it if it doesn't exist
+ *    There are never more rooms than participants (plus DEFAULTROOM), so
+ *    there is always an id left
+ *    Returns the room's id
+ */
+int enterRoom(const char *name);
 
-  }
+/* leaveRoom
+ *    Counts a participant out of room id, which goes away with the last one
+ */
+void leaveRoom(int id);
 
-  else {
-    char message[1001] = {'\0'};
-    memset(message, 0, sizeof(message)*sizeof(char));
-    n = recv(participants[j].sdparts, message, sizeof(char)*messageLength, 0);
+/* findRoom
+ *    Looks up a room by name in O(1), hold roomLock while using it
+ *    Returns its entry, NULL if there is no such room
+ */
+roomEntry* findRoom(const char *name);
 
-    if (messageLength >= 1000) {
-      printf("we will disconnect participants[j]");
-      disconnectPart(j, readfds);
-      //disconnectObs(j, readfds);
-    }
-    else {
+/* pinRoom
+ *    Counts a member into room name only if it exists, so records from other
+ *    nodes can be broadcast to it without it going away meanwhile
+ *    Returns its id (leaveRoom lets go of it), -1 if there is no such room
+ */
+int pinRoom(const char *name);
 
-      // private
-      if (message[0] == '@' && message[1] != ' ') {
-        int p = 1;
-        int recipNameLength = 0;
-        // case 1: @username
+/* joinRoom
+ *    Participant j sent "/join name", moves it and its observer to that room
+ *    and tells both rooms
+ */
+void joinRoom(int j, const char *name);
 
-        // gets recipient name length
-        while (message[p] != ' '){
-          recipNameLength++;
-          p++;
-        }
+/* recordHistory
+ *    Remembers broadcast f in room id's history, forgetting the oldest ones
+ *    while there are historyMax or they take up more than historyBytesMax
+ */
+void recordHistory(int id, frame *f);
 
-        // stores recipient's name
-        char* recipName = calloc(recipNameLength, sizeof(char));
-        int q = 0;
-        while(message[q+1] != ' ' && q+1 != p) {
-          recipName[q] = message[q+1];
-          q++;
-        }
+/* replayHistory
+ *    Sends observer j what room id remembers (no older than historySeconds if
+ *    that is set), oldest first. v1 observers get it concatenated into one
+ *    frame, so it goes out in one write, v2 observers as records in their batch
+ */
+void replayHistory(int j, int id);
 
-        // finds the length of the message
-        p++;
-        int startMessage = p;
-        uint16_t messageLengthCurr =0;
-        while (message[p] != '\0'){
-          messageLengthCurr++;
-          p++;
-        }
+/* replayFrames
+ *    Helper function
+ *    Sends observer j frames[0..count) and releases them, v1 observers in
+ *    one concatenated frame, v2 observers as records in their batch
+ */
+void replayFrames(int j, frame **frames, int count);
 
-        // stores the message
-        char* messageCurr = calloc(messageLengthCurr, sizeof(char));
-        p = startMessage;
-        q = 0;
-        while(message[p] != '\0'){
-          messageCurr[q] = message[p];
-          q++;
-          p++;
-        }
+/* clearHistory
+ *    Helper function
+ *    Releases everything room id remembers, hold its historyLock
+ */
+void clearHistory(int id);
 
-        // checks if recipient is active
-        bool validRecip = false;
-        int recipObs = 0;
-        for(int i = 0; i < MAXSIZE; i++){
-          if(strcmp(observers[i].name, recipName) == 0 ){
-            recipObs = i;
-            validRecip = true;
-            i = MAXSIZE;
-          }
-        }
+/* subscribeObs / unsubscribeObs
+ *    Puts attached observer j on this shard's subscribers of room id, or
+ *    takes it off the ones it is on, O(1)
+ */
+void subscribeObs(int j, int id);
+void unsubscribeObs(int j);
 
-        if (validRecip) {
-          int senderNameLen = strlen(participants[j].name);
-          int numSpaces = 11- senderNameLen;
+/* Message log -------------------------------------------------------*/
 
-          char spacesStr[14] = {'\0'};
-          for (int i = 0; i < numSpaces; i++) {
-            spacesStr[i] = ' ';
-          }
+/* logOpen
+ *    Opens the log in logDir at startup, creating it if needed: reads the
+ *    index files back and finds where the last segment ends
+ */
+void logOpen();
 
-          char* msgToSend = concat("-", spacesStr, participants[j].name);
-          msgToSend = concat(msgToSend, ": ", messageCurr);
+/* logOpenSegment
+ *    Helper function
+ *    Opens segment number and its index file and maps it, preallocating and
+ *    prefaulting it if create is set
+ */
+logSegment* logOpenSegment(int number, bool create);
 
-          uint16_t msgLength = strlen(msgToSend);
-          char weWillSendThisMsg[msgLength];
-          for(int k = 0; k < msgLength; k++){
-            weWillSendThisMsg[k] = msgToSend[k];
-          }
+/* logScan
+ *    Helper function
+ *    Walks seg's entries from offset off (an indexed one if skipFirst is set)
+ *    while each follows the one before, indexing the ones that should be
+ *    Returns where they end, *seq becomes the next sequence number
+ */
+long logScan(logSegment *seg, long off, uint64_t *seq, bool skipFirst);
 
-          msgLength = htons(ntohs(msgLength));
+/* logAddIndex
+ *    Helper function
+ *    Appends to the sparse index, hold logLock
+ */
+void logAddIndex(uint64_t seq, uint64_t at, int segment, long offset);
 
-          // send to observer affiliated with recipient
-          if(observers[recipObs].sdobs != 0){
-            send(observers[recipObs].sdobs, &msgLength, sizeof(uint16_t), 0);
-            send(observers[recipObs].sdobs, weWillSendThisMsg, sizeof(char)*msgLength, 0);
-          }
+/* logFrame
+ *    Appends broadcast f to room id to the log, without blocking on the disk
+ */
+void logFrame(int id, frame *f);
 
-          // send to observer affiliated with sender
-          if(participants[j].sdobs != 0){
-            send(participants[j].sdobs, &msgLength, sizeof(uint16_t), 0);
-            send(participants[j].sdobs, weWillSendThisMsg, sizeof(char)*msgLength, 0);
-          }
-        }
+/* runLogSync
+ *    Thread body of -l: every LOGSYNCMS msyncs what was appended (group
+ *    commit), writes out the index entries it covers, finishes the retired
+ *    segments and maps the next one
+ */
+void* runLogSync(void *arg);
 
-        else {
-          char* msgToSend = concat("Warning: user ", recipName, " doesn't exist...");
+/* logRead
+ *    Copies the newest max entries the log has for room name, no older than
+ *    since (wall clock milliseconds), into one malloc'd frame, oldest first
+ *    Reads at most LOGSCANMAX entries, from the index entry before since
+ *    Returns NULL if there are none
+ */
+frame* logRead(const char *name, uint64_t since, int max);
 
-          uint16_t msgLength = strlen(msgToSend);
-          char weWillSendThisMsg[msgLength];
-          for(int k = 0; k < msgLength; k++){
-            weWillSendThisMsg[k] = msgToSend[k];
-          }
+/* logUnpack
+ *    Helper function
+ *    Rebuilds the frames of what logRead returned into frames
+ *    Returns how many there are
+ */
+int logUnpack(frame *entries, frame **frames);
 
-          msgLength = htons(ntohs(msgLength));
+/* runLogRead
+ *    Thread body of -l: runs the replays the shards asked for with logAsk,
+ *    and mails each one's entries back to the shard that asked
+ */
+void* runLogRead(void *arg);
 
-          // send to observer affiliated with sender
-          send(participants[j].sdobs, &msgLength, sizeof(uint16_t), 0);
-          send(participants[j].sdobs, weWillSendThisMsg, sizeof(char)*msgLength, 0);
-        }
+/* logAsk
+ *    Queues a replay of room since (wall clock milliseconds) for observer j
+ *    of this shard, the reader thread does the disk reads
+ */
+void logAsk(int j, const char *room, uint64_t since);
 
-        // case 2: @ a message // TODO: THIS:::::::::::::::::::::::::
-      }
+/* replayLog
+ *    Participant j sent "/replay seconds", has what its room said in that
+ *    time (everything LOGSCANMAX reaches if seconds is 0) sent to its
+ *    observer, at most once every REPLAYGAPMS
+ */
+void replayLog(int j, int seconds);
 
-      //public
-      else {
-        uint8_t nameLength = strlen(participants[j].name);
-        int numSpaces = 11-nameLength;
+/* logWarm
+ *    Refills the lobby's history from the log after a restart
+ */
+void logWarm();
 
-        char spacesStr[14] = {'\0'};
-        for (int i = 0; i < numSpaces; i++) {
-          spacesStr[i] = ' ';
-        }
+/* Username index -----------------------------------------------------*/
 
-        char* msgToSend = concat(">", spacesStr, participants[j].name);
-        msgToSend = concat(msgToSend, ": ", message);
+/* findName
+ *    Looks up an active participant by username in O(1)
+ *    Returns its entry, NULL if nobody has that name
+ *    The index is shared by every shard, hold nameLock while using it
+ *    The entry is only valid until the next addName/removeName
+ */
+nameEntry* findName(const char *name);
 
-        uint16_t msgLength = strlen(msgToSend);
-        char currMessage[msgLength];
-        for(int k = 0; k < msgLength; k++){
-          currMessage[k] = msgToSend[k];
-        }
+/* addName
+ *    Indexes participant slot part of this shard under name, with no observer yet
+ */
+nameEntry* addName(const char *name, int part);
 
-        msgLength = htons(ntohs(msgLength));
+/* removeName
+ *    Drops name from the index when its participant leaves
+ */
+void removeName(const char *name);
 
-        for(int i = 0; i < MAXSIZE; i++){
-          if((observers[i].sdobs != 0)){
-            send(observers[i].sdobs, &msgLength, sizeof(uint16_t), 0);
-            send(observers[i].sdobs, currMessage, sizeof(char)*msgLength, 0);
-          }
+/* hashName
+ *    Helper function
+ *    FNV-1a over the name, masked to nameTableSize
+ */
+unsigned int hashName(const char *name);
+
+/* resetObsSD
+ *    Invoked when an observer disconnects
+ *    If an active participant disconnects, the affiliated observer disconnects as well
+ *    Unregisters and closes the socket, resets default values for observer array
+ *    and puts the slot back on the free list
+ */
+void resetObsSD(int j);
+
+/* resetPartSD
+ *    Invoked when a participant disconnects
+ *    Unregisters and closes the socket, resets default values for participant array
+ *    and puts the slot back on the free list
+ */
+void resetPartSD(int j);
+
+/* concat
+ *    Helper function
+ *    Concatenates three strings for message printing
+ *    The result lives in the arena, it is gone after the next arenaReset
+ */
+char* concat(const char *str1, const char *str2, const char *str3);
+
+/* arenaAlloc
+ *    Zeroed scratch memory for assembling a message, never freed by the caller
+ *    Falls back to malloc (counted in the shard's allocs) if the arena is used up
+ */
+void* arenaAlloc(int size);
+
+/* arenaReset
+ *    Recycles the whole arena, called once each frame has been handled and
+ *    its output queued
+ */
+void arenaReset();
+
+/* Event loop --------------------------------------------------------*/
+
+/* loopInit
+ *    Sets up this shard's backend: the io_uring ring with -b uring, otherwise
+ *    the epoll instance, or the select fd sets with -DUSE_SELECT
+ */
+void loopInit();
+
+/* loopAdd
+ *    Registers a socket with the event loop once, when it is accepted
+ *    tag and slot come back with every wakeup for that socket
+ */
+void loopAdd(int sd, int tag, int slot);
+
+/* loopDel
+ *    Unregisters a socket, must be called before the socket is closed
+ */
+void loopDel(int sd);
+
+/* loopFits
+ *    Whether the event loop can watch sd at all (select stops at FD_SETSIZE)
+ */
+bool loopFits(int sd);
+
+/* loopWantWrite
+ *    Observer socket sd has frames queued (want) or has just run out of them,
+ *    only select needs telling, epoll and io_uring get told by the socket
+ */
+void loopWantWrite(int sd, bool want);
+
+/* loopWait
+ *    Blocks until at least one registered socket is ready, or timeout
+ *    milliseconds pass (-1 waits forever)
+ *    Fills events with up to maxEvents ready sockets and returns how many
+ */
+int loopWait(loopEvent *events, int maxEvents, int timeout);
+
+/* pollInit / pollAdd / pollDel / pollFits / pollWantWrite / pollWait
+ *    The readiness backend behind the loop functions above,
+ *    epoll or select depending on USE_SELECT
+ */
+void pollInit();
+void pollAdd(int sd, int tag, int slot);
+void pollDel(int sd);
+bool pollFits(int sd);
+void pollWantWrite(int sd, bool want);
+int pollWait(loopEvent *events, int maxEvents, int timeout);
+
+/* Timer wheel -------------------------------------------------------*/
+
+/* timerArm
+ *    (Re)starts timer t to fire ms milliseconds from now, O(1)
+ */
+void timerArm(timer *t, int ms);
+
+/* timerCancel
+ *    Stops timer t if it is armed, O(1)
+ */
+void timerCancel(timer *t);
+
+/* timerInsert
+ *    Helper function
+ *    Links t into the level and slot its expiry falls in, relative to wheelNow
+ */
+void timerInsert(timer *t);
+
+/* timerAdvance
+ *    Fires every timer that is due, a tick at a time, cascading the higher
+ *    levels down whenever the level below has gone round once
+ */
+void timerAdvance();
+
+/* timerTimeout
+ *    Milliseconds the event loop may sleep before timerAdvance has work,
+ *    -1 if no timer is armed
+ */
+int timerTimeout();
+
+/* handshakeExpired
+ *    A participant or observer didn't pick a name in time, frees its slot
+ */
+void handshakeExpired(int tag, int slot);
+
+/* monoMs / monoNs
+ *    Helper functions
+ *    Monotonic clock in milliseconds / nanoseconds
+ */
+uint64_t monoMs();
+uint64_t monoNs();
+
+/* wallMs / wallNs
+ *    Helper functions
+ *    Wall clock in milliseconds, what the log records / nanoseconds, what
+ *    federation records carry
+ */
+uint64_t wallMs();
+uint64_t wallNs();
+
+/* Metrics -----------------------------------------------------------*/
+
+/* histRecord
+ *    Adds v to h, only ever called by the thread owning h
+ */
+void histRecord(histogram *h, uint64_t v);
+
+/* requestStats
+ *    SIGUSR1 handler, the main loop prints the metrics on its next pass
+ */
+void requestStats(int sig);
+
+/* printStats
+ *    Prints the metrics to stdout
+ */
+void printStats();
+
+/* writeMetrics
+ *    Writes every counter and histogram, summed over the shards, to out as
+ *    plain text, one "name{labels} value" per line
+ */
+void writeMetrics(FILE *out);
+
+/* writeHistogram
+ *    Writes the histogram sums[0..HISTBUCKETS) with count and sum as
+ *    cumulative name_bucket{le="..."} lines, skipping empty buckets
+ */
+void writeHistogram(FILE *out, const char *name, uint64_t *sums, uint64_t count, uint64_t sum);
+
+/* runAdmin
+ *    Thread body of -a: accepts on the admin port and answers every
+ *    connection with writeMetrics, as an HTTP response if it asked with GET
+ */
+void* runAdmin(void *arg);
+
+/* Trace -------------------------------------------------------------*/
+
+/* traceRecord
+ *    Behind TRACE, puts a record for site in this thread's trace ring unless
+ *    the site is over TRACERATE or the ring is full, never blocks
+ */
+void traceRecord(traceSite *site, const char *str, long a, long b);
+
+/* traceAttach
+ *    Helper function
+ *    Gives the calling thread its trace ring and adds it to traceRings
+ */
+traceRing* traceAttach();
+
+/* traceFormat
+ *    Helper function
+ *    Writes record t to out as one line of at most room bytes, "seconds
+ *    since startup, level, [shard] text"
+ *    Returns its length
+ */
+int traceFormat(char *out, int room, traceEntry *t);
+
+/* traceWrite
+ *    Helper function
+ *    Writes len bytes of out to stdout, however many writes that takes
+ */
+void traceWrite(const char *out, int len);
+
+/* runTrace
+ *    Thread body of the trace thread: every TRACEDRAINMS empties every trace
+ *    ring onto stdout
+ */
+void* runTrace(void *arg);
+
+/* Federation --------------------------------------------------------*/
+
+/* federate
+ *    Queues a record of type for every other node (link -1), or for the one
+ *    behind link, in this shard's fedOut. flushMail hands it over at the end
+ *    of the pass. Does nothing unless federated
+ */
+void federate(int link, uint8_t type, const char *a, const char *b, const char *text);
+
+/* findRemote
+ *    Returns the federation link user name is reached through, -1 if it is
+ *    nobody on another node
+ */
+int findRemote(const char *name);
+
+/* fedEncode / fedDecode
+ *    Helper functions
+ *    fedEncode writes a record to out, at most FEDRECORDMAX bytes, and
+ *    returns its length. fedDecode reads one from the len bytes at buf into r
+ *    and returns its length, 0 if it hasn't all arrived, -1 if it is malformed
+ */
+int fedEncode(char *out, uint8_t type, uint64_t sentAt, const char *a, const char *b, const char *text);
+int fedDecode(const char *buf, int len, fedRecord *r);
+
+/* fedReserve
+ *    Helper function
+ *    Makes room for more bytes at the end of b
+ *    Returns where they go, the caller adds them to len
+ */
+char* fedReserve(fedBuf *b, int more);
+
+/* deliverRemote
+ *    Called for a MAIL_REMOTE, broadcasts the public messages and join/leave
+ *    notices in f to their rooms and sends the private messages to their
+ *    recipients' observers, recording each one's hop time
+ */
+void deliverRemote(frame *f);
+
+/* runFederation
+ *    Thread body of -f / -P: dials the -P links, takes the ones that dial in,
+ *    and moves records between them and the shards
+ */
+void* runFederation(void *arg);
+
+/* fedDial / fedConnected / fedAccept
+ *    Helper functions
+ *    fedDial starts dialing -P link p, fedConnected finishes it once the
+ *    socket is writable, fedAccept takes every link waiting on listener
+ */
+void fedDial(int p);
+void fedConnected(int p);
+void fedAccept(int listener);
+
+/* fedUp / fedDown
+ *    Link p has come up, it is sent a FED_HELLO and a FED_ONLINE for every
+ *    local user
+ *    Link p went away or fell behind: closes it and takes its users out of
+ *    the username index
+ */
+void fedUp(int p);
+void fedDown(int p);
+
+/* fedRead / fedWrite
+ *    Helper functions
+ *    fedRead reads what link p sent and routes every whole record, fedWrite
+ *    writes what it is owed until its socket would block
+ */
+void fedRead(int p);
+void fedWrite(int p);
+
+/* fedRoute
+ *    Helper function
+ *    Handles record r (the len bytes at rec) from link p: directory records
+ *    straight away, the rest into the batch of the shard that delivers them
+ */
+void fedRoute(int p, const char *rec, int len, fedRecord *r);
+
+/* fedClaim
+ *    Helper function
+ *    Link p says user name is on its node, e is the index entry name already
+ *    has, if any. Adds or moves e, settling a name two nodes claim in favour
+ *    of the lower node id. Hold nameLock
+ */
+void fedClaim(int p, const char *name, nameEntry *e);
+
+/* evictPart
+ *    Called for a MAIL_EVICT, participant j lost its name to a user of another
+ *    node: warns its observer and disconnects it, unless the slot has moved on
+ */
+void evictPart(int j, const char *name);
+
+/* fedTakeInbox
+ *    Helper function
+ *    Takes everything the shards handed over and queues it on the links
+ */
+void fedTakeInbox();
+
+/* fedAppend
+ *    Helper function
+ *    Queues the len bytes at rec for link p, dropping the link if that puts
+ *    it more than FEDQUEUEMAX behind
+ */
+void fedAppend(int p, const char *rec, int len);
+
+/* io_uring backend -----------------------------------------------------*/
+
+/* uringInit
+ *    Creates this shard's ring with raw syscalls, maps its queues and
+ *    registers the provided buffer ring for reads
+ */
+void uringInit();
+
+/* uringSqe
+ *    Next free submission queue entry, zeroed
+ *    Submits what is queued first if the ring is full
+ */
+struct io_uring_sqe* uringSqe();
+
+/* uringEnter
+ *    Submits every queued entry and, if wait is set, blocks until a
+ *    completion arrives or timeout milliseconds pass (-1 waits forever)
+ */
+void uringEnter(bool wait, int timeout);
+
+/* uringAdd
+ *    loopAdd for io_uring: a multishot accept for listeners, multishot poll
+ *    for the wake pipe, multishot read into the buffer ring for everything else
+ */
+void uringAdd(int sd, int tag, int slot);
+
+/* uringCancel
+ *    loopDel for io_uring: cancels everything in flight on sd straight away,
+ *    before the socket is closed or handed to another shard
+ */
+void uringCancel(int sd);
+
+/* uringRecycle
+ *    Gives provided buffer bid back to the kernel
+ */
+void uringRecycle(int bid);
+
+/* uringFlush
+ *    Starts writing all of observer j's queued frames, as a chain of linked
+ *    writevs of up to URINGIOV frames each
+ */
+void uringFlush(int j);
+
+/* uringComplete
+ *    Handles one completion
+ */
+void uringComplete(struct io_uring_cqe *cqe);
+
+/* uringRead
+ *    n bytes arrived in a provided buffer for participant or observer j,
+ *    runs the framing state machine over them like handlePart/handleObs
+ */
+void uringRead(client *c, int j, bool part, const char *data, int n);
+
+/* runUring
+ *    The event loop when io_uring is the backend
+ */
+void runUring();
+
+/* -------------------------------------------------------------------*/
+
+
+/* Global variables, one copy per shard */
+__thread client *participants;      /* connMax slots reserved, pHigh of them set up, see growSlots */
+__thread clientCold *partCold;      /* the rest of each participant, same index */
+__thread int pSize = 0;
+__thread int pHigh = 0;
+__thread client *observers;
+__thread clientCold *obsCold;
+__thread int oSize = 0;
+__thread int oHigh = 0;
+__thread int freePart = -1;         /* heads of the free slot lists, threaded through nextFree */
+__thread int freeObs = -1;
+__thread char readBuf[READBUFSIZE]; /* shared by every socket, frames are handled straight out of it */
+__thread int *backlog;              /* participants that ran out of read budget */
+__thread int backlogCount = 0;
+__thread int *turn;                 /* backlog as it was when their turn came */
+
+__thread char arena[ARENASIZE];     /* message assembly scratch, see arenaAlloc */
+__thread int arenaUsed = 0;
+__thread arenaBlock *arenaOverflow = NULL;
+
+__thread frame *poolFree[POOLCLASSES];
+
+__thread int shardId;               /* which shard this thread runs */
+__thread shard *me;                 /* &shards[shardId] */
+__thread mailbox outbox[MAXSHARDS]; /* mail for the other shards, see postMail */
+__thread mailbox taken;             /* inbox swapped out by drainMail */
+
+__thread timer *wheel[WHEELLEVELS][WHEELSLOTS]; /* handshake deadlines, see timerArm */
+__thread uint64_t wheelNow = 0;     /* next tick timerAdvance handles */
+__thread int timerCount = 0;        /* armed timers */
+
+__thread uring ring;                /* io_uring backend only */
+__thread int *dirty;                /* observers with frames queued this pass, see uringFlush */
+__thread int dirtyCount = 0;
+__thread bool batchesOpen = false; /* some v2 observer has a batch, see flushBatches */
+__thread int *batched;             /* observers that opened one this pass */
+__thread int batchedCount = 0;
+__thread int *fanMembers;          /* copies of a room's subscribers for fanOut ... */
+__thread int *cutMembers;          /* ... and cutShared, which a send from fanOut can run */
+__thread int spareFd = -1;         /* given up to accept and refuse a connection when out of fds */
+__thread subscribers *subs;        /* observers of each room, indexed by room id */
+__thread int *cutRooms;            /* rooms whose deflate group has pending records */
+__thread int cutCount = 0;
+__thread traceRing *traceMine = NULL; /* set up on its first TRACE, see traceAttach */
+__thread fedBuf fedOut;            /* records for other nodes this pass, each behind its int8_t link (-1 all) */
+
+/* Global variables, shared */
+int queueMax = QUEUEMAX;   /* high-water mark of each observer's outbound queue */
+int queuePolicy = POLICY_DROP;
+int historyMax = HISTORYMAX;        /* -H */
+long historyBytesMax = HISTORYBYTES; /* -B */
+int historySeconds = 0;             /* -T, 0 replays however old the history is */
+int connMax = CONNMAX;              /* -c, slots of each table in each shard */
+int backend = BACKEND_POLL;
+int poolSizes[POOLCLASSES] = {64, 256, 1024, 2048, V2BATCH}; /* frame bytes per class */
+
+shard shards[MAXSHARDS];
+int shardCount = 1;
+uint16_t participantPort;
+uint16_t observerPort;
+uint16_t adminPort = 0;   /* -a, 0 leaves the metrics port closed */
+int tcpProto;              /* protocol number of "tcp" */
+
+nameEntry *nameTable;      /* open addressing, linear probing, guarded by nameLock */
+int nameTableSize;         /* a power of two at least 2x every slot of every shard, plus remoteMax */
+pthread_mutex_t nameLock = PTHREAD_MUTEX_INITIALIZER;
+
+room *rooms;               /* indexed by id, maxRooms of them */
+int maxRooms;              /* every participant of every shard in a room of its own, plus DEFAULTROOM */
+int freeRoom = -1;         /* head of the released ids, threaded through nextFree */
+int roomHigh = 0;          /* ids handed out so far, the ones past it are untouched */
+int roomCount = 0;         /* rooms in use */
+roomEntry *roomTable;      /* name to id, nameTableSize slots, guarded by roomLock */
+pthread_mutex_t roomLock = PTHREAD_MUTEX_INITIALIZER;
+
+char *logDir = NULL;       /* -l, NULL keeps no log */
+pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER; /* guards everything down to logIndexSynced */
+pthread_cond_t logWake = PTHREAD_COND_INITIALIZER;   /* wakes the sync thread early */
+logSegment *logCur;        /* appended to */
+logSegment *logSpare;      /* mapped ahead by the sync thread, the next one first */
+int logSpares = 0;         /* how many, up to LOGSPARES */
+logSegment *logRetired;    /* full ones the sync thread hasn't finished */
+long logOffset;            /* end of logCur */
+uint64_t logSeq = 1;       /* next entry's sequence number */
+logIndexEntry *logIndex;   /* sparse index of every segment, oldest first */
+int logIndexCount = 0;
+int logIndexCap = 0;
+int logIndexSynced = 0;    /* how many index entries are in the .idx files */
+long logSyncs = 0;         /* written by the sync thread only, like logSyncTime */
+pthread_mutex_t logReadLock = PTHREAD_MUTEX_INITIALIZER; /* guards logRequests */
+pthread_cond_t logReadWake = PTHREAD_COND_INITIALIZER;   /* wakes the reader thread */
+logRequest *logRequests;   /* replays the shards asked for, oldest first */
+int logRequestCount = 0;
+int logRequestCap = 0;
+histogram logSyncTime;
+
+int traceLevel = TRACE_INFO;        /* -v, the lowest TRACE level kept */
+traceRing *traceRings = NULL;      /* every thread's ring, pushed with a CAS and never taken off */
+uint64_t traceStart;               /* monoNs at startup, trace lines count from it */
+
+uint16_t fedPort = 0;      /* -f, 0 takes no federation links */
+peer peers[MAXPEERS];      /* the -P links first, then slots for the ones that dial in */
+int peerCount = 0;         /* -P links */
+bool federated = false;    /* -f or -P, only then do shards hand records over */
+uint32_t nodeId = 0;       /* -N, or picked at startup, the lower id keeps a name two nodes claim */
+int fedWake[2];            /* pipe, a byte in fedWake[1] wakes the federation thread */
+pthread_mutex_t fedLock = PTHREAD_MUTEX_INITIALIZER; /* guards fedInbox */
+fedBuf fedInbox;           /* what the shards' fedOut handed over */
+fedBuf fedBatches[MAXSHARDS]; /* federation thread only, records each shard delivers this pass */
+int remoteUsers = 0;       /* users of other nodes in the username index, guarded by nameLock */
+int remoteMax = 0;         /* most of them it makes room for */
+long fedLinks = 0;         /* links up, this and the rest written by the federation thread only */
+long fedRecordsIn = 0;
+long fedRecordsOut = 0;
+long fedBytesIn = 0;
+long fedBytesOut = 0;
+long fedDrops = 0;
+long fedConflicts = 0;
+long fedDirFull = 0;
+
+/* Set by SIGUSR1, the first shard prints the metrics (which are in shards) */
+volatile sig_atomic_t statsRequested = 0;
+
+int main(int argc, char** argv) {
+  srand(time(0));
+  traceStart = monoNs();
+  struct protoent *ptrp;  	/* pointer to a protocol table entry */
+
+  int opt;
+  while ((opt = getopt(argc, argv, "w:p:t:b:a:H:B:T:l:c:v:f:P:N:")) != -1) {
+    switch (opt) {
+
+      // high-water mark of the observer queues, in frames
+      case 'w':
+        queueMax = atoi(optarg);
+        if (queueMax < 1) {
+          fprintf(stderr,"Error: Bad queue size %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // what to do with an observer past the high-water mark
+      case 'p':
+        if (strcmp(optarg, "drop") == 0) {
+          queuePolicy = POLICY_DROP;
+        }
+        else if (strcmp(optarg, "disconnect") == 0) {
+          queuePolicy = POLICY_DISCONNECT;
+        }
+        else {
+          fprintf(stderr,"Error: Bad queue policy %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // how many reactor threads
+      case 't':
+        shardCount = atoi(optarg);
+        if (shardCount < 1 || shardCount > MAXSHARDS) {
+          fprintf(stderr,"Error: Bad thread count %s (1-%d)\n", optarg, MAXSHARDS);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // event loop backend
+      case 'b':
+        if (strcmp(optarg, "poll") == 0) {
+          backend = BACKEND_POLL;
+        }
+        else if (strcmp(optarg, "uring") == 0) {
+          backend = BACKEND_URING;
+        }
+        else {
+          fprintf(stderr,"Error: Bad backend %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // metrics port
+      case 'a':
+        adminPort = atoi(optarg);
+        if (adminPort == 0) {
+          fprintf(stderr,"Error: Bad port number %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // room history kept for observers that attach
+      case 'H':
+        historyMax = atoi(optarg);
+        if (historyMax < 0) {
+          fprintf(stderr,"Error: Bad history size %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'B':
+        historyBytesMax = atol(optarg);
+        if (historyBytesMax < 0) {
+          fprintf(stderr,"Error: Bad history size %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+      case 'T':
+        historySeconds = atoi(optarg);
+        if (historySeconds < 0) {
+          fprintf(stderr,"Error: Bad history age %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // directory of the message log
+      case 'l':
+        logDir = optarg;
+        break;
+
+      // connections each shard may hold, of each kind
+      case 'c':
+        connMax = atoi(optarg);
+        if (connMax < 1 || connMax > CONNLIMIT) {
+          fprintf(stderr,"Error: Bad connection count %s (1-%d)\n", optarg, CONNLIMIT);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // how much the server says about itself
+      case 'v':
+        if (strcmp(optarg, "debug") == 0) {
+          traceLevel = TRACE_DEBUG;
+        }
+        else if (strcmp(optarg, "info") == 0) {
+          traceLevel = TRACE_INFO;
+        }
+        else if (strcmp(optarg, "warn") == 0) {
+          traceLevel = TRACE_WARN;
+        }
+        else if (strcmp(optarg, "off") == 0) {
+          traceLevel = TRACE_OFF;
+        }
+        else {
+          fprintf(stderr,"Error: Bad trace level %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      // port other servers dial for federation links
+      case 'f':
+        fedPort = atoi(optarg);
+        if (fedPort == 0) {
+          fprintf(stderr,"Error: Bad port number %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        federated = true;
+        break;
+
+      // a server to dial, host:port
+      case 'P': {
+        char *colon = strrchr(optarg, ':');
+        if (colon == NULL || atoi(colon + 1) <= 0 || atoi(colon + 1) > 65535) {
+          fprintf(stderr,"Error: Bad peer %s (host:port)\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        if (peerCount == MAXPEERS) {
+          fprintf(stderr,"Error: Too many peers (at most %d)\n", MAXPEERS);
+          exit(EXIT_FAILURE);
+        }
+        *colon = '\0';
+        struct hostent *ptrh = gethostbyname(optarg);
+        if (ptrh == NULL) {
+          fprintf(stderr,"Error: Invalid host: %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        peer *l = &peers[peerCount++];
+        l->addr.sin_family = AF_INET;
+        l->addr.sin_port = htons(atoi(colon + 1));
+        memcpy(&l->addr.sin_addr, ptrh->h_addr, ptrh->h_length);
+        l->dialed = true;
+        federated = true;
+        break;
+      }
+
+      // this node's id, which decides who keeps a name two nodes claim
+      case 'N':
+        nodeId = strtoul(optarg, NULL, 10);
+        if (nodeId == 0) {
+          fprintf(stderr,"Error: Bad node id %s\n", optarg);
+          exit(EXIT_FAILURE);
+        }
+        break;
+
+      default:
+        argc = 0;
+        break;
+    }
+  }
+
+  if( argc - optind != 2 ) {
+    fprintf(stderr,"Error: Wrong number of arguments\n");
+    fprintf(stderr,"usage:\n");
+    fprintf(stderr,"./server [-w queue_frames] [-p drop|disconnect] [-t threads] [-b poll|uring]\n");
+    fprintf(stderr,"         [-a admin_port] [-H history_frames] [-B history_bytes] [-T history_seconds]\n");
+    fprintf(stderr,"         [-l log_dir] [-c connections] [-v debug|info|warn|off]\n");
+    fprintf(stderr,"         [-f federation_port] [-P peer_host:port]... [-N node_id]\n");
+    fprintf(stderr,"         participant_port observer_port\n");
+    exit(EXIT_FAILURE);
+  }
+  argv += optind - 1;
+
+  participantPort = atoi(argv[1]);
+  observerPort = atoi(argv[2]);
+
+  /* Tests for illegal value */
+  if (participantPort == 0) {
+    fprintf(stderr,"Error: Bad port number %s\n",argv[1]);
+    exit(EXIT_FAILURE);
+  }
+  if (observerPort == 0) {
+    fprintf(stderr,"Error: Bad port number %s\n",argv[2]);
+    exit(EXIT_FAILURE);
+  }
+  /* Map TCP transport protocol name to protocol number */
+  if ( ((long int)(ptrp = getprotobyname("tcp"))) == 0) {
+    fprintf(stderr, "Error: Cannot map \"tcp\" to protocol number");
+    exit(EXIT_FAILURE);
+  }
+  tcpProto = ptrp->p_proto;
+
+#ifndef USE_SELECT
+  // every connection is a descriptor, take as many as we are allowed
+  struct rlimit fds;
+  if (getrlimit(RLIMIT_NOFILE, &fds) == 0 && fds.rlim_cur < fds.rlim_max) {
+    fds.rlim_cur = fds.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &fds);
+  }
+#endif
+
+  // room for every participant of every shard at half load, and for the
+  // users of other nodes when federated
+  remoteMax = federated ? REMOTEUSERS * connMax * shardCount : 0;
+  nameTableSize = 1;
+  while (nameTableSize < 2 * ((long)connMax * shardCount + remoteMax)) {
+    nameTableSize *= 2;
+  }
+  nameTable = calloc(nameTableSize, sizeof(nameEntry));
+  if (nameTable == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+
+  // zeroed pages, a room's only get touched once its id is handed out
+  maxRooms = connMax * shardCount + 1;
+  rooms = calloc(maxRooms, sizeof(room));
+  roomTable = calloc(nameTableSize, sizeof(roomEntry));
+  if (rooms == NULL || roomTable == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+
+  // counted in once and never out, so it stays
+  enterRoom(DEFAULTROOM);
+
+  if (logDir != NULL) {
+    logOpen();
+  }
+
+  for (int i = 0; i < shardCount; i++) {
+    if (pipe(shards[i].wake) < 0) {
+      fprintf(stderr, "Error: Pipe creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+    setNonBlocking(shards[i].wake[0]);
+    setNonBlocking(shards[i].wake[1]);
+    pthread_mutex_init(&shards[i].lock, NULL);
+  }
+
+  // a closed observer must not kill the server mid-send
+  signal(SIGPIPE, SIG_IGN);
+
+  // kill -USR1 prints the metrics, only the first shard's thread takes it
+  signal(SIGUSR1, requestStats);
+  sigset_t usr1;
+  sigemptyset(&usr1);
+  sigaddset(&usr1, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &usr1, NULL);
+  for (int i = 1; i < shardCount; i++) {
+    if (pthread_create(&shards[i].thread, NULL, runShard, &shards[i]) != 0) {
+      fprintf(stderr, "Error: Thread creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_t admin;
+  if (adminPort != 0 && pthread_create(&admin, NULL, runAdmin, NULL) != 0) {
+    fprintf(stderr, "Error: Thread creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_t logSync;
+  pthread_t logReader;
+  if (logDir != NULL && (pthread_create(&logSync, NULL, runLogSync, NULL) != 0 ||
+                         pthread_create(&logReader, NULL, runLogRead, NULL) != 0)) {
+    fprintf(stderr, "Error: Thread creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_t federation;
+  if (federated) {
+    // srand(time(0)) would give nodes started in the same second the same id
+    while (nodeId == 0) {
+      nodeId = (uint32_t)(wallNs() ^ (uint64_t)getpid() * 2654435761u);
+    }
+    TRACE(TRACE_INFO, "federation node id %u", NULL, nodeId, 0);
+    if (pipe(fedWake) < 0) {
+      fprintf(stderr, "Error: Pipe creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+    setNonBlocking(fedWake[0]);
+    setNonBlocking(fedWake[1]);
+    if (pthread_create(&federation, NULL, runFederation, NULL) != 0) {
+      fprintf(stderr, "Error: Thread creation failed\n");
+      exit(EXIT_FAILURE);
+    }
+  }
+  pthread_t trace;
+  if (traceLevel < TRACE_OFF && pthread_create(&trace, NULL, runTrace, NULL) != 0) {
+    fprintf(stderr, "Error: Thread creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  pthread_sigmask(SIG_UNBLOCK, &usr1, NULL);
+
+  // this thread runs the first shard
+  runShard(&shards[0]);
+  return 0;
+} //main
+
+void* runShard(void *arg) {
+  struct sockaddr_in cad; 	/* structure to hold client's address */
+  int sdpart, sdobs;         /* socket descriptors */
+  int alen;               	/* length of address */
+
+  me = arg;
+  shardId = me - shards;
+  subs = calloc(maxRooms, sizeof(subscribers));
+  cutRooms = malloc(sizeof(int) * maxRooms);
+  if (subs == NULL || cutRooms == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+
+  sdpart = openListener(participantPort);
+  sdobs = openListener(observerPort);
+
+  loopEvent events[MAXEVENTS];
+  int n;
+
+  // Initialize participants and observers
+  initializeSDs();
+
+  // what the lobby said before the restart
+  if (shardId == 0 && logDir != NULL) {
+    logWarm();
+  }
+  wheelNow = monoMs() / WHEELTICK;
+  loopInit();
+  loopAdd(sdpart, TAG_PARTLISTEN, 0);
+  loopAdd(sdobs, TAG_OBSLISTEN, 0);
+  loopAdd(me->wake[0], TAG_WAKE, 0);
+
+  if (backend == BACKEND_URING) {
+    runUring();
+  }
+
+  while(1){
+
+    // don't sleep while a participant still has unread input,
+    // or past the next handshake deadline
+    n = loopWait(events, MAXEVENTS, backlogCount > 0 ? 0 : timerTimeout());
+    uint64_t passStart = monoNs();
+    TRACE(TRACE_DEBUG, "status:%d", NULL, n, 0);
+    timerAdvance();
+
+    if (shardId == 0 && statsRequested) {
+      printStats();
+    }
+
+    // game logic
+    for (int e = 0; e < n; e++) {
+      switch (events[e].tag) {
+
+        // A participant is connecting
+        case TAG_PARTLISTEN:
+          while (connectingPart(sdpart, cad, alen) >= 0);
+          break;
+
+        // An observer is connecting
+        case TAG_OBSLISTEN:
+          while (connectingObs(sdobs, cad, alen) >= 0);
+          break;
+
+        // Messages
+        case TAG_PART:
+          handlePart(events[e].slot);
+          break;
+
+        // Observer has room for queued frames, or is trying to send
+        // something to server (the observer never sends anything to server)
+        case TAG_OBS:
+          if (events[e].writable) {
+            flushObs(events[e].slot);
+          }
+          if (events[e].readable) {
+            handleObs(events[e].slot);
+          }
+          break;
+
+        // Another shard left mail
+        case TAG_WAKE:
+          drainMail();
+          break;
+      }
+    }
+
+    // leave notices built outside parsePart
+    arenaReset();
+
+    // participants that ran out of read budget get another turn
+    int turns = backlogCount;
+    memcpy(turn, backlog, sizeof(int) * turns);
+    backlogCount = 0;
+    for (int i = 0; i < turns; i++) {
+      partCold[turn[i]].backlogged = false;
+      handlePart(turn[i]);
+    }
+
+    // everything v2 observers got this pass goes out as one frame each
+    flushBatches();
+
+    // hand this pass's broadcasts to the other shards
+    flushMail();
+
+    __atomic_store_n(&me->stats.participants, pSize, __ATOMIC_RELAXED);
+    __atomic_store_n(&me->stats.observers, oSize, __ATOMIC_RELAXED);
+    histRecord(&me->stats.loopTime, monoNs() - passStart);
+  }   //while game continues
+  return NULL;
+}
+
+int openListener(uint16_t port) {
+  struct sockaddr_in sad; 	/* structure to hold server's address */
+  int optval = 1;         	/* boolean value when we set socket option */
+  int sd;
+
+  memset((char *)&sad,0,sizeof(sad)); /* clear sockaddr structure */
+  sad.sin_family = AF_INET;
+  sad.sin_addr.s_addr = INADDR_ANY;
+  sad.sin_port = htons(port);
+
+  /* Creates a socket and returns a socket descriptor named sd. */
+  sd = socket(AF_INET, SOCK_STREAM, tcpProto);
+  if (sd < 0) {
+    fprintf(stderr, "Error: Socket creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  /* Allow reuse of port - avoid "Bind failed" issues */
+  if( setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &optval, sizeof(optval)) < 0 ) {
+    fprintf(stderr, "Error Setting socket option failed\n");
+    exit(EXIT_FAILURE);
+  }
+  /* Every shard listens on the same port, the kernel spreads connections over them */
+  if( shardCount > 1 && setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &optval, sizeof(optval)) < 0 ) {
+    fprintf(stderr, "Error Setting socket option failed\n");
+    exit(EXIT_FAILURE);
+  }
+  /* Bind a local address to the socket. */
+  if (bind(sd, (struct sockaddr *) &sad, sizeof(sad)) < 0) {
+    fprintf(stderr,"Error: Bind failed\n");
+    exit(EXIT_FAILURE);
+  }
+  /* Specify size of request queue. */
+  if (listen(sd, QLEN) < 0) {
+    fprintf(stderr,"Error: Listen failed\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // Listening sockets never block so one wakeup can drain every pending connection
+  setNonBlocking(sd);
+  return sd;
+}
+
+
+void doMessage(int j, const char *body, uint16_t messageLength) {
+  char message[MAXMSG+1];
+  memcpy(message, body, messageLength);
+  message[messageLength] = '\0';
+
+  // moving to another room
+  if (strncmp(message, "/join ", 6) == 0) {
+    joinRoom(j, message + 6);
+    return;
+  }
+
+  // catching up from the log
+  if (strncmp(message, "/replay ", 8) == 0) {
+    replayLog(j, atoi(message + 8));
+    return;
+  }
+
+  // private, "@name text": the name ends at the first space or the end of
+  // the message and is cut off in place, so nothing is copied out of it
+  if (message[0] == '@' && message[1] != ' ') {
+    int p = 1;
+    while (p < messageLength && message[p] != ' ') {
+      p++;
+    }
+    message[p] = '\0';
+    const char *recipName = message + 1;
+    const char *text = p < messageLength ? message + p + 1 : "";
+
+    // checks if recipient is active, nobody has a name that long
+    int recipShard = shardId;
+    int recipObs = p - 1 <= 10 ? findObsSlot(recipName, &recipShard) : -1;
+    int senderObs = partCold[j].obs;
+    int recipLink;
+
+    if (recipObs >= 0) {
+      frame *f = makeMessage(REC_PRIVATE, partCold[j].name, text);
+
+      // send to observer affiliated with recipient, through its shard's mail
+      // if it lives elsewhere
+      if(recipShard != shardId){
+        postMail(recipShard, MAIL_PRIVATE, f, -1, recipName);
+      }
+      else if(observers[recipObs].sdobs != 0){
+        sendFrame(recipObs, f);
+      }
+
+      // send to observer affiliated with sender, always in this shard
+      if(senderObs >= 0){
+        sendFrame(senderObs, f);
+      }
+      releaseFrame(f);
+    }
+
+    // a user of another node, its node has the observer
+    else if(p - 1 <= 10 && (recipLink = findRemote(recipName)) >= 0){
+      federate(recipLink, FED_PRIVATE, recipName, partCold[j].name, text);
+      if(senderObs >= 0){
+        frame *f = makeMessage(REC_PRIVATE, partCold[j].name, text);
+        sendFrame(senderObs, f);
+        releaseFrame(f);
+      }
+    }
+
+    // send to observer affiliated with sender
+    else if(senderObs >= 0){
+      char* msgToSend = concat("Warning: user ", recipName, " doesn't exist...");
+      frame *f = makeFrame(msgToSend, strlen(msgToSend));
+      f->record = makeRecord(REC_WARNING, NULL, msgToSend);
+      sendFrame(senderObs, f);
+      releaseFrame(f);
+    }
+  }
+
+  //public
+  else {
+    // encoded once, every observer queue points at the same frame
+    frame *f = makeMessage(REC_PUBLIC, partCold[j].name, message);
+    broadcastFrame(f, participants[j].room, -1);
+    releaseFrame(f);
+    federate(-1, FED_PUBLIC, rooms[participants[j].room].name, partCold[j].name, message);
+  }
+}
+
+int connectingPart(int sdpart, struct sockaddr_in cad, int alen){
+  alen = sizeof(cad);
+  int sd;
+  if ((sd = accept(sdpart, (struct sockaddr *)&cad, &alen)) < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return -1;
+    }
+    if (errno == EMFILE || errno == ENFILE) {
+      return refuseSpare(sdpart, 0);
+    }
+    fprintf(stderr, "Error: Accept failed\n");
+    exit(EXIT_FAILURE);
+  }
+  setNonBlocking(sd);
+  return admitPart(sd);
+}
+
+int connectingObs(int sdobs, struct sockaddr_in cad, int alen){
+  alen = sizeof(cad);
+  int sd;
+  if ((sd = accept(sdobs, (struct sockaddr *)&cad, &alen)) < 0) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return -1;
+    }
+    if (errno == EMFILE || errno == ENFILE) {
+      return refuseSpare(sdobs, 1);
+    }
+    fprintf(stderr, "Error: Accept failed\n");
+    exit(EXIT_FAILURE);
+  }
+  setNonBlocking(sd);
+  return admitObs(sd);
+}
+
+int refuseSpare(int listener, int role) {
+  if (spareFd < 0 && (spareFd = open("/dev/null", O_RDONLY)) < 0) {
+    return -1;
+  }
+  close(spareFd);
+  int sd = accept(listener, NULL, NULL);
+  if (sd >= 0) {
+    COUNT(refused[role], 1);
+    char buf[]={'N'};
+    send(sd, &buf, sizeof(char), 0);
+    close(sd);
+  }
+
+  // another shard may have taken it meanwhile, then the next refusal has to wait
+  spareFd = open("/dev/null", O_RDONLY);
+  return sd < 0 ? -1 : connMax;
+}
+
+int admitPart(int sd){
+  if (freePart == -1 && pHigh < connMax) {
+    growSlots(participants, partCold, &pHigh, &freePart, TAG_PART);
+  }
+  int j = freePart == -1 || !loopFits(sd) ? connMax : freePart;
+
+  //array is full
+  if(j == connMax){
+    COUNT(refused[0], 1);
+    char buf2[]={'N'};
+    send(sd, &buf2, sizeof(char), 0);
+    close(sd);
+  }
+
+  else{
+    freePart = partCold[j].nextFree;
+    participants[j].sdparts = sd;
+    loopAdd(sd, TAG_PART, j);
+
+    // case 1: connection
+    if (participants[j].state  == -1) {
+      if (pSize < connMax){
+        char buf[]={'Y'};
+        send(participants[j].sdparts, &buf, sizeof(char), 0);
+        timerArm(&partCold[j].handshake, TIMER * 1000);
+        participants[j].state  = 0;
+        pSize++;
+      }
+    }
+  }
+  return j;
+}
+
+int admitObs(int sd){
+  if (freeObs == -1 && oHigh < connMax) {
+    growSlots(observers, obsCold, &oHigh, &freeObs, TAG_OBS);
+  }
+  int j = freeObs == -1 || !loopFits(sd) ? connMax : freeObs;
+
+  //array is full
+  if(j == connMax){
+    COUNT(refused[1], 1);
+    char buf2[]={'N'};
+    send(sd, &buf2, sizeof(char), 0);
+    close(sd);
+  }
+
+  else{
+    freeObs = obsCold[j].nextFree;
+    observers[j].sdobs = sd;
+    loopAdd(sd, TAG_OBS, j);
+
+    // case 1: connection
+    if (observers[j].state  == -1) {
+      if (oSize < connMax){
+        char buf[]={'Y'};
+        send(observers[j].sdobs, &buf, sizeof(char), 0);
+        timerArm(&obsCold[j].handshake, TIMER * 1000);
+        observers[j].state  = 0;
+        oSize++;
+      }
+    }
+  }
+  return j;
+}
+
+void usernamePart(int j, const char *nameBuf, uint8_t nameLength){
+
+  // asking/checking username of participants
+  // big enough for any length byte so a bad name can't overflow
+  char name[256] = {'\0'};
+  memcpy(name, nameBuf, nameLength);
+
+  // running out of time is handled by the handshake timer
+
+  bool validLength = true;
+  if (nameLength > 10 || nameLength == 0){
+    validLength = false;
+  }
+
+  bool validChar = true;
+  for (int i = 0; i < nameLength; i++){
+    char currChar = name[i];
+    if (!(currChar == 95 || (currChar >= 48 && currChar <= 57) || (currChar >= 65 && currChar <= 90) || (currChar >= 97 && currChar <= 122))){
+      validChar = false;
+    }
+  }
+
+  name[nameLength] = '\0';
+
+  // checked and claimed under one lock, another shard may want the same name
+  pthread_mutex_lock(&nameLock);
+  bool alreadyGuessed = validLength && findName(name) != NULL;
+  if(validLength && validChar && !alreadyGuessed){
+    addName(name, j);
+  }
+  pthread_mutex_unlock(&nameLock);
+
+  if(validLength && validChar && !alreadyGuessed){
+
+    strcpy(partCold[j].name, name);
+    participants[j].state = 1;
+    participants[j].room = enterRoom(DEFAULTROOM);
+    timerCancel(&partCold[j].handshake);
+
+    //send 'Y' to participant
+    COUNT(handshakes[0][HS_Y], 1);
+    char buf[] = {'Y'};
+    send(participants[j].sdparts, &buf, sizeof(char), 0);
+
+    // send the name to everybody that "a new 'username' joined"
+    char* str1 = "User ";
+    // str2 will be name
+    char* str3 = " has joined";
+    char* message = concat(str1, name, str3);
+    frame *f = makeFrame(message, strlen(message));
+    f->record = makeRecord(REC_JOIN, name, NULL);
+    broadcastFrame(f, participants[j].room, -1);
+    releaseFrame(f);
+    federate(-1, FED_ONLINE, name, NULL, NULL);
+    federate(-1, FED_JOIN, DEFAULTROOM, name, NULL);
+  }
+
+  else{
+    if(validLength == false || validChar == false){
+
+      //send 'I'
+      //do not reset timer
+      COUNT(handshakes[0][HS_I], 1);
+      char buf[] = {'I'};
+      send(participants[j].sdparts, &buf, sizeof(char), 0);
+    }
+
+    else if(alreadyGuessed){
+
+      //send 'T'
+      //reset timer
+      COUNT(handshakes[0][HS_T], 1);
+      char buf[] = {'T'};
+      send(participants[j].sdparts, &buf, sizeof(char), 0);
+      timerArm(&partCold[j].handshake, TIMER * 1000);
+    }
+  } //end else
+}
+
+void usernameObs(int j, const char *nameBuf, uint8_t nameLength){
+
+  TRACE(TRACE_DEBUG, "The length of the name we are receivng is : %d", NULL, nameLength, 0);
+
+  // big enough for any length byte so a bad name can't overflow
+  char name[256] = {'\0'};
+  memcpy(name, nameBuf, nameLength);
+
+  TRACE(TRACE_DEBUG, "the given name is: %s", name, 0, 0);
+
+  // claim the participant while holding the lock, if it lives in this shard
+  pthread_mutex_lock(&nameLock);
+  nameEntry *e = findName(name);
+
+  // a user of another node, its observer has to attach there
+  if (e != NULL && e->peer >= 0) {
+    e = NULL;
+  }
+  bool noMatch = e == NULL;
+  bool taken = false;
+  int a = -1;
+  int target = shardId;
+  if(e != NULL){
+    a = e->part;
+    target = e->shard;
+    taken = e->obs >= 0;
+    if(!taken && target == shardId){
+      e->obs = j;
+    }
+  }
+  pthread_mutex_unlock(&nameLock);
+
+  if(e != NULL){
+
+    // lives in another shard, which finishes the job
+    if(!taken && target != shardId){
+      handOffObs(j, target, name);
+    }
+
+    //no observer yet, send "I"
+    else if(!taken){
+      TRACE(TRACE_DEBUG, "I found a participant with the name I'm looking for!!", NULL, 0, 0);
+      COUNT(handshakes[1][HS_Y], 1);
+      char buf={'Y'};
+      send(observers[j].sdobs, &buf, sizeof(char), 0);
+      participants[a].sdobs = observers[j].sdobs;
+      partCold[a].obs = j;
+      observers[j].sdparts  = participants[a].sdparts;
+      observers[j].state    = 1;
+      strcpy(obsCold[j].name, name);
+      timerCancel(&obsCold[j].handshake);
+      subscribeObs(j, participants[a].room);
+
+      // what it missed, ahead of everything that comes next
+      replayHistory(j, participants[a].room);
+
+      //send the name to everybody that "a new observer joined"
+      char message[] = ("A new observer has joined");
+      frame *f = makeFrame(message, strlen(message));
+      f->record = makeRecord(REC_OBSJOIN, NULL, NULL);
+      broadcastFrame(f, participants[a].room, j);
+      releaseFrame(f);
+
+      // from here on its broadcasts come compressed
+      if (observers[j].compress == COMPRESS_DEFLATE) {
+        joinShared(j);
+      }
+    }
+
+    //they already have an observer send 'T'
+    //reset timer
+    else{
+      COUNT(handshakes[1][HS_T], 1);
+      char buf= {'T'};
+      send(observers[j].sdobs, &buf, sizeof(char), 0);
+      timerArm(&obsCold[j].handshake, TIMER * 1000);
+    }
+  }
+  if(noMatch){
+    TRACE(TRACE_DEBUG, "I got into the case where I didn't find the name", NULL, 0, 0);
+    COUNT(handshakes[1][HS_N], 1);
+    char buf2[]={'N'};
+    send(observers[j].sdobs, &buf2, sizeof(char), 0);
+    oSize--;
+    resetObsSD(j);
+  }
+}
+
+void disconnectPart(int j) {
+  TRACE(TRACE_INFO, "CLOSING ACTIVE PARTICIPANT SOCKET %s", partCold[j].name, 0, 0);
+
+  char* msgToSend = concat("User ", partCold[j].name, " has left");
+  frame *f = makeFrame(msgToSend, strlen(msgToSend));
+  f->record = makeRecord(REC_LEAVE, partCold[j].name, NULL);
+  broadcastFrame(f, participants[j].room, -1);
+  releaseFrame(f);
+  federate(-1, FED_LEAVE, rooms[participants[j].room].name, partCold[j].name, NULL);
+  federate(-1, FED_OFFLINE, partCold[j].name, NULL, NULL);
+
+  // the affiliated observer lives in this shard too, and the name may
+  // already belong to a user of another node (see evictPart)
+  pthread_mutex_lock(&nameLock);
+  nameEntry *e = findName(partCold[j].name);
+  int i = partCold[j].obs;
+  if (e != NULL && e->shard == shardId && e->part == j && e->peer < 0) {
+    removeName(partCold[j].name);
+  }
+  else if (e != NULL && e->shard == shardId && e->part == j) {
+    e->shard = -1;
+    e->part = -1;
+    e->obs = -1;
+  }
+  pthread_mutex_unlock(&nameLock);
+
+  // affiliated observer is disconnected as well
+  if (i >= 0) {
+    TRACE(TRACE_INFO, "CLOSING ACTIVE PARTICIPANT'S OBSERVER SOCKET", NULL, 0, 0);
+    oSize--;
+    resetObsSD(i);
+  }
+
+  pSize--;
+  resetPartSD(j);
+}
+
+void disconnectObs(int j) {
+  // frees the participant so an observer can attach with the same username again
+  pthread_mutex_lock(&nameLock);
+  nameEntry *e = observers[j].state == 1 ? findName(obsCold[j].name) : NULL;
+  if (e != NULL && e->shard == shardId && e->obs == j) {
+    participants[e->part].sdobs = 0;
+    partCold[e->part].obs = -1;
+    e->obs = -1;
+  }
+  pthread_mutex_unlock(&nameLock);
+  TRACE(TRACE_INFO, "CLOSING ACTIVE PARTICIPANT'S OBSERVER SOCKET", NULL, 0, 0);
+  oSize--;
+  resetObsSD(j);
+}
+
+void handlePart(int j) {
+  int sd = participants[j].sdparts;
+  bool closed = false;
+
+  // stale wakeup for a slot that was already reset
+  if (sd == 0) {
+    return;
+  }
+
+  int len = restorePartial(&partCold[j]);
+  int reads = 0;
+
+  // edge-triggered, so keep reading until the socket would block
+  while (participants[j].sdparts == sd) {
+
+    // had its share for this wakeup, finish later
+    if (reads == READBUDGET) {
+      if (!partCold[j].backlogged) {
+        partCold[j].backlogged = true;
+        backlog[backlogCount++] = j;
+      }
+      break;
+    }
+    reads++;
+
+    int n = recv(sd, readBuf + len, READBUFSIZE - len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      closed = true;
+      break;
+    }
+    len += n;
+
+    // handle every complete frame, slide the cut-off tail to the front
+    int used = parsePart(j, sd, readBuf, len);
+    len -= used;
+    memmove(readBuf, readBuf + used, len);
+  }
+
+  // a handler already disconnected this participant
+  if (participants[j].sdparts != sd) {
+    return;
+  }
+
+  if (closed) {
+    dropPart(j);
+    return;
+  }
+
+  stashPartial(&partCold[j], readBuf, len);
+}
+
+void dropPart(int j) {
+
+  // close everything
+  if (participants[j].state == 0) {
+    TRACE(TRACE_DEBUG, "I AM CLOSING THE SOCKET IN PARTICPANT USER", NULL, 0, 0);
+    pSize--;
+    resetPartSD(j);
+  }
+
+  // Active participant disconnected
+  else {
+    disconnectPart(j);
+  }
+}
+
+void handleObs(int j) {
+  int sd = observers[j].sdobs;
+  bool closed = false;
+
+  if (sd == 0) {
+    return;
+  }
+
+  int len = restorePartial(&obsCold[j]);
+
+  while (observers[j].sdobs == sd) {
+    int n = recv(sd, readBuf + len, READBUFSIZE - len, 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      break;
+    }
+    if (n <= 0) {
+      closed = true;
+      break;
+    }
+    len += n;
+
+    int used = parseObs(j, sd, readBuf, len);
+    len -= used;
+    memmove(readBuf, readBuf + used, len);
+  }
+
+  if (observers[j].sdobs != sd) {
+    return;
+  }
+
+  //someone quit
+  if (closed) {
+    TRACE(TRACE_INFO, "an observer quit", NULL, 0, 0);
+    disconnectObs(j);
+    return;
+  }
+
+  stashPartial(&obsCold[j], readBuf, len);
+}
+
+int parsePart(int j, int sd, const char *buf, int len) {
+  int used = 0;
+
+  // stop as soon as a handler resets the slot
+  while (participants[j].sdparts == sd) {
+
+    // Connected participants need a username
+    if (participants[j].state == 0) {
+      if (len - used < (int)sizeof(uint8_t)) {
+        break;
+      }
+      uint8_t nameLength = (uint8_t)buf[used];
+
+      // asking for another protocol version first
+      if (nameLength == PROTO_HELLO) {
+        if (len - used < 2) {
+          break;
+        }
+        negotiate(&participants[j], sd, buf[used + 1]);
+        used += 2;
+        continue;
+      }
+      if (nameLength == PROTO_COMPRESS) {
+        if (len - used < 2) {
+          break;
+        }
+        negotiateCompress(&participants[j], sd, buf[used + 1], false);
+        used += 2;
+        continue;
+      }
+      if (len - used < (int)sizeof(uint8_t) + nameLength) {
+        break;
+      }
+      COUNT(bytesIn, sizeof(uint8_t) + nameLength);
+      usernamePart(j, buf + used + sizeof(uint8_t), nameLength);
+      used += sizeof(uint8_t) + nameLength;
+      arenaReset();
+    }
+
+    // Sending a v2 frame, records are handled as soon as each one is in
+    else if (participants[j].version == 2) {
+      if (partCold[j].frameLeft == 0) {
+        uint32_t frameLength;
+        if (len - used < V2HEADER) {
+          break;
+        }
+        memcpy(&frameLength, buf + used, V2HEADER);
+        frameLength = ntohl(frameLength);
+        if (frameLength > V2FRAMEMAX) {
+          TRACE(TRACE_WARN, "v2 frame too long, disconnecting participant %s", partCold[j].name, 0, 0);
+          disconnectPart(j);
+          break;
+        }
+        COUNT(bytesIn, V2HEADER);
+        partCold[j].frameLeft = frameLength;
+        used += V2HEADER;
+        continue;
+      }
+
+      uint16_t recordLength;
+      if (len - used < V2RECORD) {
+        break;
+      }
+      memcpy(&recordLength, buf + used + 1, sizeof(uint16_t));
+      recordLength = ntohs(recordLength);
+
+      // too long or spilling out of its frame, no need to wait for the body
+      if (recordLength >= MAXMSG || (uint32_t)(V2RECORD + recordLength) > partCold[j].frameLeft) {
+        TRACE(TRACE_WARN, "bad v2 record, disconnecting participant", NULL, 0, 0);
+        disconnectPart(j);
+        break;
+      }
+      if (len - used < V2RECORD + recordLength) {
+        break;
+      }
+      COUNT(messagesIn, 1);
+      COUNT(bytesIn, V2RECORD + recordLength);
+      partCold[j].frameLeft -= V2RECORD + recordLength;
+      doRecord(j, buf[used], buf + used + V2RECORD, recordLength);
+      used += V2RECORD + recordLength;
+      arenaReset();
+    }
+
+    // Sending a message
+    else {
+      uint16_t messageLength;
+      if (len - used < (int)sizeof(uint16_t)) {
+        break;
+      }
+      memcpy(&messageLength, buf + used, sizeof(uint16_t));
+
+      // too long, no need to wait for the body
+      if (messageLength >= MAXMSG) {
+        TRACE(TRACE_WARN, "we will disconnect participants[%d]", NULL, j, 0);
+        disconnectPart(j);
+        break;
+      }
+      if (len - used < (int)sizeof(uint16_t) + messageLength) {
+        break;
+      }
+      COUNT(messagesIn, 1);
+      COUNT(bytesIn, sizeof(uint16_t) + messageLength);
+      doMessage(j, buf + used + sizeof(uint16_t), messageLength);
+      used += sizeof(uint16_t) + messageLength;
+      arenaReset();
+    }
+  }
+  return used;
+}
+
+int parseObs(int j, int sd, const char *buf, int len) {
+  int used = 0;
+
+  while (observers[j].sdobs == sd) {
+
+    // Getting a username to associate with participant
+    if (observers[j].state == 0) {
+      if (len - used < (int)sizeof(uint8_t)) {
+        break;
+      }
+      uint8_t nameLength = (uint8_t)buf[used];
+
+      // asking for another protocol version first
+      if (nameLength == PROTO_HELLO) {
+        if (len - used < 2) {
+          break;
+        }
+        negotiate(&observers[j], sd, buf[used + 1]);
+        used += 2;
+        continue;
+      }
+
+      // and compression after that
+      if (nameLength == PROTO_COMPRESS) {
+        if (len - used < 2) {
+          break;
+        }
+        negotiateCompress(&observers[j], sd, buf[used + 1], true);
+        used += 2;
+        continue;
+      }
+      if (len - used < (int)sizeof(uint8_t) + nameLength) {
+        break;
+      }
+      usernameObs(j, buf + used + sizeof(uint8_t), nameLength);
+      used += sizeof(uint8_t) + nameLength;
+      arenaReset();
+    }
+
+    // The observer never sends anything to server once attached
+    else {
+      used = len;
+      break;
+    }
+  }
+  return used;
+}
+
+void negotiate(client *c, int sd, uint8_t wanted) {
+  c->version = wanted > PROTO_MAX ? PROTO_MAX : wanted < 1 ? 1 : wanted;
+  c->compress = COMPRESS_NONE;
+  char buf[] = {'V', c->version};
+  send(sd, &buf, sizeof(buf), 0);
+}
+
+void negotiateCompress(client *c, int sd, uint8_t wanted, bool observer) {
+  c->compress = COMPRESS_NONE;
+#ifndef USE_ZLIB
+  (void)wanted;
+  (void)observer;
+#else
+  // only what goes to observers is compressed, and only inside v2 frames
+  if (observer && c->version == 2 && wanted == COMPRESS_DEFLATE) {
+    c->compress = COMPRESS_DEFLATE;
+  }
+#endif
+  char buf[] = {'Z', c->compress};
+  send(sd, &buf, sizeof(buf), 0);
+}
+
+void doRecord(int j, uint8_t type, const char *body, uint16_t bodyLength) {
+  if (type == REC_PUBLIC) {
+    doMessage(j, body, bodyLength);
+  }
+
+  // the same "@name text" a v1 participant would have sent
+  else if (type == REC_PRIVATE && bodyLength > 0 && (uint8_t)body[0] >= 1 &&
+           (uint8_t)body[0] <= 10 && 1 + (uint8_t)body[0] <= bodyLength) {
+    uint8_t recipLength = body[0];
+    char message[MAXMSG + 1];
+    message[0] = '@';
+    memcpy(message + 1, body + 1, recipLength);
+    message[1 + recipLength] = ' ';
+    memcpy(message + 2 + recipLength, body + 1 + recipLength, bodyLength - 1 - recipLength);
+    doMessage(j, message, bodyLength + 1);
+  }
+
+  else {
+    TRACE(TRACE_WARN, "bad v2 record, disconnecting participant", NULL, 0, 0);
+    disconnectPart(j);
+  }
+}
+
+int restorePartial(clientCold *c) {
+  int len = c->partialLen;
+  if (len > 0) {
+    memcpy(readBuf, c->partial, len);
+    c->partialLen = 0;
+  }
+  return len;
+}
+
+void stashPartial(clientCold *c, const char *buf, int len) {
+  if (len == 0) {
+    return;
+  }
+  if (c->partial == NULL) {
+    c->partial = malloc(PARTIALSIZE);
+    if (c->partial == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+  memcpy(c->partial, buf, len);
+  c->partialLen = len;
+}
+
+void setNonBlocking(int sd) {
+  int flags = fcntl(sd, F_GETFL, 0);
+  if (flags < 0 || fcntl(sd, F_SETFL, flags | O_NONBLOCK) < 0) {
+    fprintf(stderr, "Error: Setting O_NONBLOCK failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
+
+frame* allocFrame(int size) {
+  size += sizeof(frame);
+  int c = 0;
+  while (c < POOLCLASSES && poolSizes[c] < size) {
+    c++;
+  }
+
+  frame *f;
+
+  // bigger than any class, not pooled
+  if (c == POOLCLASSES) {
+    f = malloc(size);
+    if (f == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+    COUNT(allocs, 1);
+    f->sizeClass = -1;
+  }
+
+  else {
+
+    // take back whatever other shards finished with
+    if (poolFree[c] == NULL && __atomic_load_n(&me->remoteFree, __ATOMIC_RELAXED) != NULL) {
+      frame *back = __atomic_exchange_n(&me->remoteFree, NULL, __ATOMIC_ACQUIRE);
+      while (back != NULL) {
+        frame *next = back->next;
+        back->next = poolFree[back->sizeClass];
+        poolFree[back->sizeClass] = back;
+        back = next;
+      }
+    }
+
+    // free list is empty, carve a new slab into frames of this class
+    if (poolFree[c] == NULL) {
+      char *slab = malloc(poolSizes[c] * SLABFRAMES);
+      if (slab == NULL) {
+        printf("out of memory\n");
+        exit(1);
+      }
+      COUNT(allocs, 1);
+      for (int i = 0; i < SLABFRAMES; i++) {
+        frame *spare = (frame *)(slab + i * poolSizes[c]);
+        spare->next = poolFree[c];
+        poolFree[c] = spare;
+      }
+    }
+
+    f = poolFree[c];
+    poolFree[c] = f->next;
+    f->sizeClass = c;
+  }
+
+  f->refs = 1;
+  f->owner = shardId;
+  f->next = NULL;
+  f->len = 0;
+  f->record = NULL;
+  return f;
+}
+
+frame* makeFrame(const char *message, uint16_t messageLength) {
+  frame *f = allocFrame(sizeof(uint16_t) + messageLength);
+  f->len = sizeof(uint16_t) + messageLength;
+  memcpy(f->data, &messageLength, sizeof(uint16_t));
+  memcpy(f->data + sizeof(uint16_t), message, messageLength);
+  return f;
+}
+
+frame* makeRecord(uint8_t type, const char *name, const char *text) {
+  uint8_t nameLength = name != NULL ? strlen(name) : 0;
+  int textLength = text != NULL ? strlen(text) : 0;
+  int prefix = name != NULL && text != NULL ? sizeof(uint8_t) : 0;
+  uint16_t bodyLength = prefix + nameLength + textLength;
+
+  frame *f = allocFrame(V2RECORD + bodyLength);
+  f->data[0] = type;
+  uint16_t wire = htons(bodyLength);
+  memcpy(f->data + 1, &wire, sizeof(uint16_t));
+  char *body = f->data + V2RECORD;
+  if (prefix > 0) {
+    *body++ = nameLength;
+  }
+  memcpy(body, name, nameLength);
+  memcpy(body + nameLength, text, textLength);
+  f->len = V2RECORD + bodyLength;
+  return f;
+}
+
+frame* makeMessage(uint8_t type, const char *name, const char *text) {
+  int nameLength = strlen(name);
+  int textLength = strlen(text);
+  uint16_t messageLength = 1 + 11 + 2 + textLength;
+
+  frame *f = allocFrame(sizeof(uint16_t) + messageLength);
+  memcpy(f->data, &messageLength, sizeof(uint16_t));
+  char *message = f->data + sizeof(uint16_t);
+  message[0] = type == REC_PRIVATE ? '-' : '>';
+  memset(message + 1, ' ', 11 - nameLength);
+  memcpy(message + 12 - nameLength, name, nameLength);
+  memcpy(message + 12, ": ", 2);
+  memcpy(message + 14, text, textLength);
+  f->len = sizeof(uint16_t) + messageLength;
+  f->record = makeRecord(type, name, text);
+  return f;
+}
+
+void releaseFrame(frame *f) {
+  if (__atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) > 0) {
+    return;
+  }
+  if (f->record != NULL) {
+    releaseFrame(f->record);
+  }
+  if (f->sizeClass < 0) {
+    free(f);
+  }
+  else if (f->owner == shardId) {
+    f->next = poolFree[f->sizeClass];
+    poolFree[f->sizeClass] = f;
+  }
+
+  // another shard's pool, it picks it up the next time it runs dry
+  else {
+    shard *s = &shards[f->owner];
+    f->next = __atomic_load_n(&s->remoteFree, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&s->remoteFree, &f->next, f, true,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  }
+}
+
+void sendFrame(int j, frame *f) {
+  if (observers[j].version < 2) {
+    queueFrame(j, f);
+  }
+  else if (f->record != NULL && observers[j].sdobs != 0) {
+
+    // anything the group already has for it goes first
+    if (observers[j].inGroup) {
+      cutShared(observers[j].room);
+    }
+    batchRecord(j, f->record);
+  }
+}
+
+void batchRecord(int j, frame *rec) {
+  frame *b = observers[j].batch;
+
+  // full, this one goes out now and the pass carries on in a new one
+  if (b != NULL && b->len + rec->len > poolSizes[POOLCLASSES - 1] - (int)sizeof(frame)) {
+    closeBatch(j);
+    b = NULL;
+  }
+  if (b == NULL) {
+    b = allocFrame(poolSizes[POOLCLASSES - 1] - sizeof(frame));
+    b->len = V2HEADER;
+    observers[j].batch = b;
+    batchesOpen = true;
+    if (!observers[j].batched) {
+      observers[j].batched = true;
+      batched[batchedCount++] = j;
+    }
+  }
+  memcpy(b->data + b->len, rec->data, rec->len);
+  b->len += rec->len;
+}
+
+void closeBatch(int j) {
+  frame *b = observers[j].batch;
+  observers[j].batch = NULL;
+  uint32_t wire = htonl(b->len - V2HEADER);
+  memcpy(b->data, &wire, V2HEADER);
+  queueFrame(j, b);
+  releaseFrame(b);
+}
+
+void flushBatches() {
+  if (!batchesOpen) {
+    return;
+  }
+  for (int i = 0; i < cutCount; i++) {
+    subs[cutRooms[i]].cutQueued = false;
+    cutShared(cutRooms[i]);
+  }
+  cutCount = 0;
+  batchesOpen = false;
+  for (int i = 0; i < batchedCount; i++) {
+    int j = batched[i];
+    observers[j].batched = false;
+    if (observers[j].batch != NULL) {
+      closeBatch(j);
+    }
+  }
+  batchedCount = 0;
+}
+
+#ifdef USE_ZLIB
+void joinShared(int j) {
+  subscribers *sub = &subs[observers[j].room];
+  if (sub->group == NULL) {
+    sub->group = calloc(1, sizeof(deflateGroup));
+    if (sub->group == NULL ||
+        deflateInit2(&sub->group->z, ZLEVEL, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+
+  // what is already pending was meant for the others only
+  cutShared(observers[j].room);
+  observers[j].inGroup = true;
+  observers[j].synced = false;
+  sub->group->members++;
+  sub->group->resetPending = true;
+}
+
+void leaveShared(int j) {
+  if (!observers[j].inGroup) {
+    return;
+  }
+  subscribers *sub = &subs[observers[j].room];
+  observers[j].inGroup = false;
+  observers[j].synced = false;
+
+  // a stream only takes up memory while someone uses it
+  if (--sub->group->members == 0) {
+    deflateEnd(&sub->group->z);
+    free(sub->group);
+    sub->group = NULL;
+  }
+}
+
+void shareRecord(int room, frame *rec) {
+  subscribers *sub = &subs[room];
+  if (sub->group != NULL && sub->group->pendingLen + rec->len > ZCHUNK) {
+    cutShared(room);
+  }
+
+  // every member may have gone while their frames were sent
+  deflateGroup *g = sub->group;
+  if (g == NULL) {
+    return;
+  }
+  memcpy(g->pending + g->pendingLen, rec->data, rec->len);
+  g->pendingLen += rec->len;
+  if (!sub->cutQueued) {
+    sub->cutQueued = true;
+    cutRooms[cutCount++] = room;
+  }
+  batchesOpen = true;
+}
+
+void cutShared(int room) {
+  subscribers *sub = &subs[room];
+  deflateGroup *g = sub->group;
+  if (g == NULL || g->pendingLen == 0) {
+    return;
+  }
+  uint64_t start = monoNs();
+
+  uint8_t flags = 0;
+  if (g->resetPending) {
+    deflateReset(&g->z);
+    deflateSetDictionary(&g->z, (const Bytef *)ZDICT, sizeof(ZDICT) - 1);
+    g->resetPending = false;
+    flags |= ZFLAG_RESET;
+    COUNT(compressResets, 1);
+  }
+
+  // as big as still fits a batch, ZCHUNK never deflates to more than that
+  int roomLeft = poolSizes[POOLCLASSES - 1] - sizeof(frame) - V2HEADER;
+  frame *rec = allocFrame(roomLeft);
+  rec->data[0] = REC_DEFLATE;
+  rec->data[V2RECORD] = flags;
+  g->z.next_in = (Bytef *)g->pending;
+  g->z.avail_in = g->pendingLen;
+  g->z.next_out = (Bytef *)rec->data + V2RECORD + 1;
+  g->z.avail_out = roomLeft - V2RECORD - 1;
+  if (deflate(&g->z, Z_SYNC_FLUSH) != Z_OK || g->z.avail_in != 0) {
+    fprintf(stderr, "Error: deflate failed\n");
+    exit(EXIT_FAILURE);
+  }
+  uint16_t bodyLength = roomLeft - V2RECORD - g->z.avail_out;
+  uint16_t wire = htons(bodyLength);
+  memcpy(rec->data + 1, &wire, sizeof(uint16_t));
+  rec->len = V2RECORD + bodyLength;
+
+  COUNT(compressIn, g->pendingLen);
+  COUNT(compressOut, rec->len);
+  COUNT(compressNs, monoNs() - start);
+  g->pendingLen = 0;
+
+  // compressed once, copied to every member, from a copy of the list
+  // because making room in a batch may disconnect one
+  int count = sub->count;
+  memcpy(cutMembers, sub->slots, sizeof(int) * count);
+  for (int k = 0; k < count; k++) {
+    int j = cutMembers[k];
+    if (observers[j].room != room || !observers[j].inGroup) {
+      continue;
+    }
+    if (flags & ZFLAG_RESET) {
+      observers[j].synced = true;
+    }
+
+    // making room may shed its queue, and the stream with it
+    frame *b = observers[j].batch;
+    if (b != NULL && b->len + rec->len > poolSizes[POOLCLASSES - 1] - (int)sizeof(frame)) {
+      closeBatch(j);
+    }
+    if (observers[j].synced) {
+      batchRecord(j, rec);
+    }
+  }
+  releaseFrame(rec);
+}
+
+void loseShared(int j) {
+  if (observers[j].inGroup) {
+    observers[j].synced = false;
+    subs[observers[j].room].group->resetPending = true;
+  }
+}
+#else
+void joinShared(int j) { (void)j; }
+void leaveShared(int j) { (void)j; }
+void shareRecord(int room, frame *rec) { (void)room; (void)rec; }
+void cutShared(int room) { (void)room; }
+void loseShared(int j) { (void)j; }
+#endif
+
+void queueFrame(int j, frame *f) {
+  int sd = observers[j].sdobs;
+  int written = 0;
+
+  if (sd == 0) {
+    return;
+  }
+  histRecord(&me->stats.queueDepth, observers[j].outCount);
+
+  // nothing queued ahead of it, try writing it right away
+  // (io_uring queues everything and writes it at the end of the pass)
+  if (observers[j].outCount == 0 && backend == BACKEND_POLL) {
+    written = send(sd, f->data, f->len, 0);
+    if (written == f->len) {
+      COUNT(messagesOut, 1);
+      COUNT(bytesOut, written);
+      return;
+    }
+    if (written < 0) {
+      // peer is gone, its read side will notice the close
+      if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+        COUNT(sendErrors, 1);
+        return;
+      }
+      written = 0;
+    }
+    COUNT(bytesOut, written);
+  }
+
+  // queue is full (io_uring checks at the end of the pass, see runUring)
+  if (backend == BACKEND_POLL && observers[j].outCount >= queueMax) {
+    if (!shedFrames(j, 1)) {
+      return;
+    }
+
+    // f carries on the deflate stream that was just shed
+    if (observers[j].inGroup) {
+      COUNT(dropped, 1);
+      return;
+    }
+  }
+
+  if (observers[j].outq == NULL) {
+    observers[j].outq = malloc(sizeof(frame *) * queueMax);
+    if (observers[j].outq == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+    observers[j].outCap = queueMax;
+  }
+
+  // io_uring only, a pass fanned out more than the queue holds
+  if (observers[j].outCount == observers[j].outCap) {
+    frame **bigger = malloc(sizeof(frame *) * observers[j].outCap * 2);
+    if (bigger == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+    for (int i = 0; i < observers[j].outCount; i++) {
+      bigger[i] = observers[j].outq[(observers[j].outHead + i) % observers[j].outCap];
+    }
+    free(observers[j].outq);
+    observers[j].outq = bigger;
+    observers[j].outHead = 0;
+    observers[j].outCap *= 2;
+  }
+
+  // only the part that didn't make it is left to write
+  if (observers[j].outCount == 0) {
+    observers[j].outOffset = written;
+  }
+  __atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+  observers[j].outq[(observers[j].outHead + observers[j].outCount) % observers[j].outCap] = f;
+  observers[j].outCount++;
+  if (observers[j].outCount == 1) {
+    loopWantWrite(sd, true);
+  }
+
+  if (backend == BACKEND_URING && !observers[j].dirty) {
+    observers[j].dirty = true;
+    dirty[dirtyCount++] = j;
+  }
+}
+
+bool shedFrames(int j, int n) {
+  if (queuePolicy == POLICY_DISCONNECT) {
+    TRACE(TRACE_WARN, "observer %s too slow, disconnecting", obsCold[j].name, 0, 0);
+    disconnectObs(j);
+    return false;
+  }
+
+  // the oldest frame may be half written, then the one after it goes,
+  // and frames in an io_uring writev stay until it finishes
+  int victim = observers[j].outOffset > 0 ? 1 : 0;
+  if (obsCold[j].outSending > victim) {
+    victim = obsCold[j].outSending;
+  }
+
+  // a deflate stream can't skip frames, everything that hasn't started goes
+  if (observers[j].inGroup) {
+    loseShared(j);
+    n = observers[j].outCount;
+  }
+  if (n > observers[j].outCount - victim) {
+    n = observers[j].outCount - victim;
+  }
+  if (n <= 0) {
+    return false;
+  }
+
+  // the oldest n after the victim go, and what comes before them moves up
+  int head = observers[j].outHead;
+  int cap = observers[j].outCap;
+  for (int k = 0; k < n; k++) {
+    releaseFrame(observers[j].outq[(head + victim + k) % cap]);
+  }
+  COUNT(dropped, n);
+  for (int k = victim - 1; k >= 0; k--) {
+    observers[j].outq[(head + k + n) % cap] = observers[j].outq[(head + k) % cap];
+  }
+  observers[j].outHead = (head + n) % cap;
+  observers[j].outCount -= n;
+  if (observers[j].outCount == 0) {
+    loopWantWrite(observers[j].sdobs, false);
+  }
+  return true;
+}
+
+void flushObs(int j) {
+  int sd = observers[j].sdobs;
+
+  while (sd != 0 && observers[j].outCount > 0) {
+
+    // gather as many queued frames as fit into one writev
+    struct iovec iov[FLUSHMAX];
+    int count = observers[j].outCount < FLUSHMAX ? observers[j].outCount : FLUSHMAX;
+    for (int i = 0; i < count; i++) {
+      frame *f = observers[j].outq[(observers[j].outHead + i) % observers[j].outCap];
+      iov[i].iov_base = f->data;
+      iov[i].iov_len = f->len;
+    }
+    iov[0].iov_base = (char *)iov[0].iov_base + observers[j].outOffset;
+    iov[0].iov_len -= observers[j].outOffset;
+
+    int n = writev(sd, iov, count);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      // full again (wait for the next writable edge) or the peer is gone
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        COUNT(sendErrors, 1);
+      }
+      return;
+    }
+
+    retireFrames(j, n);
+
+    // short write, the socket is full
+    if (observers[j].outCount > 0 && observers[j].outOffset > 0) {
+      return;
+    }
+  }
+}
+
+void retireFrames(int j, int n) {
+  COUNT(bytesOut, n);
+  n += observers[j].outOffset;
+  while (observers[j].outCount > 0) {
+    frame *f = observers[j].outq[observers[j].outHead];
+    if (n < f->len) {
+      break;
+    }
+    n -= f->len;
+    COUNT(messagesOut, 1);
+    releaseFrame(f);
+    observers[j].outHead = (observers[j].outHead + 1) % observers[j].outCap;
+    observers[j].outCount--;
+  }
+  observers[j].outOffset = n;
+  if (observers[j].outCount == 0) {
+    loopWantWrite(observers[j].sdobs, false);
+  }
+}
+
+void broadcastFrame(frame *f, int room, int except) {
+  fanOut(f, room, except);
+  recordHistory(room, f);
+  if (logDir != NULL) {
+    logFrame(room, f);
+  }
+
+  // the sender is in the room, so it can't go away and take its gen along
+  uint64_t mask = __atomic_load_n(&rooms[room].shards, __ATOMIC_RELAXED);
+  for (int s = 0; s < shardCount; s++) {
+    if (s != shardId && (mask & ((uint64_t)1 << s))) {
+      mail *m = postMail(s, MAIL_BROADCAST, f, -1, NULL);
+      m->room = room;
+      m->roomGen = rooms[room].gen;
+    }
+  }
+}
+
+void fanOut(frame *f, int room, int except) {
+  subscribers *sub = &subs[room];
+  int reached = 0;
+  bool shared = false;
+  uint64_t start = monoNs();
+
+  // from a copy of the list, a send may disconnect a slow observer
+  int count = sub->count;
+  memcpy(fanMembers, sub->slots, sizeof(int) * count);
+
+  // the group can only have it if none of its members is left out
+  bool share = f->record != NULL && (except < 0 || !observers[except].inGroup);
+  for (int k = 0; k < count; k++) {
+    int i = fanMembers[k];
+    if (i == except || observers[i].room != room) {
+      continue;
+    }
+    if (share && observers[i].inGroup) {
+      shared = true;
+    }
+    else {
+      sendFrame(i, f);
+    }
+    reached++;
+  }
+  if (shared) {
+    shareRecord(room, f->record);
+  }
+  histRecord(&me->stats.fanout, reached);
+  histRecord(&me->stats.fanoutTime, monoNs() - start);
+}
+
+int findObsSlot(const char *name, int *obsShard) {
+  pthread_mutex_lock(&nameLock);
+  nameEntry *e = findName(name);
+  if (e != NULL && e->peer >= 0) {
+    e = NULL;
+  }
+  int obs = e != NULL ? e->obs : -1;
+  *obsShard = e != NULL ? e->shard : shardId;
+  pthread_mutex_unlock(&nameLock);
+  return obs;
+}
+
+mail* postMail(int target, int type, frame *f, int sd, const char *name) {
+  mailbox *box = &outbox[target];
+  if (box->count == box->cap) {
+    box->cap = box->cap == 0 ? 64 : box->cap * 2;
+    box->items = realloc(box->items, sizeof(mail) * box->cap);
+    if (box->items == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+  mail *m = &box->items[box->count++];
+  m->type = type;
+  m->f = f;
+  m->sd = sd;
+  m->version = 1;
+  m->compress = COMPRESS_NONE;
+  m->room = -1;
+  m->roomGen = 0;
+  m->gen = 0;
+  memset(m->name, 0, sizeof(m->name));
+  if (name != NULL) {
+    strncpy(m->name, name, sizeof(m->name) - 1);
+  }
+  if (f != NULL) {
+    __atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+  }
+  return m;
+}
+
+void flushMail() {
+  for (int s = 0; s < shardCount; s++) {
+    mailbox *box = &outbox[s];
+    if (box->count == 0) {
+      continue;
+    }
+
+    shard *to = &shards[s];
+    pthread_mutex_lock(&to->lock);
+    bool wasEmpty = to->inbox.count == 0;
+    if (to->inbox.count + box->count > to->inbox.cap) {
+      while (to->inbox.count + box->count > to->inbox.cap) {
+        to->inbox.cap = to->inbox.cap == 0 ? 64 : to->inbox.cap * 2;
+      }
+      to->inbox.items = realloc(to->inbox.items, sizeof(mail) * to->inbox.cap);
+      if (to->inbox.items == NULL) {
+        printf("out of memory\n");
+        exit(1);
+      }
+    }
+    memcpy(to->inbox.items + to->inbox.count, box->items, sizeof(mail) * box->count);
+    to->inbox.count += box->count;
+    pthread_mutex_unlock(&to->lock);
+    box->count = 0;
+
+    // it only needs waking once, it takes the whole inbox when it does
+    if (wasEmpty) {
+      char wake = 1;
+      write(to->wake[1], &wake, sizeof(wake));
+    }
+  }
+
+  // the same for the records other nodes get
+  if (fedOut.len > 0) {
+    pthread_mutex_lock(&fedLock);
+    bool wasEmpty = fedInbox.len == 0;
+    memcpy(fedReserve(&fedInbox, fedOut.len), fedOut.data, fedOut.len);
+    fedInbox.len += fedOut.len;
+    pthread_mutex_unlock(&fedLock);
+    fedOut.len = 0;
+    if (wasEmpty) {
+      char wake = 1;
+      write(fedWake[1], &wake, sizeof(wake));
+    }
+  }
+}
+
+void drainMail() {
+  char wakes[64];
+  while (read(me->wake[0], wakes, sizeof(wakes)) > 0);
+
+  // swap the inbox out so senders only wait for a pointer swap
+  pthread_mutex_lock(&me->lock);
+  mailbox in = me->inbox;
+  me->inbox = taken;
+  me->inbox.count = 0;
+  pthread_mutex_unlock(&me->lock);
+  taken = in;
+
+  for (int i = 0; i < in.count; i++) {
+    mail *m = &in.items[i];
+    switch (m->type) {
+
+      // the room may have gone, and its id gone to another one since
+      case MAIL_BROADCAST:
+        if (subs[m->room].count > 0 && subs[m->room].gen == m->roomGen) {
+          fanOut(m->f, m->room, -1);
+        }
+        break;
+
+      // the recipient may have left since the sender looked
+      case MAIL_PRIVATE: {
+        int obsShard;
+        int o = findObsSlot(m->name, &obsShard);
+        if (o >= 0 && obsShard == shardId) {
+          sendFrame(o, m->f);
+        }
+        break;
+      }
+
+      case MAIL_ADOPT:
+        adoptObs(m->sd, m->version, m->compress, m->name);
+        arenaReset();
+        break;
+
+      case MAIL_REMOTE:
+        deliverRemote(m->f);
+        break;
+
+      // the observer may have left, and its slot gone to another, since it asked
+      case MAIL_REPLAY:
+        if (observers[m->sd].sdobs != 0 && observers[m->sd].gen == m->gen) {
+          frame **frames = arenaAlloc(sizeof(frame *) * LOGREPLAYMAX);
+          replayFrames(m->sd, frames, logUnpack(m->f, frames));
+          arenaReset();
+        }
+        break;
+
+      case MAIL_EVICT:
+        evictPart(m->sd, m->name);
+        arenaReset();
+        break;
+    }
+    if (m->f != NULL) {
+      releaseFrame(m->f);
+    }
+  }
+}
+
+void handOffObs(int j, int target, const char *name) {
+  int sd = observers[j].sdobs;
+  loopDel(sd);
+  mail *m = postMail(target, MAIL_ADOPT, NULL, sd, name);
+  m->version = observers[j].version;
+  m->compress = observers[j].compress;
+
+  // the socket isn't closed, the slot goes back on the free list by hand
+  observers[j].sdobs = 0;
+  obsCold[j].nextFree = freeObs;
+  freeObs = j;
+  oSize--;
+  resetObsSD(j);
+}
+
+void adoptObs(int sd, int version, int compress, const char *name) {
+  if (freeObs == -1 && oHigh < connMax) {
+    growSlots(observers, obsCold, &oHigh, &freeObs, TAG_OBS);
+  }
+  int j = freeObs;
+
+  //array is full
+  if (j == -1) {
+    COUNT(refused[1], 1);
+    char buf2[]={'N'};
+    send(sd, &buf2, sizeof(char), 0);
+    close(sd);
+    return;
+  }
+
+  freeObs = obsCold[j].nextFree;
+  observers[j].sdobs = sd;
+  observers[j].state = 0;
+  observers[j].version = version;
+  observers[j].compress = compress;
+  oSize++;
+  loopAdd(sd, TAG_OBS, j);
+  timerArm(&obsCold[j].handshake, TIMER * 1000);
+
+  // the participant may have left or found another observer in the meantime
+  usernameObs(j, name, strlen(name));
+}
+
+int enterRoom(const char *name) {
+  pthread_mutex_lock(&roomLock);
+  roomEntry *e = findRoom(name);
+  int id;
+  if (e != NULL) {
+    id = e->id;
+  }
+  else {
+    if (freeRoom != -1) {
+      id = freeRoom;
+      freeRoom = rooms[id].nextFree;
+    }
+    else {
+      id = roomHigh;
+      pthread_mutex_init(&rooms[id].historyLock, NULL);
+      __atomic_store_n(&roomHigh, roomHigh + 1, __ATOMIC_RELEASE);
+    }
+    strcpy(rooms[id].name, name);
+    rooms[id].gen++;
+    if (rooms[id].history == NULL && historyMax > 0) {
+      rooms[id].history = malloc(sizeof(historyEntry) * historyMax);
+      if (rooms[id].history == NULL) {
+        printf("out of memory\n");
+        exit(1);
+      }
+    }
+    __atomic_store_n(&roomCount, roomCount + 1, __ATOMIC_RELAXED);
+
+    unsigned int h = hashName(name);
+    while (roomTable[h].name[0] != '\0') {
+      h = (h + 1) & (nameTableSize - 1);
+    }
+    strcpy(roomTable[h].name, name);
+    roomTable[h].id = id;
+  }
+  rooms[id].members++;
+  pthread_mutex_unlock(&roomLock);
+  return id;
+}
+
+void leaveRoom(int id) {
+  pthread_mutex_lock(&roomLock);
+  if (--rooms[id].members > 0) {
+    pthread_mutex_unlock(&roomLock);
+    return;
+  }
+
+  // backward shift deletion, like removeName
+  unsigned int hole = findRoom(rooms[id].name) - roomTable;
+  unsigned int i = hole;
+  while (1) {
+    i = (i + 1) & (nameTableSize - 1);
+    if (roomTable[i].name[0] == '\0') {
+      break;
+    }
+    unsigned int home = hashName(roomTable[i].name);
+    if (((i - home) & (nameTableSize - 1)) >= ((i - hole) & (nameTableSize - 1))) {
+      roomTable[hole] = roomTable[i];
+      hole = i;
+    }
+  }
+  memset(&roomTable[hole], 0, sizeof(roomEntry));
+
+  memset(rooms[id].name, 0, sizeof(rooms[id].name));
+  pthread_mutex_lock(&rooms[id].historyLock);
+  clearHistory(id);
+  pthread_mutex_unlock(&rooms[id].historyLock);
+  rooms[id].nextFree = freeRoom;
+  freeRoom = id;
+  __atomic_store_n(&roomCount, roomCount - 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&roomLock);
+}
+
+int pinRoom(const char *name) {
+  pthread_mutex_lock(&roomLock);
+  roomEntry *e = findRoom(name);
+  int id = e != NULL ? e->id : -1;
+  if (id >= 0) {
+    rooms[id].members++;
+  }
+  pthread_mutex_unlock(&roomLock);
+  return id;
+}
+
+roomEntry* findRoom(const char *name) {
+  unsigned int h = hashName(name);
+  while (roomTable[h].name[0] != '\0') {
+    if (strcmp(roomTable[h].name, name) == 0) {
+      return &roomTable[h];
+    }
+    h = (h + 1) & (nameTableSize - 1);
+  }
+  return NULL;
+}
+
+void joinRoom(int j, const char *name) {
+  int o = partCold[j].obs;
+
+  // same rules as usernames
+  int nameLength = strlen(name);
+  bool valid = nameLength >= 1 && nameLength <= 10;
+  for (int i = 0; valid && i < nameLength; i++) {
+    char c = name[i];
+    valid = c == '_' || (c >= '0' && c <= '9') || (c >= 'A' && c <= 'Z') || (c >= 'a' && c <= 'z');
+  }
+  if (!valid) {
+    if (o >= 0) {
+      char* msgToSend = concat("Warning: room ", name, " is not a valid room name...");
+      frame *f = makeFrame(msgToSend, strlen(msgToSend));
+      f->record = makeRecord(REC_WARNING, NULL, msgToSend);
+      sendFrame(o, f);
+      releaseFrame(f);
+    }
+    return;
+  }
+
+  int id = enterRoom(name);
+  int old = participants[j].room;
+  if (id == old) {
+    leaveRoom(id);
+    return;
+  }
+
+  char* msgToSend = concat("User ", partCold[j].name, " has left");
+  frame *f = makeFrame(msgToSend, strlen(msgToSend));
+  f->record = makeRecord(REC_LEAVE, partCold[j].name, NULL);
+  broadcastFrame(f, old, -1);
+  releaseFrame(f);
+  federate(-1, FED_LEAVE, rooms[old].name, partCold[j].name, NULL);
+
+  // its observer (always in this shard) follows, with everything it was
+  // still owed from the old room
+  participants[j].room = id;
+  if (o >= 0 && observers[o].room >= 0) {
+    cutShared(old);
+    unsubscribeObs(o);
+    subscribeObs(o, id);
+    replayHistory(o, id);
+    if (observers[o].compress == COMPRESS_DEFLATE) {
+      joinShared(o);
+    }
+  }
+
+  msgToSend = concat("User ", partCold[j].name, " has joined");
+  f = makeFrame(msgToSend, strlen(msgToSend));
+  f->record = makeRecord(REC_JOIN, partCold[j].name, NULL);
+  broadcastFrame(f, id, -1);
+  releaseFrame(f);
+  federate(-1, FED_JOIN, name, partCold[j].name, NULL);
+
+  leaveRoom(old);
+}
+
+void recordHistory(int id, frame *f) {
+  long size = f->len + (f->record != NULL ? f->record->len : 0);
+  if (historyMax == 0 || size > historyBytesMax) {
+    return;
+  }
+  room *rm = &rooms[id];
+  pthread_mutex_lock(&rm->historyLock);
+  while (rm->historyCount == historyMax || rm->historyBytes + size > historyBytesMax) {
+    frame *old = rm->history[rm->historyHead].f;
+    rm->historyBytes -= old->len + (old->record != NULL ? old->record->len : 0);
+    releaseFrame(old);
+    rm->historyHead = (rm->historyHead + 1) % historyMax;
+    rm->historyCount--;
+  }
+  __atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+  historyEntry *e = &rm->history[(rm->historyHead + rm->historyCount) % historyMax];
+  e->f = f;
+  e->at = monoMs();
+  rm->historyCount++;
+  __atomic_store_n(&rm->historyBytes, rm->historyBytes + size, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&rm->historyLock);
+}
+
+void replayHistory(int j, int id) {
+  room *rm = &rooms[id];
+  if (rm->history == NULL) {
+    return;
+  }
+
+  // the monotonic clock starts near boot, a -T longer than the uptime keeps everything
+  uint64_t now = monoMs();
+  uint64_t age = historySeconds * 1000ull;
+  uint64_t since = historySeconds > 0 && now > age ? now - age : 0;
+
+  // take references under the lock, send after it
+  frame **frames = arenaAlloc(sizeof(frame *) * historyMax);
+  int count = 0;
+  pthread_mutex_lock(&rm->historyLock);
+  for (int i = 0; i < rm->historyCount; i++) {
+    historyEntry *e = &rm->history[(rm->historyHead + i) % historyMax];
+    if (e->at >= since) {
+      __atomic_fetch_add(&e->f->refs, 1, __ATOMIC_RELAXED);
+      frames[count++] = e->f;
+    }
+  }
+  pthread_mutex_unlock(&rm->historyLock);
+  replayFrames(j, frames, count);
+}
+
+void replayFrames(int j, frame **frames, int count) {
+  if (count == 0) {
+    return;
+  }
+  COUNT(replayed, count);
+
+  if (observers[j].version < 2) {
+    int v1Bytes = 0;
+    for (int i = 0; i < count; i++) {
+      v1Bytes += frames[i]->len;
+    }
+    frame *b = allocFrame(v1Bytes);
+    for (int i = 0; i < count; i++) {
+      memcpy(b->data + b->len, frames[i]->data, frames[i]->len);
+      b->len += frames[i]->len;
+    }
+    queueFrame(j, b);
+    releaseFrame(b);
+  }
+  for (int i = 0; i < count; i++) {
+    if (observers[j].version == 2) {
+      sendFrame(j, frames[i]);
+    }
+    releaseFrame(frames[i]);
+  }
+}
+
+void clearHistory(int id) {
+  room *rm = &rooms[id];
+  for (int i = 0; i < rm->historyCount; i++) {
+    releaseFrame(rm->history[(rm->historyHead + i) % historyMax].f);
+  }
+  rm->historyHead = 0;
+  rm->historyCount = 0;
+  __atomic_store_n(&rm->historyBytes, 0, __ATOMIC_RELAXED);
+}
+
+void subscribeObs(int j, int id) {
+  subscribers *sub = &subs[id];
+  if (sub->count == 0) {
+    sub->gen = rooms[id].gen;
+    __atomic_fetch_or(&rooms[id].shards, (uint64_t)1 << shardId, __ATOMIC_RELAXED);
+  }
+  if (sub->count == sub->cap) {
+    sub->cap = sub->cap == 0 ? 8 : sub->cap * 2;
+    sub->slots = realloc(sub->slots, sizeof(int) * sub->cap);
+    if (sub->slots == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+  observers[j].room = id;
+  obsCold[j].roomPos = sub->count;
+  sub->slots[sub->count++] = j;
+}
+
+void unsubscribeObs(int j) {
+  int id = observers[j].room;
+  if (id < 0) {
+    return;
+  }
+  leaveShared(j);
+
+  // the last one takes its place
+  subscribers *sub = &subs[id];
+  int last = sub->slots[--sub->count];
+  sub->slots[obsCold[j].roomPos] = last;
+  obsCold[last].roomPos = obsCold[j].roomPos;
+  if (sub->count == 0) {
+    __atomic_fetch_and(&rooms[id].shards, ~((uint64_t)1 << shardId), __ATOMIC_RELAXED);
+  }
+  observers[j].room = -1;
+}
+
+void logOpen() {
+  if (mkdir(logDir, 0755) < 0 && errno != EEXIST) {
+    fprintf(stderr, "Error: Cannot create log directory %s\n", logDir);
+    exit(EXIT_FAILURE);
+  }
+  DIR *dir = opendir(logDir);
+  if (dir == NULL) {
+    fprintf(stderr, "Error: Cannot open log directory %s\n", logDir);
+    exit(EXIT_FAILURE);
+  }
+  int first = -1;
+  int last = -1;
+  struct dirent *d;
+  while ((d = readdir(dir)) != NULL) {
+    int number;
+    char end;
+    if (strlen(d->d_name) == 12 && sscanf(d->d_name, "%8d.lo%c", &number, &end) == 2 && end == 'g') {
+      first = first < 0 || number < first ? number : first;
+      last = number > last ? number : last;
+    }
+  }
+  closedir(dir);
+
+  // a new log, the sync thread maps the second spare
+  if (last < 0) {
+    logCur = logOpenSegment(0, true);
+    logOffset = 0;
+    logSpare = logOpenSegment(1, true);
+    logSpares = 1;
+    return;
+  }
+
+  // the index of every segment, segments deleted by hand are skipped
+  char path[PATH_MAX];
+  for (int n = first; n <= last; n++) {
+    snprintf(path, sizeof(path), "%s/%08d.idx", logDir, n);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    logIndexEntry e;
+    while (read(fd, &e, sizeof(e)) == sizeof(e)) {
+      logAddIndex(e.seq, e.at, e.segment, e.offset);
+    }
+    close(fd);
+  }
+  logIndexSynced = logIndexCount;
+
+  // the last segment with entries goes on from where they stop, those after
+  // its last index entry weren't synced yet and are checked one by one. The
+  // ones the sync thread made ahead of it that nothing went in are spares again
+  logSegment *seg;
+  uint64_t seq;
+  long end;
+  for (int n = last; ; n--) {
+    seg = logOpenSegment(n, false);
+    bool indexed = logIndexCount > 0 && logIndex[logIndexCount - 1].segment == (uint32_t)n;
+    seq = indexed ? logIndex[logIndexCount - 1].seq : 0;
+    long start = indexed ? logIndex[logIndexCount - 1].offset : 0;
+    end = logScan(seg, start, &seq, indexed);
+    if (end > 0 || n == first) {
+      break;
+    }
+    seg->next = logSpare;
+    logSpare = seg;
+    logSpares++;
+  }
+
+  // appends go on in the first empty one after it, if there is one
+  if (end > 0 && logSpare != NULL) {
+    seg->end = end;
+    seg->synced = end;
+    logRetired = seg;
+    logCur = logSpare;
+    logSpare = logCur->next;
+    logCur->next = NULL;
+    logSpares--;
+    logOffset = 0;
+  }
+  else {
+    logCur = seg;
+    logOffset = end;
+  }
+  if (logSpare == NULL) {
+    logSpare = logOpenSegment(last + 1, true);
+    logSpares = 1;
+  }
+  logSeq = seq > 0 ? seq : 1;
+  TRACE(TRACE_INFO, "log: %s, segment %d, next entry %lu", logDir, logCur->number, logSeq);
+}
+
+logSegment* logOpenSegment(int number, bool create) {
+  logSegment *seg = calloc(1, sizeof(logSegment));
+  if (seg == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  char path[PATH_MAX];
+  snprintf(path, sizeof(path), "%s/%08d.log", logDir, number);
+  seg->number = number;
+  seg->fd = open(path, O_RDWR | O_CREAT, 0644);
+
+  // the blocks are reserved up front, so running out of disk can't fault a
+  // store into the mapping later
+  if (seg->fd < 0 || posix_fallocate(seg->fd, 0, LOGSEGMENT) != 0) {
+    fprintf(stderr, "Error: Cannot create log segment %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  seg->map = mmap(NULL, LOGSEGMENT, PROT_READ | PROT_WRITE,
+                  MAP_SHARED | (create ? MAP_POPULATE : 0), seg->fd, 0);
+  if (seg->map == MAP_FAILED) {
+    fprintf(stderr, "Error: Cannot map log segment %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  if (create) {
+    fsync(seg->fd);
+  }
+  snprintf(path, sizeof(path), "%s/%08d.idx", logDir, number);
+  seg->idxFd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  if (seg->idxFd < 0) {
+    fprintf(stderr, "Error: Cannot create log index %s\n", path);
+    exit(EXIT_FAILURE);
+  }
+  return seg;
+}
+
+long logScan(logSegment *seg, long off, uint64_t *seq, bool skipFirst) {
+  while (off + (long)sizeof(logHeader) <= LOGSEGMENT) {
+    logHeader *h = (logHeader *)(seg->map + off);
+    if (h->len < sizeof(logHeader) || h->len % 8 != 0 || h->len > LOGSEGMENT - off ||
+        sizeof(logHeader) + h->frameLen + h->recordLen > h->len ||
+        (*seq > 0 && h->seq != *seq)) {
+      break;
+    }
+    if (!skipFirst && (off == 0 || h->seq % LOGINDEXEVERY == 0)) {
+      logAddIndex(h->seq, h->at, seg->number, off);
+    }
+    skipFirst = false;
+    *seq = h->seq + 1;
+    off += h->len;
+  }
+  return off;
+}
+
+void logAddIndex(uint64_t seq, uint64_t at, int segment, long offset) {
+  if (logIndexCount == logIndexCap) {
+    logIndexCap = logIndexCap == 0 ? 1024 : logIndexCap * 2;
+    logIndex = realloc(logIndex, sizeof(logIndexEntry) * logIndexCap);
+    if (logIndex == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+  logIndexEntry *e = &logIndex[logIndexCount++];
+  e->seq = seq;
+  e->at = at;
+  e->segment = segment;
+  e->offset = offset;
+}
+
+void logFrame(int id, frame *f) {
+  uint64_t start = monoNs();
+  uint64_t at = wallMs();
+  int recordLen = f->record != NULL ? f->record->len : 0;
+  uint32_t len = (sizeof(logHeader) + f->len + recordLen + 7) & ~7;
+
+  pthread_mutex_lock(&logLock);
+
+  // full and the sync thread is behind, making a segment here would stall
+  // the message path on the disk
+  if (logOffset + len > LOGSEGMENT && logSpare == NULL) {
+    pthread_cond_signal(&logWake);
+    pthread_mutex_unlock(&logLock);
+    COUNT(logDropped, 1);
+    TRACE(TRACE_WARN, "log: no spare segment, entry dropped", NULL, 0, 0);
+    return;
+  }
+
+  // full, a spare takes over and the sync thread finishes this one
+  if (logOffset + len > LOGSEGMENT) {
+    logSegment *full = logCur;
+    full->end = logOffset;
+    full->next = logRetired;
+    logRetired = full;
+    logCur = logSpare;
+    logSpare = logCur->next;
+    logCur->next = NULL;
+    logSpares--;
+    logOffset = 0;
+    pthread_cond_signal(&logWake);
+  }
+
+  logHeader *h = (logHeader *)(logCur->map + logOffset);
+  h->frameLen = f->len;
+  h->recordLen = recordLen;
+  h->seq = logSeq++;
+  h->at = at;
+  memcpy(h->room, rooms[id].name, sizeof(h->room));
+  memcpy((char *)(h + 1), f->data, f->len);
+  if (recordLen > 0) {
+    memcpy((char *)(h + 1) + f->len, f->record->data, recordLen);
+  }
+  if (logOffset == 0 || h->seq % LOGINDEXEVERY == 0) {
+    logAddIndex(h->seq, at, logCur->number, logOffset);
+  }
+
+  // readers stop at the first zero len
+  __atomic_store_n(&h->len, len, __ATOMIC_RELEASE);
+  logOffset += len;
+  pthread_mutex_unlock(&logLock);
+
+  COUNT(logEntries, 1);
+  COUNT(logBytes, len);
+  histRecord(&me->stats.logAppendTime, monoNs() - start);
+}
+
+void* runLogSync(void *arg) {
+  long pageSize = sysconf(_SC_PAGESIZE);
+  logIndexEntry *entries = NULL;
+  int entriesCap = 0;
+
+  pthread_mutex_lock(&logLock);
+  while (1) {
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    until.tv_nsec += LOGSYNCMS * 1000000L;
+    if (until.tv_nsec >= 1000000000L) {
+      until.tv_sec++;
+      until.tv_nsec -= 1000000000L;
+    }
+    if (logRetired == NULL && logSpares == LOGSPARES) {
+      pthread_cond_timedwait(&logWake, &logLock, &until);
+    }
+
+    // what has been appended so far, everything below is done without the lock
+    logSegment *seg = logCur;
+    long end = logOffset;
+    logSegment *retired = logRetired;
+    logRetired = NULL;
+    int newEntries = logIndexCount - logIndexSynced;
+    if (newEntries > entriesCap) {
+      entriesCap = newEntries * 2;
+      entries = realloc(entries, sizeof(logIndexEntry) * entriesCap);
+      if (entries == NULL) {
+        printf("out of memory\n");
+        exit(1);
+      }
+    }
+    memcpy(entries, logIndex + logIndexSynced, sizeof(logIndexEntry) * newEntries);
+    logIndexSynced = logIndexCount;
+    logSegment *newest = logCur;
+    for (logSegment *s = logSpare; s != NULL; s = s->next) {
+      newest = s;
+    }
+    int spareNumber = logSpares < LOGSPARES ? newest->number + 1 : -1;
+    pthread_mutex_unlock(&logLock);
+
+    // one msync covers everything appended since the last one
+    uint64_t start = monoNs();
+    bool synced = false;
+    for (logSegment *r = retired; r != NULL; r = r->next) {
+      long from = r->synced & ~(pageSize - 1);
+      if (r->end > r->synced) {
+        msync(r->map + from, r->end - from, MS_SYNC);
+        synced = true;
+      }
+    }
+    if (end > seg->synced) {
+      long from = seg->synced & ~(pageSize - 1);
+      msync(seg->map + from, end - from, MS_SYNC);
+      seg->synced = end;
+      synced = true;
+    }
+    if (synced) {
+      __atomic_store_n(&logSyncs, logSyncs + 1, __ATOMIC_RELAXED);
+      histRecord(&logSyncTime, monoNs() - start);
+    }
+
+    // the index only points at entries that made it to the disk
+    for (int i = 0; i < newEntries; i++) {
+      int fd = seg->idxFd;
+      for (logSegment *r = retired; r != NULL; r = r->next) {
+        if (r->number == (int)entries[i].segment) {
+          fd = r->idxFd;
+        }
+      }
+      if (write(fd, &entries[i], sizeof(logIndexEntry)) != sizeof(logIndexEntry)) {
+        fprintf(stderr, "Error: Cannot write log index\n");
+      }
+    }
+    while (retired != NULL) {
+      logSegment *next = retired->next;
+      fsync(retired->idxFd);
+      munmap(retired->map, LOGSEGMENT);
+      close(retired->fd);
+      close(retired->idxFd);
+      free(retired);
+      retired = next;
+    }
+
+    // the next spare, so filling this one never waits for a new file,
+    // only this thread adds them so the number is still the right one
+    logSegment *spare = spareNumber >= 0 ? logOpenSegment(spareNumber, true) : NULL;
+
+    pthread_mutex_lock(&logLock);
+    if (spare != NULL) {
+      logSegment **tail = &logSpare;
+      while (*tail != NULL) {
+        tail = &(*tail)->next;
+      }
+      *tail = spare;
+      logSpares++;
+    }
+  }
+  return NULL;
+}
+
+frame* logRead(const char *name, uint64_t since, int max) {
+
+  // the index entry before since, and how far the log went when asked
+  pthread_mutex_lock(&logLock);
+  int lo = 0;
+  int hi = logIndexCount;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (logIndex[mid].at < since) {
+      lo = mid;
+    }
+    else {
+      hi = mid;
+    }
+  }
+  if (logIndexCount - lo > LOGSCANMAX / LOGINDEXEVERY) {
+    lo = logIndexCount - LOGSCANMAX / LOGINDEXEVERY;
+  }
+  bool empty = logIndexCount == 0;
+  logIndexEntry from = empty ? (logIndexEntry){0} : logIndex[lo];
+  uint64_t last = logSeq;
+  int lastSegment = logCur->number;
+  pthread_mutex_unlock(&logLock);
+  if (empty) {
+    return NULL;
+  }
+
+  // mappings of its own, the sync thread may unmap the segments it retires,
+  // and they stay until the newest max entries have been copied out
+  int segments = lastSegment - from.segment + 1;
+  char **maps = calloc(segments, sizeof(char *));
+  logHeader **found = malloc(sizeof(logHeader *) * max);
+  if (maps == NULL || found == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  int count = 0;
+  int head = 0;
+  char path[PATH_MAX];
+  for (int n = from.segment; n <= lastSegment; n++) {
+    snprintf(path, sizeof(path), "%s/%08d.log", logDir, n);
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    char *map = mmap(NULL, LOGSEGMENT, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+      continue;
+    }
+    maps[n - from.segment] = map;
+    long off = n == (int)from.segment ? from.offset : 0;
+    while (off + (long)sizeof(logHeader) <= LOGSEGMENT) {
+      logHeader *h = (logHeader *)(map + off);
+      uint32_t len = __atomic_load_n(&h->len, __ATOMIC_ACQUIRE);
+      if (len == 0 || h->seq >= last) {
+        break;
+      }
+
+      // only the newest max are kept
+      if (h->at >= since && strcmp(h->room, name) == 0) {
+        if (count == max) {
+          found[head] = h;
+          head = (head + 1) % max;
+        }
+        else {
+          found[count++] = h;
+        }
+      }
+      off += len;
+    }
+  }
+
+  // oldest first, in a frame of its own that is freed with its last reference
+  frame *f = NULL;
+  if (count > 0) {
+    long bytes = 0;
+    for (int i = 0; i < count; i++) {
+      bytes += found[i]->len;
+    }
+    f = malloc(sizeof(frame) + bytes);
+    if (f == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+    f->refs = 1;
+    f->sizeClass = -1;
+    f->owner = -1;
+    f->next = NULL;
+    f->record = NULL;
+    f->len = 0;
+    for (int i = 0; i < count; i++) {
+      logHeader *h = found[(head + i) % count];
+      memcpy(f->data + f->len, h, h->len);
+      f->len += h->len;
+    }
+  }
+  for (int i = 0; i < segments; i++) {
+    if (maps[i] != NULL) {
+      munmap(maps[i], LOGSEGMENT);
+    }
+  }
+  free(maps);
+  free(found);
+  return f;
+}
+
+int logUnpack(frame *entries, frame **frames) {
+  int count = 0;
+  for (int off = 0; off < entries->len; ) {
+    logHeader *h = (logHeader *)(entries->data + off);
+    frame *f = allocFrame(h->frameLen);
+    f->len = h->frameLen;
+    memcpy(f->data, (char *)(h + 1), h->frameLen);
+    if (h->recordLen > 0) {
+      f->record = allocFrame(h->recordLen);
+      f->record->len = h->recordLen;
+      memcpy(f->record->data, (char *)(h + 1) + h->frameLen, h->recordLen);
+    }
+    frames[count++] = f;
+    off += h->len;
+  }
+  return count;
+}
+
+void* runLogRead(void *arg) {
+  logRequest *batch = NULL;
+  int batchCap = 0;
+  while (1) {
+
+    // everything asked for so far, the shards only wait for a copy
+    pthread_mutex_lock(&logReadLock);
+    while (logRequestCount == 0) {
+      pthread_cond_wait(&logReadWake, &logReadLock);
+    }
+    int count = logRequestCount;
+    if (count > batchCap) {
+      batchCap = count * 2;
+      batch = realloc(batch, sizeof(logRequest) * batchCap);
+      if (batch == NULL) {
+        printf("out of memory\n");
+        exit(1);
+      }
+    }
+    memcpy(batch, logRequests, sizeof(logRequest) * count);
+    logRequestCount = 0;
+    pthread_mutex_unlock(&logReadLock);
+
+    for (int i = 0; i < count; i++) {
+      frame *f = logRead(batch[i].room, batch[i].since, LOGREPLAYMAX);
+      if (f == NULL) {
+        continue;
+      }
+      mail *m = postMail(batch[i].shard, MAIL_REPLAY, f, batch[i].obs, NULL);
+      m->gen = batch[i].gen;
+      releaseFrame(f);
+    }
+    flushMail();
+  }
+  return NULL;
+}
+
+void logAsk(int j, const char *room, uint64_t since) {
+  pthread_mutex_lock(&logReadLock);
+  if (logRequestCount == logRequestCap) {
+    logRequestCap = logRequestCap == 0 ? 64 : logRequestCap * 2;
+    logRequests = realloc(logRequests, sizeof(logRequest) * logRequestCap);
+    if (logRequests == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+  logRequest *r = &logRequests[logRequestCount++];
+  r->shard = shardId;
+  r->obs = j;
+  r->gen = observers[j].gen;
+  strncpy(r->room, room, sizeof(r->room) - 1);
+  r->room[sizeof(r->room) - 1] = '\0';
+  r->since = since;
+  pthread_cond_signal(&logReadWake);
+  pthread_mutex_unlock(&logReadLock);
+}
+
+void replayLog(int j, int seconds) {
+  int o = partCold[j].obs;
+  if (o < 0) {
+    return;
+  }
+  const char *warning = NULL;
+  uint64_t now = monoMs();
+  if (logDir == NULL) {
+    warning = "Warning: there is no message log to replay...";
+  }
+  else if (now < partCold[j].replayAt) {
+    warning = "Warning: wait a moment before replaying again...";
+  }
+  if (warning != NULL) {
+    frame *f = makeFrame(warning, strlen(warning));
+    f->record = makeRecord(REC_WARNING, NULL, warning);
+    sendFrame(o, f);
+    releaseFrame(f);
+    return;
+  }
+  partCold[j].replayAt = now + REPLAYGAPMS;
+  logAsk(o, rooms[participants[j].room].name, seconds > 0 ? wallMs() - seconds * 1000ull : 0);
+}
+
+void logWarm() {
+  if (historyMax == 0) {
+    return;
+  }
+  uint64_t since = historySeconds > 0 ? wallMs() - historySeconds * 1000ull : 0;
+  frame *entries = logRead(DEFAULTROOM, since, historyMax);
+  if (entries == NULL) {
+    return;
+  }
+  frame **frames = arenaAlloc(sizeof(frame *) * historyMax);
+  int count = logUnpack(entries, frames);
+  releaseFrame(entries);
+  pthread_mutex_lock(&roomLock);
+  int id = findRoom(DEFAULTROOM)->id;
+  pthread_mutex_unlock(&roomLock);
+  for (int i = 0; i < count; i++) {
+    recordHistory(id, frames[i]);
+    releaseFrame(frames[i]);
+  }
+  arenaReset();
+}
+
+unsigned int hashName(const char *name) {
+  unsigned int h = 2166136261u;
+  while (*name != '\0') {
+    h ^= (unsigned char)*name++;
+    h *= 16777619u;
+  }
+  return h & (nameTableSize - 1);
+}
+
+nameEntry* findName(const char *name) {
+
+  // nobody can have a longer (or empty) name
+  if (name[0] == '\0' || strlen(name) > 10) {
+    return NULL;
+  }
+
+  // probe until the name or a free slot turns up
+  unsigned int h = hashName(name);
+  while (nameTable[h].name[0] != '\0') {
+    if (strcmp(nameTable[h].name, name) == 0) {
+      return &nameTable[h];
+    }
+    h = (h + 1) & (nameTableSize - 1);
+  }
+  return NULL;
+}
+
+nameEntry* addName(const char *name, int part) {
+  unsigned int h = hashName(name);
+  while (nameTable[h].name[0] != '\0') {
+    h = (h + 1) & (nameTableSize - 1);
+  }
+  strcpy(nameTable[h].name, name);
+  nameTable[h].shard = shardId;
+  nameTable[h].part = part;
+  nameTable[h].obs = -1;
+  nameTable[h].peer = -1;
+  return &nameTable[h];
+}
+
+void removeName(const char *name) {
+  nameEntry *e = findName(name);
+  if (e == NULL) {
+    return;
+  }
+
+  // backward shift deletion: pull later entries of the probe run into the
+  // hole so lookups never need tombstones
+  unsigned int hole = e - nameTable;
+  unsigned int i = hole;
+  while (1) {
+    i = (i + 1) & (nameTableSize - 1);
+    if (nameTable[i].name[0] == '\0') {
+      break;
+    }
+    unsigned int home = hashName(nameTable[i].name);
+
+    // entry may move back only if its home is not between the hole and i
+    if (((i - home) & (nameTableSize - 1)) >= ((i - hole) & (nameTableSize - 1))) {
+      nameTable[hole] = nameTable[i];
+      hole = i;
+    }
+  }
+  memset(&nameTable[hole], 0, sizeof(nameEntry));
+}
+
+void resetObsSD(int j) {
+  if (observers[j].sdobs != 0) {
+    loopDel(observers[j].sdobs);
+    close(observers[j].sdobs);
+    obsCold[j].nextFree = freeObs;
+    freeObs = j;
+  }
+  observers[j].gen++;
+  observers[j].sdparts = 0;
+  observers[j].sdobs = 0;
+  memset(obsCold[j].name, 0, sizeof(obsCold[j].name));
+  observers[j].state = -1;
+  timerCancel(&obsCold[j].handshake);
+  free(obsCold[j].partial);
+  obsCold[j].partial = NULL;
+  obsCold[j].partialLen = 0;
+  observers[j].version = 1;
+  observers[j].compress = COMPRESS_NONE;
+  unsubscribeObs(j);
+  if (observers[j].batch != NULL) {
+    releaseFrame(observers[j].batch);
+    observers[j].batch = NULL;
+  }
+
+  // drop whatever was still waiting to be written
+  for (int i = 0; i < observers[j].outCount; i++) {
+    releaseFrame(observers[j].outq[(observers[j].outHead + i) % observers[j].outCap]);
+  }
+  free(observers[j].outq);
+  observers[j].outq = NULL;
+  free(obsCold[j].iov);
+  obsCold[j].iov = NULL;
+  observers[j].outHead = 0;
+  observers[j].outCount = 0;
+  observers[j].outOffset = 0;
+  observers[j].outCap = 0;
+  obsCold[j].outSending = 0;
+  obsCold[j].outPieces = 0;
+  obsCold[j].outWritten = 0;
+  obsCold[j].iovCap = 0;
+}
+
+void resetPartSD(int j) {
+  if (participants[j].sdparts != 0) {
+    loopDel(participants[j].sdparts);
+    close(participants[j].sdparts);
+    partCold[j].nextFree = freePart;
+    freePart = j;
+  }
+  participants[j].gen++;
+  participants[j].sdparts = 0;
+  participants[j].sdobs = 0;
+  partCold[j].obs = -1;
+  memset(partCold[j].name, 0, sizeof(partCold[j].name));
+  participants[j].state = -1;
+  timerCancel(&partCold[j].handshake);
+  free(partCold[j].partial);
+  partCold[j].partial = NULL;
+  partCold[j].partialLen = 0;
+  participants[j].version = 1;
+  partCold[j].frameLeft = 0;
+  partCold[j].replayAt = 0;
+  if (participants[j].room >= 0) {
+    leaveRoom(participants[j].room);
+    participants[j].room = -1;
+  }
+}
+
+void* reserveTable(size_t size) {
+  void *p = mmap(NULL, size * connMax, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if (p == MAP_FAILED) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  return p;
+}
+
+void initializeSDs() {
+
+  // address space only, pages get backed as growSlots first writes them,
+  // and the page-aligned start keeps every client on a cache line of its own
+  participants = reserveTable(sizeof(client));
+  partCold = reserveTable(sizeof(clientCold));
+  observers = reserveTable(sizeof(client));
+  obsCold = reserveTable(sizeof(clientCold));
+  backlog = malloc(sizeof(int) * connMax);
+  turn = malloc(sizeof(int) * connMax);
+  dirty = malloc(sizeof(int) * connMax);
+  batched = malloc(sizeof(int) * connMax);
+  fanMembers = malloc(sizeof(int) * connMax);
+  cutMembers = malloc(sizeof(int) * connMax);
+  if (backlog == NULL || turn == NULL || dirty == NULL || batched == NULL || fanMembers == NULL || cutMembers == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  freePart = -1;
+  freeObs = -1;
+  spareFd = open("/dev/null", O_RDONLY);
+}
+
+void growSlots(client *table, clientCold *cold, int *high, int *freeHead, int tag) {
+  int end = *high + SLOTCHUNK < connMax ? *high + SLOTCHUNK : connMax;
+
+  for (int i = *high; i < end; i++) {
+    client *c = &table[i];
+    c->outq = NULL;
+    c->batch = NULL;
+    c->sdparts = 0;
+    c->sdobs = 0;
+    c->state = -1;
+    c->room = -1;
+    c->outHead = 0;
+    c->outCount = 0;
+    c->outOffset = 0;
+    c->outCap = 0;
+    c->gen = 0;
+    c->version = 1;
+    c->compress = COMPRESS_NONE;
+    c->inGroup = false;
+    c->synced = false;
+    c->dirty = false;
+    c->batched = false;
+
+    clientCold *k = &cold[i];
+    memset(k->name, 0, sizeof(k->name));
+    k->handshake.next = NULL;
+    k->handshake.pprev = NULL;
+    k->handshake.tag = tag;
+    k->handshake.slot = i;
+    k->partial = NULL;
+    k->partialLen = 0;
+    k->frameLeft = 0;
+    k->backlogged = false;
+    k->roomPos = 0;
+    k->obs = -1;
+    k->outSending = 0;
+    k->outPieces = 0;
+    k->outWritten = 0;
+    k->iovCap = 0;
+    k->iov = NULL;
+
+    // lowest slots are handed out first
+    k->nextFree = i + 1 < end ? i + 1 : *freeHead;
+  }
+  *freeHead = *high;
+  *high = end;
+}
+
+char* concat(const char *str1, const char *str2, const char *str3) {
+
+  char* result = arenaAlloc(sizeof(char) * (strlen(str1) + strlen(str2) + strlen(str3) + 1)); //+1 for null terminator
+
+  strcpy(result, str1);
+  strcat(result, str2);
+  strcat(result, str3);
+
+  return result;
+}
+
+void* arenaAlloc(int size) {
+
+  // keep everything handed out aligned
+  size = (size + 7) & ~7;
+
+  if (arenaUsed + size <= ARENASIZE) {
+    void *p = arena + arenaUsed;
+    arenaUsed += size;
+    memset(p, 0, size);
+    return p;
+  }
+
+  // used up, this block lives until the next reset
+  arenaBlock *block = calloc(1, sizeof(arenaBlock) + size);
+  if (block == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  COUNT(allocs, 1);
+  block->next = arenaOverflow;
+  arenaOverflow = block;
+  return block->data;
+}
+
+void arenaReset() {
+  arenaUsed = 0;
+  while (arenaOverflow != NULL) {
+    arenaBlock *next = arenaOverflow->next;
+    free(arenaOverflow);
+    arenaOverflow = next;
+  }
+}
+
+/* Timer wheel -------------------------------------------------------*/
+
+void timerArm(timer *t, int ms) {
+  timerCancel(t);
+  t->expires = (monoMs() + ms + WHEELTICK - 1) / WHEELTICK;
+  timerInsert(t);
+  timerCount++;
+}
+
+void timerCancel(timer *t) {
+  if (t->pprev == NULL) {
+    return;
+  }
+  *t->pprev = t->next;
+  if (t->next != NULL) {
+    t->next->pprev = t->pprev;
+  }
+  t->next = NULL;
+  t->pprev = NULL;
+  timerCount--;
+}
+
+void timerInsert(timer *t) {
+  uint64_t expires = t->expires;
+
+  // already due, it goes off on the tick being handled
+  if (expires < wheelNow) {
+    expires = wheelNow;
+  }
+
+  // the first level whose span reaches the expiry, the last one takes the rest
+  uint64_t delta = expires - wheelNow;
+  int level = 0;
+  while (level < WHEELLEVELS - 1 && delta >= ((uint64_t)1 << (WHEELBITS * (level + 1)))) {
+    level++;
+  }
+  if (delta >= ((uint64_t)1 << (WHEELBITS * WHEELLEVELS))) {
+    expires = wheelNow + ((uint64_t)1 << (WHEELBITS * WHEELLEVELS)) - 1;
+  }
+
+  timer **head = &wheel[level][(expires >> (WHEELBITS * level)) & (WHEELSLOTS - 1)];
+  t->next = *head;
+  if (t->next != NULL) {
+    t->next->pprev = &t->next;
+  }
+  t->pprev = head;
+  *head = t;
+}
+
+void timerAdvance() {
+  uint64_t now = monoMs() / WHEELTICK;
+
+  // nothing armed, nothing to walk through
+  if (timerCount == 0) {
+    wheelNow = now + 1;
+    return;
+  }
+
+  while (wheelNow <= now) {
+    int slot = wheelNow & (WHEELSLOTS - 1);
+
+    // a level went round, the next slot of each level above moves down a level
+    for (int level = 1; slot == 0 && level < WHEELLEVELS; level++) {
+      slot = (wheelNow >> (WHEELBITS * level)) & (WHEELSLOTS - 1);
+      timer *t = wheel[level][slot];
+      wheel[level][slot] = NULL;
+      while (t != NULL) {
+        timer *next = t->next;
+        timerInsert(t);
+        t = next;
+      }
+    }
+
+    // everything left in this slot is due
+    timer **head = &wheel[0][wheelNow & (WHEELSLOTS - 1)];
+    while (*head != NULL) {
+      timer *t = *head;
+      timerCancel(t);
+      handshakeExpired(t->tag, t->slot);
+    }
+    wheelNow++;
+  }
+}
+
+int timerTimeout() {
+  if (timerCount == 0) {
+    return -1;
+  }
+
+  // first busy slot of the first level before it goes round, or else the
+  // tick where the level above cascades into it
+  uint64_t lap = (wheelNow | (WHEELSLOTS - 1)) + 1;
+  uint64_t due = wheelNow;
+  while (due < lap && wheel[0][due & (WHEELSLOTS - 1)] == NULL) {
+    due++;
+  }
+
+  int64_t ms = (int64_t)(due * WHEELTICK) - (int64_t)monoMs();
+  return ms > 0 ? (int)ms : 0;
+}
+
+void handshakeExpired(int tag, int slot) {
+  if (tag == TAG_PART && participants[slot].state == 0) {
+    TRACE(TRACE_INFO, "participant took too long to pick a name", NULL, 0, 0);
+    COUNT(handshakes[0][HS_TIMEOUT], 1);
+    pSize--;
+    resetPartSD(slot);
+  }
+  else if (tag == TAG_OBS && observers[slot].state == 0) {
+    TRACE(TRACE_INFO, "observer took too long to pick a name", NULL, 0, 0);
+    COUNT(handshakes[1][HS_TIMEOUT], 1);
+    oSize--;
+    resetObsSD(slot);
+  }
+}
+
+uint64_t monoMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t monoNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint64_t wallMs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+uint64_t wallNs() {
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Metrics -----------------------------------------------------------*/
+
+void histRecord(histogram *h, uint64_t v) {
+  int b;
+  if (v < HISTSUB) {
+    b = v;
+  }
+  else {
+    // the power of two picks the group, the bits below the top one the bucket
+    int top = 63 - __builtin_clzll(v);
+    b = (top - 3) * HISTSUB + ((v >> (top - 4)) & (HISTSUB - 1));
+    if (b >= HISTBUCKETS) {
+      b = HISTBUCKETS - 1;
+    }
+  }
+  __atomic_store_n(&h->counts[b], h->counts[b] + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+}
+
+void requestStats(int sig) {
+  statsRequested = 1;
+}
+
+void printStats() {
+  statsRequested = 0;
+  writeMetrics(stdout);
+  fflush(stdout);
+}
+
+void writeMetrics(FILE *out) {
+  static const char *roles[2] = {"participant", "observer"};
+  static const char *outcomes[HS_KINDS] = {"Y", "T", "I", "N", "timeout"};
+
+  // everything is summed first, the shards keep going meanwhile
+  metrics *total = calloc(1, sizeof(metrics));
+  if (total == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  for (int i = 0; i < shardCount; i++) {
+    metrics *m = &shards[i].stats;
+    total->participants += __atomic_load_n(&m->participants, __ATOMIC_RELAXED);
+    total->observers += __atomic_load_n(&m->observers, __ATOMIC_RELAXED);
+    for (int r = 0; r < 2; r++) {
+      for (int k = 0; k < HS_KINDS; k++) {
+        total->handshakes[r][k] += __atomic_load_n(&m->handshakes[r][k], __ATOMIC_RELAXED);
+      }
+      total->refused[r] += __atomic_load_n(&m->refused[r], __ATOMIC_RELAXED);
+    }
+    total->messagesIn += __atomic_load_n(&m->messagesIn, __ATOMIC_RELAXED);
+    total->bytesIn += __atomic_load_n(&m->bytesIn, __ATOMIC_RELAXED);
+    total->messagesOut += __atomic_load_n(&m->messagesOut, __ATOMIC_RELAXED);
+    total->bytesOut += __atomic_load_n(&m->bytesOut, __ATOMIC_RELAXED);
+    total->dropped += __atomic_load_n(&m->dropped, __ATOMIC_RELAXED);
+    total->sendErrors += __atomic_load_n(&m->sendErrors, __ATOMIC_RELAXED);
+    total->allocs += __atomic_load_n(&m->allocs, __ATOMIC_RELAXED);
+    total->compressIn += __atomic_load_n(&m->compressIn, __ATOMIC_RELAXED);
+    total->compressOut += __atomic_load_n(&m->compressOut, __ATOMIC_RELAXED);
+    total->compressNs += __atomic_load_n(&m->compressNs, __ATOMIC_RELAXED);
+    total->compressResets += __atomic_load_n(&m->compressResets, __ATOMIC_RELAXED);
+    total->replayed += __atomic_load_n(&m->replayed, __ATOMIC_RELAXED);
+    total->logEntries += __atomic_load_n(&m->logEntries, __ATOMIC_RELAXED);
+    total->logBytes += __atomic_load_n(&m->logBytes, __ATOMIC_RELAXED);
+    total->logDropped += __atomic_load_n(&m->logDropped, __ATOMIC_RELAXED);
+
+    histogram *from[6] = {&m->fanout, &m->fanoutTime, &m->queueDepth, &m->loopTime, &m->logAppendTime,
+                          &m->fedHop};
+    histogram *to[6] = {&total->fanout, &total->fanoutTime, &total->queueDepth, &total->loopTime,
+                        &total->logAppendTime, &total->fedHop};
+    for (int h = 0; h < 6; h++) {
+      for (int b = 0; b < HISTBUCKETS; b++) {
+        to[h]->counts[b] += __atomic_load_n(&from[h]->counts[b], __ATOMIC_RELAXED);
+      }
+      to[h]->count += __atomic_load_n(&from[h]->count, __ATOMIC_RELAXED);
+      to[h]->sum += __atomic_load_n(&from[h]->sum, __ATOMIC_RELAXED);
+    }
+  }
+
+  fprintf(out, "chat_shards %d\n", shardCount);
+  fprintf(out, "chat_participants %ld\n", total->participants);
+  fprintf(out, "chat_observers %ld\n", total->observers);
+  fprintf(out, "chat_rooms %d\n", __atomic_load_n(&roomCount, __ATOMIC_RELAXED));
+  long historyBytes = 0;
+  int high = __atomic_load_n(&roomHigh, __ATOMIC_ACQUIRE);
+  for (int i = 0; i < high; i++) {
+    historyBytes += __atomic_load_n(&rooms[i].historyBytes, __ATOMIC_RELAXED);
+  }
+  fprintf(out, "chat_history_bytes %ld\n", historyBytes);
+  for (int r = 0; r < 2; r++) {
+    for (int k = 0; k < HS_KINDS; k++) {
+      fprintf(out, "chat_handshakes_total{role=\"%s\",result=\"%s\"} %ld\n",
+              roles[r], outcomes[k], total->handshakes[r][k]);
+    }
+  }
+  for (int r = 0; r < 2; r++) {
+    fprintf(out, "chat_refused_total{role=\"%s\"} %ld\n", roles[r], total->refused[r]);
+  }
+  fprintf(out, "chat_messages_in_total %ld\n", total->messagesIn);
+  fprintf(out, "chat_bytes_in_total %ld\n", total->bytesIn);
+  fprintf(out, "chat_messages_out_total %ld\n", total->messagesOut);
+  fprintf(out, "chat_bytes_out_total %ld\n", total->bytesOut);
+  fprintf(out, "chat_dropped_total %ld\n", total->dropped);
+  fprintf(out, "chat_send_errors_total %ld\n", total->sendErrors);
+  fprintf(out, "chat_allocations_total %ld\n", total->allocs);
+  fprintf(out, "chat_compress_bytes_in_total %ld\n", total->compressIn);
+  fprintf(out, "chat_compress_bytes_out_total %ld\n", total->compressOut);
+  fprintf(out, "chat_compress_ratio %.3f\n",
+          total->compressOut > 0 ? (double)total->compressIn / total->compressOut : 0.0);
+  fprintf(out, "chat_compress_nanoseconds_total %ld\n", total->compressNs);
+  fprintf(out, "chat_compress_resets_total %ld\n", total->compressResets);
+  fprintf(out, "chat_history_replayed_total %ld\n", total->replayed);
+  writeHistogram(out, "chat_fanout", total->fanout.counts, total->fanout.count, total->fanout.sum);
+  writeHistogram(out, "chat_fanout_nanoseconds", total->fanoutTime.counts, total->fanoutTime.count,
+                 total->fanoutTime.sum);
+  writeHistogram(out, "chat_queue_depth", total->queueDepth.counts, total->queueDepth.count,
+                 total->queueDepth.sum);
+  writeHistogram(out, "chat_loop_nanoseconds", total->loopTime.counts, total->loopTime.count,
+                 total->loopTime.sum);
+  fprintf(out, "chat_log_entries_total %ld\n", total->logEntries);
+  fprintf(out, "chat_log_bytes_total %ld\n", total->logBytes);
+  fprintf(out, "chat_log_dropped_total %ld\n", total->logDropped);
+  fprintf(out, "chat_log_syncs_total %ld\n", __atomic_load_n(&logSyncs, __ATOMIC_RELAXED));
+  writeHistogram(out, "chat_log_append_nanoseconds", total->logAppendTime.counts,
+                 total->logAppendTime.count, total->logAppendTime.sum);
+
+  // the sync thread's, copied into a histogram that has already been written out
+  for (int b = 0; b < HISTBUCKETS; b++) {
+    total->loopTime.counts[b] = __atomic_load_n(&logSyncTime.counts[b], __ATOMIC_RELAXED);
+  }
+  writeHistogram(out, "chat_log_sync_nanoseconds", total->loopTime.counts,
+                 __atomic_load_n(&logSyncTime.count, __ATOMIC_RELAXED),
+                 __atomic_load_n(&logSyncTime.sum, __ATOMIC_RELAXED));
+
+  long traceDropped = 0;
+  long traceSuppressed = 0;
+  for (traceRing *r = __atomic_load_n(&traceRings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+    traceDropped += __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    traceSuppressed += __atomic_load_n(&r->suppressed, __ATOMIC_RELAXED);
+  }
+  fprintf(out, "chat_trace_dropped_total %ld\n", traceDropped);
+  fprintf(out, "chat_trace_suppressed_total %ld\n", traceSuppressed);
+  fprintf(out, "chat_federation_links %ld\n", __atomic_load_n(&fedLinks, __ATOMIC_RELAXED));
+  fprintf(out, "chat_federation_remote_users %d\n", __atomic_load_n(&remoteUsers, __ATOMIC_RELAXED));
+  fprintf(out, "chat_federation_records_in_total %ld\n", __atomic_load_n(&fedRecordsIn, __ATOMIC_RELAXED));
+  fprintf(out, "chat_federation_records_out_total %ld\n", __atomic_load_n(&fedRecordsOut, __ATOMIC_RELAXED));
+  fprintf(out, "chat_federation_bytes_in_total %ld\n", __atomic_load_n(&fedBytesIn, __ATOMIC_RELAXED));
+  fprintf(out, "chat_federation_bytes_out_total %ld\n", __atomic_load_n(&fedBytesOut, __ATOMIC_RELAXED));
+  fprintf(out, "chat_federation_link_drops_total %ld\n", __atomic_load_n(&fedDrops, __ATOMIC_RELAXED));
+  fprintf(out, "chat_federation_name_conflicts_total %ld\n", __atomic_load_n(&fedConflicts, __ATOMIC_RELAXED));
+  fprintf(out, "chat_federation_directory_full_total %ld\n", __atomic_load_n(&fedDirFull, __ATOMIC_RELAXED));
+  writeHistogram(out, "chat_federation_hop_nanoseconds", total->fedHop.counts, total->fedHop.count,
+                 total->fedHop.sum);
+  free(total);
+}
+
+void writeHistogram(FILE *out, const char *name, uint64_t *sums, uint64_t count, uint64_t sum) {
+  uint64_t seen = 0;
+  for (int b = 0; b < HISTBUCKETS; b++) {
+    if (sums[b] == 0) {
+      continue;
+    }
+    seen += sums[b];
+
+    // le is the largest value the bucket holds
+    uint64_t le = b;
+    if (b >= HISTSUB) {
+      int top = b / HISTSUB + 3;
+      le = ((uint64_t)(HISTSUB + b % HISTSUB + 1) << (top - 4)) - 1;
+    }
+    fprintf(out, "%s_bucket{le=\"%lu\"} %lu\n", name, le, seen);
+  }
+  fprintf(out, "%s_bucket{le=\"+Inf\"} %lu\n", name, count);
+  fprintf(out, "%s_sum %lu\n", name, sum);
+  fprintf(out, "%s_count %lu\n", name, count);
+}
+
+void* runAdmin(void *arg) {
+  struct sockaddr_in cad;
+  socklen_t alen;
+
+  // answers one scraper at a time, so it can simply block
+  int sdadmin = openListener(adminPort);
+  fcntl(sdadmin, F_SETFL, fcntl(sdadmin, F_GETFL, 0) & ~O_NONBLOCK);
+
+  while (1) {
+    alen = sizeof(cad);
+    int sd = accept(sdadmin, (struct sockaddr *)&cad, &alen);
+    if (sd < 0) {
+      continue;
+    }
+
+    // plain "nc host port" gets the text straight away, an HTTP scraper
+    // sends its request first and gets a response it understands
+    char request[1024];
+    int n = 0;
+    struct pollfd asked = {sd, POLLIN, 0};
+    if (poll(&asked, 1, 100) > 0) {
+      n = recv(sd, request, sizeof(request), 0);
+    }
+
+    FILE *out = fdopen(sd, "w");
+    if (out == NULL) {
+      close(sd);
+      continue;
+    }
+    if (n >= 4 && memcmp(request, "GET ", 4) == 0) {
+      fprintf(out, "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\n\r\n");
+    }
+    writeMetrics(out);
+    fclose(out);
+  }
+  return NULL;
+}
+
+/* Trace -------------------------------------------------------------*/
+
+void traceRecord(traceSite *site, const char *str, long a, long b) {
+  uint64_t now = monoNs();
+
+  // a new second starts the site's count over, whichever thread sees it first
+  uint64_t window = now / 1000000000;
+  if (__atomic_load_n(&site->window, __ATOMIC_RELAXED) != window) {
+    __atomic_store_n(&site->window, window, __ATOMIC_RELAXED);
+    __atomic_store_n(&site->count, 0, __ATOMIC_RELAXED);
+  }
+  traceRing *r = traceMine != NULL ? traceMine : (traceMine = traceAttach());
+  if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) >= TRACERATE) {
+    __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&r->suppressed, r->suppressed + 1, __ATOMIC_RELAXED);
+    return;
+  }
+
+  // the trace thread is behind, losing the record beats waiting for it
+  unsigned tail = r->tail;
+  if (tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == TRACERING) {
+    __atomic_store_n(&r->dropped, r->dropped + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  traceEntry *t = &r->entries[tail & (TRACERING - 1)];
+  t->site = site;
+  t->at = now;
+  t->a = a;
+  t->b = b;
+  t->suppressed = 0;
+  if (__atomic_load_n(&site->suppressed, __ATOMIC_RELAXED) > 0) {
+    t->suppressed = __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+  }
+  t->shard = me != NULL ? shardId : -1;
+  t->str[0] = '\0';
+  if (str != NULL) {
+    strncpy(t->str, str, TRACESTR - 1);
+    t->str[TRACESTR - 1] = '\0';
+  }
+  __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+traceRing* traceAttach() {
+  // zeroed, and page aligned for head and tail's cache lines
+  traceRing *r = mmap(NULL, sizeof(traceRing), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (r == MAP_FAILED) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  r->next = __atomic_load_n(&traceRings, __ATOMIC_RELAXED);
+  while (!__atomic_compare_exchange_n(&traceRings, &r->next, r, true,
+                                      __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+  return r;
+}
+
+int traceFormat(char *out, int room, traceEntry *t) {
+  static const char *levels[TRACE_OFF] = {"debug", "info", "warn"};
+  uint64_t since = t->at - traceStart;
+  long args[2] = {t->a, t->b};
+  int next = 0;
+
+  // one byte is kept back for the newline, snprintf's count is clamped as
+  // the line gets cut off at room
+  room--;
+  int n = snprintf(out, room, "%lu.%06lu %-5s [", since / 1000000000, since / 1000 % 1000000,
+                   levels[t->site->level]);
+  n += t->shard >= 0 ? snprintf(out + n, room - n, "%d] ", t->shard) : snprintf(out + n, room - n, "-] ");
+  for (const char *p = t->site->fmt; *p != '\0' && n < room - 1; p++) {
+    if (*p != '%') {
+      out[n++] = *p;
+      continue;
+    }
+    while (*++p == 'l');
+    if (*p == 'd') {
+      n += snprintf(out + n, room - n, "%ld", next < 2 ? args[next++] : 0);
+    }
+    else if (*p == 'u') {
+      n += snprintf(out + n, room - n, "%lu", (unsigned long)(next < 2 ? args[next++] : 0));
+    }
+    else if (*p == 's') {
+      n += snprintf(out + n, room - n, "%s", t->str);
+    }
+    else if (*p == '%') {
+      out[n++] = '%';
+    }
+    else {
+      break;
+    }
+    if (n > room - 1) {
+      n = room - 1;
+    }
+  }
+  if (t->suppressed > 0 && n < room - 1) {
+    n += snprintf(out + n, room - n, " (%ld more not kept)", t->suppressed);
+  }
+  if (n > room - 1) {
+    n = room - 1;
+  }
+  out[n++] = '\n';
+  return n;
+}
+
+void traceWrite(const char *out, int len) {
+  while (len > 0) {
+    int n = write(STDOUT_FILENO, out, len);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    out += n;
+    len -= n;
+  }
+}
+
+void* runTrace(void *arg) {
+  char *out = malloc(TRACEOUT);
+  if (out == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+
+  // only this thread writes, so a slow stdout holds up nobody but the rings
+  while (1) {
+    struct timespec nap = {0, TRACEDRAINMS * 1000000L};
+    nanosleep(&nap, NULL);
+    int len = 0;
+    for (traceRing *r = __atomic_load_n(&traceRings, __ATOMIC_ACQUIRE); r != NULL; r = r->next) {
+      unsigned head = r->head;
+      unsigned tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+      while (head != tail) {
+        if (TRACEOUT - len < TRACELINE) {
+          traceWrite(out, len);
+          len = 0;
+        }
+        len += traceFormat(out + len, TRACELINE, &r->entries[head & (TRACERING - 1)]);
+        head++;
+      }
+      __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+    }
+    traceWrite(out, len);
+  }
+  return NULL;
+}
+
+/* Federation --------------------------------------------------------*/
+
+void federate(int link, uint8_t type, const char *a, const char *b, const char *text) {
+  if (!federated) {
+    return;
+  }
+  char *out = fedReserve(&fedOut, 1 + FEDRECORDMAX);
+  out[0] = (int8_t)link;
+  fedOut.len += 1 + fedEncode(out + 1, type, wallNs(), a, b, text);
+}
+
+int findRemote(const char *name) {
+  pthread_mutex_lock(&nameLock);
+  nameEntry *e = findName(name);
+  int link = e != NULL ? e->peer : -1;
+  pthread_mutex_unlock(&nameLock);
+  return link;
+}
+
+int fedEncode(char *out, uint8_t type, uint64_t sentAt, const char *a, const char *b, const char *text) {
+  a = a != NULL ? a : "";
+  b = b != NULL ? b : "";
+  text = text != NULL ? text : "";
+  uint8_t aLength = strlen(a);
+  uint8_t bLength = strlen(b);
+  uint16_t textLength = strlen(text);
+  uint16_t wire = htons(FEDFIXED + aLength + bLength + textLength);
+  uint64_t at = htobe64(sentAt);
+
+  char *p = out;
+  memcpy(p, &wire, sizeof(uint16_t));
+  p += sizeof(uint16_t);
+  *p++ = type;
+  memcpy(p, &at, sizeof(uint64_t));
+  p += sizeof(uint64_t);
+  *p++ = aLength;
+  memcpy(p, a, aLength);
+  p += aLength;
+  *p++ = bLength;
+  memcpy(p, b, bLength);
+  p += bLength;
+  wire = htons(textLength);
+  memcpy(p, &wire, sizeof(uint16_t));
+  p += sizeof(uint16_t);
+  memcpy(p, text, textLength);
+  return p + textLength - out;
+}
+
+int fedDecode(const char *buf, int len, fedRecord *r) {
+  uint16_t wire;
+  if (len < (int)sizeof(uint16_t)) {
+    return 0;
+  }
+  memcpy(&wire, buf, sizeof(uint16_t));
+  int recordLength = ntohs(wire);
+  if (recordLength < (int)FEDFIXED || recordLength > (int)(FEDRECORDMAX - sizeof(uint16_t))) {
+    return -1;
+  }
+  if (len < (int)sizeof(uint16_t) + recordLength) {
+    return 0;
+  }
+
+  // every length is checked against what is left before it is used
+  const char *p = buf + sizeof(uint16_t);
+  const char *end = p + recordLength;
+  r->type = *p++;
+  uint64_t at;
+  memcpy(&at, p, sizeof(uint64_t));
+  r->sentAt = be64toh(at);
+  p += sizeof(uint64_t);
+  int aLength = (uint8_t)*p++;
+  if (aLength < 1 || aLength > 10 || end - p < aLength + 1) {
+    return -1;
+  }
+  memcpy(r->a, p, aLength);
+  r->a[aLength] = '\0';
+  p += aLength;
+  int bLength = (uint8_t)*p++;
+  if (bLength > 10 || end - p < bLength + (int)sizeof(uint16_t)) {
+    return -1;
+  }
+  memcpy(r->b, p, bLength);
+  r->b[bLength] = '\0';
+  p += bLength;
+  memcpy(&wire, p, sizeof(uint16_t));
+  p += sizeof(uint16_t);
+  int textLength = ntohs(wire);
+  if (textLength >= MAXMSG || end - p != textLength) {
+    return -1;
+  }
+  memcpy(r->text, p, textLength);
+  r->text[textLength] = '\0';
+
+  // only the directory records go without a user
+  if (r->type < FED_ONLINE || r->type > FED_HELLO ||
+      (bLength == 0 && r->type != FED_ONLINE && r->type != FED_OFFLINE && r->type != FED_HELLO)) {
+    return -1;
+  }
+  return sizeof(uint16_t) + recordLength;
+}
+
+char* fedReserve(fedBuf *b, int more) {
+  if (b->len + more > b->cap) {
+    while (b->len + more > b->cap) {
+      b->cap = b->cap == 0 ? 4096 : b->cap * 2;
+    }
+    b->data = realloc(b->data, b->cap);
+    if (b->data == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+  return b->data + b->len;
+}
+
+void deliverRemote(frame *f) {
+  fedRecord r;
+  int used;
+  for (int off = 0; off < f->len; off += used) {
+    used = fedDecode(f->data + off, f->len - off, &r);
+    if (used <= 0) {
+      break;
+    }
+
+    // a recipient that left since the federation thread looked gets nothing
+    if (r.type == FED_PRIVATE) {
+      int obsShard;
+      int o = findObsSlot(r.a, &obsShard);
+      if (o >= 0) {
+        frame *m = makeMessage(REC_PRIVATE, r.b, r.text);
+        if (obsShard != shardId) {
+          postMail(obsShard, MAIL_PRIVATE, m, -1, r.a);
+        }
+        else if (observers[o].sdobs != 0) {
+          sendFrame(o, m);
+        }
+        releaseFrame(m);
+      }
+    }
+
+    // only rooms that have participants here have observers here
+    else {
+      int id = pinRoom(r.a);
+      if (id < 0) {
+        continue;
+      }
+      frame *m;
+      if (r.type == FED_PUBLIC) {
+        m = makeMessage(REC_PUBLIC, r.b, r.text);
+      }
+      else {
+        bool joined = r.type == FED_JOIN;
+        char* msgToSend = concat("User ", r.b, joined ? " has joined" : " has left");
+        m = makeFrame(msgToSend, strlen(msgToSend));
+        m->record = makeRecord(joined ? REC_JOIN : REC_LEAVE, r.b, NULL);
+      }
+      broadcastFrame(m, id, -1);
+      releaseFrame(m);
+      leaveRoom(id);
+      arenaReset();
+    }
+
+    // the wall clocks of two nodes on one host agree, across hosts this is
+    // only as good as their clock sync
+    uint64_t now = wallNs();
+    histRecord(&me->stats.fedHop, now > r.sentAt ? now - r.sentAt : 0);
+  }
+}
+
+void* runFederation(void *arg) {
+  struct pollfd fds[2 + MAXPEERS];
+  int fdPeer[2 + MAXPEERS];
+  for (int p = 0; p < MAXPEERS; p++) {
+    peers[p].sd = -1;
+  }
+  int listener = fedPort != 0 ? openListener(fedPort) : -1;
+  for (int p = 0; p < peerCount; p++) {
+    fedDial(p);
+  }
+
+  while (1) {
+
+    // the wake pipe, the listener, every link that is up or being dialed,
+    // and no sleeping past the next redial
+    int n = 0;
+    int timeout = -1;
+    uint64_t now = monoMs();
+    fds[n++] = (struct pollfd){fedWake[0], POLLIN, 0};
+    if (listener >= 0) {
+      fds[n++] = (struct pollfd){listener, POLLIN, 0};
+    }
+    int first = n;
+    for (int p = 0; p < MAXPEERS; p++) {
+      if (peers[p].sd >= 0) {
+        short events = peers[p].connecting ? POLLOUT : POLLIN;
+        if (peers[p].up && peers[p].outSent < peers[p].out.len) {
+          events |= POLLOUT;
         }
+        fdPeer[n] = p;
+        fds[n++] = (struct pollfd){peers[p].sd, events, 0};
+      }
+      else if (peers[p].dialed) {
+        int wait = peers[p].retryAt > now ? peers[p].retryAt - now : 0;
+        timeout = timeout < 0 || wait < timeout ? wait : timeout;
+      }
+    }
+    if (poll(fds, n, timeout) < 0 && errno != EINTR) {
+      perror("poll");
+      exit(EXIT_FAILURE);
+    }
+
+    if (fds[0].revents != 0) {
+      char wakes[64];
+      while (read(fedWake[0], wakes, sizeof(wakes)) > 0);
+      fedTakeInbox();
+    }
+    if (listener >= 0 && fds[1].revents != 0) {
+      fedAccept(listener);
+    }
+    for (int i = first; i < n; i++) {
+      int p = fdPeer[i];
+      if (fds[i].revents == 0 || peers[p].sd != fds[i].fd) {
+        continue;
+      }
+      if (peers[p].connecting) {
+        fedConnected(p);
+        continue;
+      }
+      if (fds[i].revents & (POLLIN | POLLHUP | POLLERR)) {
+        fedRead(p);
+      }
+      if (peers[p].sd >= 0 && (fds[i].revents & POLLOUT)) {
+        fedWrite(p);
+      }
+    }
+    now = monoMs();
+    for (int p = 0; p < peerCount; p++) {
+      if (peers[p].sd < 0 && peers[p].retryAt <= now) {
+        fedDial(p);
       }
     }
-  }
-
 
+    // what came in goes to each shard as one piece of mail, in a frame of
+    // its own that is freed with the mail's reference
+    for (int s = 0; s < shardCount; s++) {
+      fedBuf *batch = &fedBatches[s];
+      if (batch->len == 0) {
+        continue;
+      }
+      frame *f = malloc(sizeof(frame) + batch->len);
+      if (f == NULL) {
+        printf("out of memory\n");
+        exit(1);
+      }
+      f->refs = 1;
+      f->sizeClass = -1;
+      f->owner = -1;
+      f->next = NULL;
+      f->record = NULL;
+      f->len = batch->len;
+      memcpy(f->data, batch->data, batch->len);
+      postMail(s, MAIL_REMOTE, f, -1, NULL);
+      releaseFrame(f);
+      batch->len = 0;
+    }
+    flushMail();
+  }
+  return NULL;
+}
 
+void fedDial(int p) {
+  peer *l = &peers[p];
+  l->retryAt = monoMs() + FEDRETRYMS;
+  l->sd = socket(AF_INET, SOCK_STREAM, tcpProto);
+  if (l->sd < 0) {
+    return;
+  }
+  setNonBlocking(l->sd);
+  if (connect(l->sd, (struct sockaddr *)&l->addr, sizeof(l->addr)) == 0) {
+    fedUp(p);
+  }
+  else if (errno == EINPROGRESS) {
+    l->connecting = true;
+  }
+  else {
+    close(l->sd);
+    l->sd = -1;
+  }
 }
 
-int connectingPart(int sdpart, struct sockaddr_in cad, int alen){
-  bool notFound = true;
-  int j = 0;
-  while (j < MAXSIZE && notFound){
+void fedConnected(int p) {
+  peer *l = &peers[p];
+  int err = 0;
+  socklen_t len = sizeof(err);
+  l->connecting = false;
+  if (getsockopt(l->sd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+    close(l->sd);
+    l->sd = -1;
+    return;
+  }
+  fedUp(p);
+}
 
-    if(participants[j].sdparts == 0){
-      notFound = false;
+void fedAccept(int listener) {
+  int sd;
+  while ((sd = accept(listener, NULL, NULL)) >= 0) {
+    int p = peerCount;
+    while (p < MAXPEERS && peers[p].sd >= 0) {
+      p++;
     }
-    else{
-      j++;
+    if (p == MAXPEERS) {
+      TRACE(TRACE_WARN, "federation link refused, all %d are in use", NULL, MAXPEERS, 0);
+      close(sd);
+      continue;
     }
+    setNonBlocking(sd);
+    peers[p].sd = sd;
+    fedUp(p);
   }
-  alen = sizeof(cad);
+}
 
-  //array is full
-  if(j == MAXSIZE){
-    int sdFULL;
-    if ((sdFULL = accept(sdpart, (struct sockaddr *)&cad, &alen)) < 0) {
-      fprintf(stderr, "Error: Accept failed\n");
-      exit(EXIT_FAILURE);
+void fedUp(int p) {
+  peer *l = &peers[p];
+  int one = 1;
+  setsockopt(l->sd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  l->up = true;
+  l->out.len = 0;
+  l->outSent = 0;
+  l->inLen = 0;
+  l->node = 0;
+  __atomic_store_n(&fedLinks, fedLinks + 1, __ATOMIC_RELAXED);
+  TRACE(TRACE_INFO, "federation link %d up", NULL, p, 0);
+
+  // who this is, then everything the shards hand over from now on comes after
+  uint64_t now = wallNs();
+  char id[11];
+  snprintf(id, sizeof(id), "%u", nodeId);
+  l->out.len += fedEncode(fedReserve(&l->out, FEDRECORDMAX), FED_HELLO, now, id, NULL, NULL);
+  pthread_mutex_lock(&nameLock);
+  for (int i = 0; i < nameTableSize; i++) {
+    if (nameTable[i].name[0] != '\0' && nameTable[i].peer < 0) {
+      char *out = fedReserve(&l->out, FEDRECORDMAX);
+      l->out.len += fedEncode(out, FED_ONLINE, now, nameTable[i].name, NULL, NULL);
+      __atomic_store_n(&fedRecordsOut, fedRecordsOut + 1, __ATOMIC_RELAXED);
     }
-    char buf2[]={'N'};
-    send(sdFULL, &buf2, sizeof(char), 0);
-    close(sdFULL);
   }
+  pthread_mutex_unlock(&nameLock);
+  fedWrite(p);
+}
 
-  else{
-    if ((participants[j].sdparts=accept(sdpart, (struct sockaddr *)&cad, &alen)) < 0) {
-      fprintf(stderr, "Error: Accept failed\n");
-      exit(EXIT_FAILURE);
+void fedDown(int p) {
+  peer *l = &peers[p];
+  if (l->up) {
+    __atomic_store_n(&fedLinks, fedLinks - 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&fedDrops, fedDrops + 1, __ATOMIC_RELAXED);
+    TRACE(TRACE_INFO, "federation link %d down", NULL, p, 0);
+  }
+  close(l->sd);
+  l->sd = -1;
+  l->up = false;
+  l->connecting = false;
+  l->retryAt = monoMs() + FEDRETRYMS;
+
+  // its users are gone until it is back and says otherwise, a slot stays
+  // put while the entry moved into it is checked
+  pthread_mutex_lock(&nameLock);
+  for (int i = 0; i < nameTableSize; ) {
+    if (nameTable[i].name[0] != '\0' && nameTable[i].peer == p) {
+      char name[11];
+      strcpy(name, nameTable[i].name);
+      removeName(name);
+      __atomic_store_n(&remoteUsers, remoteUsers - 1, __ATOMIC_RELAXED);
     }
-
-    // case 1: connection
-    if (participants[j].state  == -1) {
-      if (pSize < MAXSIZE){
-        char buf[]={'Y'};
-        send(participants[j].sdparts, &buf, sizeof(char), 0);
-        //struct timeval start;
-        //struct timeval end;
-        gettimeofday(&participants[j].start, NULL);
-        participants[j].state  = 0;
-        pSize++;
-      }
+    else {
+      i++;
     }
   }
-  return j;
+  pthread_mutex_unlock(&nameLock);
 }
 
-int connectingObs(int sdobs, struct sockaddr_in cad, int alen){
-
-  bool notFound = true;
-  int j = 0;
-  while (j < MAXSIZE && notFound){
-    if(observers[j].sdobs == 0){
-      notFound = false;
+void fedRead(int p) {
+  peer *l = &peers[p];
+  while (1) {
+    int n = recv(l->sd, l->in + l->inLen, FEDREADSIZE - l->inLen, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
     }
-    else{
-      j++;
+    if (n <= 0) {
+      fedDown(p);
+      return;
     }
+    l->inLen += n;
+    __atomic_store_n(&fedBytesIn, fedBytesIn + n, __ATOMIC_RELAXED);
+
+    fedRecord r;
+    int off = 0;
+    int used;
+    while ((used = fedDecode(l->in + off, l->inLen - off, &r)) > 0) {
+      fedRoute(p, l->in + off, used, &r);
+      off += used;
+    }
+    if (used < 0) {
+      TRACE(TRACE_WARN, "bad federation record, dropping link %d", NULL, p, 0);
+      fedDown(p);
+      return;
+    }
+    l->inLen -= off;
+    memmove(l->in, l->in + off, l->inLen);
   }
-  alen = sizeof(cad);
+}
 
-  //array is full
-  if(j == MAXSIZE){
-    int sdFULL;
-    if ((sdFULL = accept(sdobs, (struct sockaddr *)&cad, &alen)) < 0) {
-      fprintf(stderr, "Error: Accept failed\n");
-      exit(EXIT_FAILURE);
-      char buf2[]={'N'};
-      send(sdFULL, &buf2, sizeof(char), 0);
-      close(sdFULL);
+void fedWrite(int p) {
+  peer *l = &peers[p];
+  while (l->outSent < l->out.len) {
+    int n = send(l->sd, l->out.data + l->outSent, l->out.len - l->outSent, 0);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      return;
     }
+    if (n <= 0) {
+      fedDown(p);
+      return;
+    }
+    l->outSent += n;
+    __atomic_store_n(&fedBytesOut, fedBytesOut + n, __ATOMIC_RELAXED);
   }
+  l->out.len = 0;
+  l->outSent = 0;
+}
 
-  else{
-    if ((observers[j].sdobs=accept(sdobs, (struct sockaddr *)&cad, &alen)) < 0) {
-      fprintf(stderr, "Error: Accept failed\n");
-      exit(EXIT_FAILURE);
+void fedRoute(int p, const char *rec, int len, fedRecord *r) {
+  __atomic_store_n(&fedRecordsIn, fedRecordsIn + 1, __ATOMIC_RELAXED);
+  switch (r->type) {
+
+    case FED_HELLO:
+      peers[p].node = strtoul(r->a, NULL, 10);
+      TRACE(TRACE_INFO, "federation link %d is node %s", r->a, p, 0);
+      break;
+
+    case FED_ONLINE:
+      pthread_mutex_lock(&nameLock);
+      fedClaim(p, r->a, findName(r->a));
+      pthread_mutex_unlock(&nameLock);
+      break;
+
+    case FED_OFFLINE: {
+      pthread_mutex_lock(&nameLock);
+      nameEntry *e = findName(r->a);
+      if (e != NULL && e->peer == p) {
+        removeName(r->a);
+        __atomic_store_n(&remoteUsers, remoteUsers - 1, __ATOMIC_RELAXED);
+      }
+      pthread_mutex_unlock(&nameLock);
+      break;
     }
 
-    // case 1: connection
-    if (observers[j].state  == -1) {
-      if (oSize < MAXSIZE){
-        char buf[]={'Y'};
-        send(observers[j].sdobs, &buf, sizeof(char), 0);
-        //gettimeofday(&observers[j].start, NULL);
-        observers[j].state  = 0;
-        oSize++;
+    // to the recipient's shard, if it is here at all
+    case FED_PRIVATE: {
+      pthread_mutex_lock(&nameLock);
+      nameEntry *e = findName(r->a);
+      int s = e != NULL && e->peer < 0 ? e->shard : -1;
+      pthread_mutex_unlock(&nameLock);
+      if (s >= 0) {
+        memcpy(fedReserve(&fedBatches[s], len), rec, len);
+        fedBatches[s].len += len;
       }
+      break;
+    }
+
+    // one shard per room keeps the room's records in order
+    default: {
+      int s = hashName(r->a) % shardCount;
+      memcpy(fedReserve(&fedBatches[s], len), rec, len);
+      fedBatches[s].len += len;
+      break;
     }
   }
-  return j;
 }
 
-void usernamePart(int sdpart, int j, fd_set readfds){
-  int n;
-  uint8_t nameLength;
-  bool needName = true;
-  while(needName){
+void fedClaim(int p, const char *name, nameEntry *e) {
+  if (e == NULL && remoteUsers < remoteMax) {
+    e = addName(name, -1);
+    e->shard = -1;
+    e->peer = p;
+    __atomic_store_n(&remoteUsers, remoteUsers + 1, __ATOMIC_RELAXED);
+    return;
+  }
+  if (e == NULL) {
+    __atomic_store_n(&fedDirFull, fedDirFull + 1, __ATOMIC_RELAXED);
+    TRACE(TRACE_WARN, "federation directory full, %s not added", name, 0, 0);
+    return;
+  }
+  if (e->peer == p) {
+    return;
+  }
 
-    // asking/checking username of participants
-    if(participants[j].state == 0){
-      n = recv(participants[j].sdparts, &nameLength, sizeof(uint8_t), 0);
+  // taken on two nodes, the lower id keeps it (equal ids leave it as it is)
+  __atomic_store_n(&fedConflicts, fedConflicts + 1, __ATOMIC_RELAXED);
+  uint32_t holder = e->peer < 0 ? nodeId : peers[e->peer].node;
+  if (peers[p].node == 0 || peers[p].node >= holder) {
+    TRACE(TRACE_WARN, "username %s claimed by link %d too, kept", name, p, 0);
+    return;
+  }
+  TRACE(TRACE_WARN, "username %s taken over by link %d", name, p, 0);
+
+  // a local user is told and disconnected by its shard, which clears shard,
+  // part and obs when it does (disconnectObs still needs them until then)
+  if (e->peer < 0) {
+    postMail(e->shard, MAIL_EVICT, NULL, e->part, name);
+    __atomic_store_n(&remoteUsers, remoteUsers + 1, __ATOMIC_RELAXED);
+  }
+  e->peer = p;
+}
 
-      // close everything
-      if (n == 0) {
-        close(participants[j].sdparts);
-        printf("I AM CLOSING THE SOCKET IN PARTICPANT USER \n");
-        FD_CLR(participants[j].sdparts, &readfds);
-        pSize--;
-        resetPartSD(j);
+void evictPart(int j, const char *name) {
+  if (participants[j].state != 1 || strcmp(partCold[j].name, name) != 0) {
+    return;
+  }
+  TRACE(TRACE_WARN, "participant %s lost its username to another node, disconnecting", name, 0, 0);
+
+  // written right away, it only gets there if the socket takes it before
+  // the observer is closed (io_uring waits, unless nothing is in flight)
+  int o = partCold[j].obs;
+  if (o >= 0) {
+    char *warning = concat("Warning: username ", name, " is taken on another server, disconnecting...");
+    frame *f = makeFrame(warning, strlen(warning));
+    f->record = makeRecord(REC_WARNING, NULL, warning);
+    sendFrame(o, f);
+    releaseFrame(f);
+    if (observers[o].batch != NULL) {
+      closeBatch(o);
+    }
+    if (obsCold[o].outSending == 0) {
+      flushObs(o);
+    }
+  }
+  disconnectPart(j);
+}
 
+void fedTakeInbox() {
+  static fedBuf in;
+
+  // swap the inbox out so shards only wait for a pointer swap
+  pthread_mutex_lock(&fedLock);
+  fedBuf handed = fedInbox;
+  fedInbox = in;
+  fedInbox.len = 0;
+  pthread_mutex_unlock(&fedLock);
+  in = handed;
+
+  uint16_t wire;
+  for (int off = 0; off < in.len; ) {
+    int link = (int8_t)in.data[off++];
+    memcpy(&wire, in.data + off, sizeof(uint16_t));
+    int len = sizeof(uint16_t) + ntohs(wire);
+    for (int p = 0; p < MAXPEERS; p++) {
+      if (peers[p].up && (link < 0 || link == p)) {
+        fedAppend(p, in.data + off, len);
       }
-      else{
+    }
+    off += len;
+  }
+  for (int p = 0; p < MAXPEERS; p++) {
+    if (peers[p].up) {
+      fedWrite(p);
+    }
+  }
+}
 
-        char name[11] = {'\0'};
-        for (int i = 0; i < 11; i++) {
-          name[i] = '\0';
-        }
-        n = recv(participants[j].sdparts, name, sizeof(char)*nameLength, 0);
-        gettimeofday(&participants[j].end, NULL);
-        double timeTaken = (double)(participants[j].end.tv_usec - participants[j].start.tv_usec)/1000000 + (participants[j].end.tv_sec - participants[j].start.tv_sec);
-        if(timeTaken > participants[j].time){
-
-          needName = false;
-          close(participants[j].sdparts);
-          FD_CLR(participants[j].sdparts, &readfds);
-          pSize--;
-          resetPartSD(j);
-
-          //ran out of time
-        }
-        else{
-          participants[j].time = participants[j].time - timeTaken;
-          //didn't run out of time
+void fedAppend(int p, const char *rec, int len) {
+  peer *l = &peers[p];
+  if (l->out.len - l->outSent + len > FEDQUEUEMAX) {
+    TRACE(TRACE_WARN, "federation link %d fell behind, dropping it", NULL, p, 0);
+    fedDown(p);
+    return;
+  }
+  memcpy(fedReserve(&l->out, len), rec, len);
+  l->out.len += len;
+  __atomic_store_n(&fedRecordsOut, fedRecordsOut + 1, __ATOMIC_RELAXED);
+}
 
-          bool validLength = true;
-          if (nameLength > 10){
-            validLength = false;
-          }
+/* Event loop --------------------------------------------------------*/
 
-          bool validChar = true;
-          for (int i = 0; i < nameLength; i++){
-            char currChar = name[i];
-            if (!(currChar == 95 || (currChar >= 48 && currChar <= 57) || (currChar >= 65 && currChar <= 90) || (currChar >= 97 && currChar <= 122))){
-              validChar = false;
-            }
-          }
+void loopInit() {
+  if (backend == BACKEND_URING) {
+    uringInit();
+  }
+  else {
+    pollInit();
+  }
+}
 
-          name[nameLength] = '\0';
-          bool alreadyGuessed = false;
-          for(int a = 0; a < MAXSIZE; a++){
-            if(strcmp(participants[a].name, name) == 0){
-              //no observer yet, send "I"
-              a = MAXSIZE;
-              alreadyGuessed = true;
-            }
-          }
+void loopAdd(int sd, int tag, int slot) {
+  if (backend == BACKEND_URING) {
+    uringAdd(sd, tag, slot);
+  }
+  else {
+    pollAdd(sd, tag, slot);
+  }
+}
+
+void loopDel(int sd) {
+  if (backend == BACKEND_URING) {
+    uringCancel(sd);
+  }
+  else {
+    pollDel(sd);
+  }
+}
 
-          if(validLength && validChar && !alreadyGuessed){
+bool loopFits(int sd) {
+  return backend == BACKEND_URING || pollFits(sd);
+}
 
-            strcpy(participants[j].name, name);
-            participants[j].state = 1;
+void loopWantWrite(int sd, bool want) {
+  if (backend != BACKEND_URING) {
+    pollWantWrite(sd, want);
+  }
+}
 
-            //send 'Y' to participant
-            char buf[] = {'Y'};
-            needName = false;
-            send(participants[j].sdparts, &buf, sizeof(char), 0);
+int loopWait(loopEvent *events, int maxEvents, int timeout) {
+  return pollWait(events, maxEvents, timeout);
+}
 
-            // send the name to everybody that "a new 'username' joined"
-            uint16_t messageSize = 18 + nameLength;
-            char* str1 = "User ";
-            // str2 will be name
-            char* str3 = " has joined";
-            char* message = concat(str1, name, str3);
-            char messageCurr[messageSize+1];
+#ifndef USE_SELECT
 
-            for(int k = 0; k < messageSize; k++){
-              messageCurr[k] = message[k];
-            }
+__thread int epollFd; /* this shard's epoll instance, every socket is registered with one */
 
-            messageSize = htons(ntohs(messageSize));
+void pollInit() {
+  epollFd = epoll_create1(0);
+  if (epollFd < 0) {
+    fprintf(stderr, "Error: epoll creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+}
 
+void pollAdd(int sd, int tag, int slot) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET;
 
-            for(int i = 0; i < MAXSIZE; i++){
-              if((observers[i].sdobs != 0) && (observers[i].sdobs != participants[j].sdobs)){
-                send(observers[i].sdobs, &messageSize, sizeof(uint16_t), 0);
-                send(observers[i].sdobs, messageCurr, sizeof(char)*messageSize, 0);
-              }
-            }
-          }
+  // observers also get an edge whenever their socket has room again
+  if (tag == TAG_OBS) {
+    ev.events |= EPOLLOUT;
+  }
+  ev.data.u64 = ((uint64_t)tag << 32) | (uint32_t)slot;
+  if (epoll_ctl(epollFd, EPOLL_CTL_ADD, sd, &ev) < 0) {
+    perror("epoll_ctl");
+    exit(1);
+  }
+}
+
+void pollDel(int sd) {
+  epoll_ctl(epollFd, EPOLL_CTL_DEL, sd, NULL);
+}
 
-          else{
-            if(validLength == false || validChar == false){
+bool pollFits(int sd) {
+  return true;
+}
 
-              //send 'I'
-              //do not reset timer
-              char buf[] = {'I'};
-              send(participants[j].sdparts, &buf, sizeof(char), 0);
-            }
+void pollWantWrite(int sd, bool want) {
+}
 
-            if(alreadyGuessed){
+int pollWait(loopEvent *events, int maxEvents, int timeout) {
+  struct epoll_event ready[MAXEVENTS];
+  if (maxEvents > MAXEVENTS) {
+    maxEvents = MAXEVENTS;
+  }
 
-              //send 'T'
-              //reset timer
-              char buf[] = {'T'};
-              send(participants[j].sdparts, &buf, sizeof(char), 0);
-            }
-          } //end else
-        } // if participant state = 0
-      }
+  int status = epoll_wait(epollFd, ready, maxEvents, timeout);
+  if (status == -1) {
+    if (errno == EINTR) {
+      return 0;
     }
-  } // else select > 0
+    perror("epoll_wait");
+    exit(1);
+  }
 
+  for (int i = 0; i < status; i++) {
+    events[i].tag = (int)(ready[i].data.u64 >> 32);
+    events[i].slot = (int)(uint32_t)ready[i].data.u64;
+    events[i].readable = (ready[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) != 0;
+    events[i].writable = (ready[i].events & EPOLLOUT) != 0;
+  }
+  return status;
 }
 
-void usernameObs(int sdobs, int j, fd_set readfds){
-  int n;
-  uint8_t nameLength;
-  bool needName = true;
-  while (needName){
-    if(observers[j].state == 0){
-
-      n = recv(observers[j].sdobs, &nameLength, sizeof(uint8_t), 0);
-
-
-      if (n <= 0) {
-
-        // this was closing active participant
-        //close(participants[j].sdparts);
-        printf("CLOSING ACTIVE OBSERVER SOCKET\n");
-        disconnectObs(j, readfds);
-
-        // char* username = malloc(sizeof(char) * strlen(participants[j].name));
-        // strcpy(username, participants[j].name);
-        // char* msgToSend = concat("User ", username, " has left");
-        // uint16_t msgLength = strlen(msgToSend);
-        //
-        // char weWillSendThisMsg[msgLength];
-        // for(int k = 0; k < msgLength; k++){
-        //   weWillSendThisMsg[k] = msgToSend[k];
-        // }
-        //
-        // for (int i = 0; i < MAXSIZE; i++) {
-        //   // send to all observers except for the one affiliated with disconnecting participant
-        //   if(observers[i].sdobs != 0 && observers[i].sdobs != participants[j].sdobs){
-        //     send(observers[i].sdobs, &msgLength, sizeof(uint16_t), 0);
-        //     send(observers[i].sdobs, weWillSendThisMsg, sizeof(char)*msgLength, 0);
-        //   }
-        // }
-        //
-        // for (int i = 0; i < MAXSIZE; i++) {
-        //   if (0 == strcmp(participants[j].name, observers[i].name) ) {
-        //     close(observers[i].sdobs);
-        //     printf("CLOSING ACTIVE PARTICIPANT'S OBSERVER SOCKET\n");
-        //     FD_CLR(observers[i].sdobs, &readfds);
-        //     oSize--;
-        //     observers[i].sdparts = 0;
-        //     observers[i].sdobs = 0;
-        //     memset(observers[i].name, 0, sizeof(observers[i].name));
-        //     observers[i].state = -1;
-        //     observers[i].time = TIMER;
-        //
-        //   }
-        // }
-        //
-        // FD_CLR(participants[j].sdparts, &readfds);
-        // pSize--;
-        // /*
-        // participants[j].sdparts = 0;
-        // participants[j].sdobs = 0;
-        // memset(participants[j].name, 0, sizeof(participants[j].name));
-        // participants[j].state = -1;
-        // participants[j].time = TIMER;
-        // */
-        // resetPartSD(j);
-        //
-
-      }
-
-
-      printf("The length of the name we are receivng is : %d \n", nameLength);
-      //close everything
-      /*if (n == 0) {
-        printf("I AM CLOSING THE SOCKET IN ObserverUSER \n");
-        FD_CLR(observers[j].sdobs, &readfds);
-        oSize--;
-        observers[j].sdparts = 0;
-        observers[j].sdobs = 0;
-        memset(observers[j].name, 0, sizeof(observers[j].name));
-        observers[j].state = -1;
-        observers[j].time = 4;
-
-        close(observers[j].sdobs);
-      }*/
-      //else{
-
-        char name[11] = {'\0'};
-        for (int i = 0; i < 11; i++) {
-          name[i] = '\0';
-        }
+#else
 
-        //gettimeofday(&observers[j].end, NULL);
-        ///double timeTaken = (double)(observers[j].end.tv_usec - observers[j].start.tv_usec)/1000000 + (observers[j].end.tv_sec - observers[j].start.tv_sec);
-        //bool noMatch = true;
-        //printf("timeTaken: %f, observers[j].time: %f\n", timeTaken, observers[j].time);
-        /*if(timeTaken > observers[j].time){
-          int status_test = 0;
-          printf("I AM CLOSING THE SOCKET IN ObserverUSER IN PLACE #2\n");
-          needName = false;
-          noMatch = false;
-          status_test = close(observers[j].sdparts);
-          fprintf(stderr, "status 1 is %d\n", status_test);
-          fprintf(stderr, "status 2 is %d\n", observers[j].sdobs);
-          FD_CLR(observers[j].sdobs, &readfds);
-          oSize--;
-          // fprintf(stderr, "status 2 is %d\n", status_test);
-          observers[j].sdparts = 0;
-          observers[j].sdobs = 0;
-          memset(observers[j].name, 0, sizeof(observers[j].name));
-          // fprintf(stderr, "status 3 is %d\n", status_test);
-          observers[j].state = -1;
-          observers[j].time = 4;
-          observers[j].start;
-          observers[j].end;
-
-          //ran out of time
-        }*/
-        //else{
-          //observers[j].time = observers[j].time - timeTaken;
-
-          n = recv(observers[j].sdobs, &name, sizeof(char)*nameLength, 0);
-          //observers[j].time = observers[j].time - timeTaken;
-
-          bool noMatch = true;
-          for(int a = 0; a < MAXSIZE; a++){
-            printf("the participants name is: %s \n", participants[a].name);
-            printf("the given name is: %s \n", name);
-            if(strcmp(participants[a].name, name) == 0){
-
-              //no observer yet, send "I"
-              if(participants[a].sdobs == 0){
-                printf("I found a participant with the name I'm looking for!! \n");
-                needName = false;
-                char buf={'Y'};
-                send(observers[j].sdobs, &buf, sizeof(char), 0);
-                participants[a].sdobs = observers[j].sdobs;
-                observers[j].sdparts  = participants[a].sdparts;
-                observers[j].state    = 1;
-                strcpy(observers[j].name, name);
-
-                //send the name to everybody that "a new observer joined"
-                uint16_t messageSize = 25;
-                char message[25] = ("A new observer has joined");
-
-                messageSize = htons(ntohs(messageSize));
-
-                for(int i = 0; i < MAXSIZE; i++){
-                  if((observers[i].sdobs != 0) && (observers[i].sdobs != participants[a].sdobs)){
-                    send(observers[i].sdobs, &messageSize, sizeof(uint16_t), 0);
-                    send(observers[i].sdobs, message, sizeof(char)*messageSize, 0);
-                  }
-                }
-              }
-
-              //they already have an observer send 'T'
-              else{
-                char buf= {'T'};
-                send(observers[j].sdobs, &buf, sizeof(char), 0);
-              }
-              a = MAXSIZE;
-              noMatch = false;
-            }
-          }
-          if(noMatch){
-            printf("I got into the case where I didn't find the name \n");
-            char buf2[]={'N'};
-            needName = false;
-            send(observers[j].sdobs, &buf2, sizeof(char), 0);
-            oSize--;
-            FD_CLR(observers[j].sdobs, &readfds);
-            close(observers[j].sdobs);
+/* fd_set is a plain bit array on Linux, so it is walked a word at a time */
+__thread fd_set readSet;            /* every registered socket, so also the set of live fds */
+__thread fd_set writeSet;           /* observers with frames queued, see loopWantWrite */
+__thread int maxFd = -1;            /* highest fd in readSet */
+__thread int fdTag[FD_SETSIZE];     /* what pollAdd was told about each fd */
+__thread int fdSlot[FD_SETSIZE];
+__thread int scanWord = 0;          /* where the next wakeup starts looking, so high fds get their turn */
 
-            resetObsSD(j);
+void pollInit() {
+  FD_ZERO(&readSet);
+  FD_ZERO(&writeSet);
+}
 
-          }
-        }
-      //}
-    //}
+void pollAdd(int sd, int tag, int slot) {
+  FD_SET(sd, &readSet);
+  fdTag[sd] = tag;
+  fdSlot[sd] = slot;
+  if (sd > maxFd) {
+    maxFd = sd;
   }
 }
 
-void disconnectPart(int j, fd_set readfds) {
-  close(participants[j].sdparts);
-  printf("CLOSING ACTIVE PARTICIPANT SOCKET\n");
+void pollDel(int sd) {
+  if (sd < 0 || sd >= FD_SETSIZE) {
+    return;
+  }
+  FD_CLR(sd, &readSet);
+  FD_CLR(sd, &writeSet);
+  if (sd != maxFd) {
+    return;
+  }
 
-  char* username = malloc(sizeof(char) * strlen(participants[j].name));
-  strcpy(username, participants[j].name);
-  char* msgToSend = concat("User ", username, " has left");
-  uint16_t msgLength = strlen(msgToSend);
+  // the next highest live fd, a word at a time
+  unsigned long *live = (unsigned long *)&readSet;
+  maxFd = -1;
+  for (int w = sd / NFDBITS; w >= 0; w--) {
+    if (live[w] != 0) {
+      maxFd = w * NFDBITS + NFDBITS - 1 - __builtin_clzl(live[w]);
+      break;
+    }
+  }
+}
 
-  // sends in network standard byte order
-  msgLength = htons(ntohs(msgLength));
+bool pollFits(int sd) {
+  return sd < FD_SETSIZE;
+}
 
-  char weWillSendThisMsg[msgLength];
-  for(int k = 0; k < msgLength; k++){
-    weWillSendThisMsg[k] = msgToSend[k];
+void pollWantWrite(int sd, bool want) {
+  if (want) {
+    FD_SET(sd, &writeSet);
+  }
+  else {
+    FD_CLR(sd, &writeSet);
   }
+}
+
+int pollWait(loopEvent *events, int maxEvents, int timeout) {
+  struct timeval tv;
+  fd_set readfds = readSet;
+  fd_set writefds = writeSet;
+  int status;
 
-  for (int i = 0; i < MAXSIZE; i++) {
-    // send to all observers except for the one affiliated with disconnecting participant
-    if(observers[i].sdobs != 0 ){
-      send(observers[i].sdobs, &msgLength, sizeof(uint16_t), 0);
-      send(observers[i].sdobs, weWillSendThisMsg, sizeof(char)*msgLength, 0);
+  TRACE(TRACE_DEBUG, "max+1: %d", NULL, maxFd+1, 0);
+  tv.tv_sec = timeout / 1000;
+  tv.tv_usec = (timeout % 1000) * 1000;
+  status = select (maxFd+1, &readfds, &writefds, NULL, timeout < 0 ? NULL : &tv);
+
+  if (status == -1) {
+    if (errno == EINTR) {
+      return 0;
     }
+    perror("select");
+    exit(1);
+  }
+
+  // only the words holding ready fds are looked at, and within them only
+  // the set bits, starting where the last wakeup that filled events stopped
+  unsigned long *r = (unsigned long *)&readfds;
+  unsigned long *w = (unsigned long *)&writefds;
+  int words = maxFd / NFDBITS + 1;
+  if (scanWord >= words) {
+    scanWord = 0;
   }
-  for (int i = 0; i < MAXSIZE; i++) {
-    if (0 == strcmp(participants[j].name, observers[i].name) ) {
-      close(observers[i].sdobs);
-      printf("CLOSING ACTIVE PARTICIPANT'S OBSERVER SOCKET\n");
-      FD_CLR(observers[i].sdobs, &readfds);
-      oSize--;
-      resetObsSD(i);
+  int n = 0;
+  for (int k = 0; k < words && n < status && n < maxEvents; k++) {
+    int word = (scanWord + k) % words;
+    unsigned long ready = r[word] | w[word];
+    while (ready != 0 && n < maxEvents) {
+      int sd = word * NFDBITS + __builtin_ctzl(ready);
+      ready &= ready - 1;
+      events[n].tag = fdTag[sd];
+      events[n].slot = fdSlot[sd];
+      events[n].readable = FD_ISSET(sd, &readfds);
+      events[n].writable = FD_ISSET(sd, &writefds);
+      n++;
+    }
+    if (n == maxEvents) {
+      scanWord = word + 1;
     }
-    i = MAXSIZE;
   }
+  return n;
+}
 
+#endif
 
-  for (int i = 0; i < MAXSIZE; i++) {
-    if (0 == strcmp(participants[j].name, observers[i].name) ) {
-      close(observers[i].sdobs);
-      printf("CLOSING ACTIVE PARTICIPANT'S OBSERVER SOCKET\n");
-      FD_CLR(observers[i].sdobs, &readfds);
-      oSize--;
-      resetObsSD(i);
-    }
+/* io_uring backend -----------------------------------------------------*/
+
+/* completion user_data: tag in the top byte, slot below it, the slot's gen at the bottom */
+#define URINGDATA(tag, slot, gen) (((uint64_t)(tag) << 56) | ((uint64_t)((slot) & 0xffffff) << 32) | (uint32_t)(gen))
+
+void uringInit() {
+  struct io_uring_params p;
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_SUBMIT_ALL | IORING_SETUP_COOP_TASKRUN | IORING_SETUP_SINGLE_ISSUER;
+  ring.fd = syscall(__NR_io_uring_setup, URINGENTRIES, &p);
+
+  // older kernels don't know those flags, they are only an optimisation
+  if (ring.fd < 0 && errno == EINVAL) {
+    memset(&p, 0, sizeof(p));
+    ring.fd = syscall(__NR_io_uring_setup, URINGENTRIES, &p);
+  }
+  if (ring.fd < 0) {
+    fprintf(stderr, "Error: io_uring creation failed\n");
+    exit(EXIT_FAILURE);
+  }
+  if (!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_EXT_ARG)) {
+    fprintf(stderr, "Error: io_uring is too old for this server\n");
+    exit(EXIT_FAILURE);
   }
 
-  FD_CLR(participants[j].sdparts, &readfds);
-  pSize--;
-  resetPartSD(j);
+  // both rings share one mapping, the entries have their own
+  size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  char *rings = mmap(NULL, sqSize > cqSize ? sqSize : cqSize, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+  ring.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+  if (rings == MAP_FAILED || ring.sqes == MAP_FAILED) {
+    fprintf(stderr, "Error: io_uring mmap failed\n");
+    exit(EXIT_FAILURE);
+  }
+  ring.sqHead = (unsigned *)(rings + p.sq_off.head);
+  ring.sqTail = (unsigned *)(rings + p.sq_off.tail);
+  ring.sqMask = (unsigned *)(rings + p.sq_off.ring_mask);
+  ring.sqArray = (unsigned *)(rings + p.sq_off.array);
+  ring.sqEntries = p.sq_entries;
+  ring.tail = *ring.sqTail;
+  ring.cqHead = (unsigned *)(rings + p.cq_off.head);
+  ring.cqTail = (unsigned *)(rings + p.cq_off.tail);
+  ring.cqMask = (unsigned *)(rings + p.cq_off.ring_mask);
+  ring.cqes = (struct io_uring_cqe *)(rings + p.cq_off.cqes);
+
+  // reads don't pick a buffer until data is there, so idle sockets hold none
+  ring.bufRing = mmap(NULL, RECVBUFS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  ring.bufs = malloc(RECVBUFS * RECVBUFSIZE);
+  if (ring.bufRing == MAP_FAILED || ring.bufs == NULL) {
+    printf("out of memory\n");
+    exit(1);
+  }
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)ring.bufRing;
+  reg.ring_entries = RECVBUFS;
+  reg.bgid = 0;
+  if (syscall(__NR_io_uring_register, ring.fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+    fprintf(stderr, "Error: Registering io_uring buffers failed\n");
+    exit(EXIT_FAILURE);
+  }
+  ring.bufTail = 0;
+  for (int i = 0; i < RECVBUFS; i++) {
+    uringRecycle(i);
+  }
+}
+
+struct io_uring_sqe* uringSqe() {
+
+  // ring is full, hand what is there to the kernel first
+  if (ring.tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) >= ring.sqEntries) {
+    uringEnter(false, 0);
+  }
+
+  unsigned idx = ring.tail & *ring.sqMask;
+  struct io_uring_sqe *sqe = &ring.sqes[idx];
+  memset(sqe, 0, sizeof(*sqe));
+  ring.sqArray[idx] = idx;
+  ring.tail++;
+  return sqe;
 }
 
-void disconnectObs(int j, fd_set readfds) {
-  for (int i = 0; i < MAXSIZE; i++) {
-    if (0 == strcmp(participants[j].name, observers[i].name) ) {
-      close(observers[i].sdobs);
-      printf("CLOSING ACTIVE PARTICIPANT'S OBSERVER SOCKET\n");
-      FD_CLR(observers[i].sdobs, &readfds);
-      oSize--;
-      resetObsSD(i);
+void uringEnter(bool wait, int timeout) {
+  __atomic_store_n(ring.sqTail, ring.tail, __ATOMIC_RELEASE);
+  unsigned submit = ring.tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE);
+
+  struct __kernel_timespec ts;
+  struct io_uring_getevents_arg arg;
+  memset(&arg, 0, sizeof(arg));
+  if (wait && timeout >= 0) {
+    ts.tv_sec = timeout / 1000;
+    ts.tv_nsec = (timeout % 1000) * 1000000L;
+    arg.ts = (uint64_t)&ts;
+  }
+
+  unsigned flags = IORING_ENTER_EXT_ARG | (wait ? IORING_ENTER_GETEVENTS : 0);
+  if (syscall(__NR_io_uring_enter, ring.fd, submit, wait ? 1 : 0, flags, &arg, sizeof(arg)) < 0) {
+
+    // a signal, the timeout, or completions to reap before anything else fits
+    if (errno == EINTR || errno == ETIME || errno == EBUSY || errno == EAGAIN) {
+      return;
     }
-    i = MAXSIZE;
+    perror("io_uring_enter");
+    exit(1);
   }
 }
 
-void resetObsSD(int j) {
-  observers[j].sdparts = 0;
-  observers[j].sdobs = 0;
-  memset(observers[j].name, 0, sizeof(observers[j].name));
-  observers[j].state = -1;
-  observers[j].time = TIMER;
-  observers[j].start;
-  observers[j].end;
+void uringAdd(int sd, int tag, int slot) {
+  struct io_uring_sqe *sqe = uringSqe();
+  sqe->fd = sd;
+
+  if (tag == TAG_PARTLISTEN || tag == TAG_OBSLISTEN) {
+    if (tag == TAG_PARTLISTEN) {
+      ring.partListen = sd;
+    }
+    else {
+      ring.obsListen = sd;
+    }
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = URINGDATA(tag, 0, 0);
+  }
+
+  else if (tag == TAG_WAKE) {
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = POLLIN;
+    sqe->user_data = URINGDATA(tag, 0, 0);
+  }
+
+  else {
+    client *c = tag == TAG_PART ? &participants[slot] : &observers[slot];
+    sqe->opcode = IORING_OP_RECV;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = URINGDATA(tag, slot, c->gen);
+  }
 }
 
-void resetPartSD(int j) {
-  participants[j].sdparts = 0;
-  participants[j].sdobs = 0;
-  memset(participants[j].name, 0, sizeof(participants[j].name));
-  participants[j].state = -1;
-  participants[j].time = TIMER;
-  participants[j].start;
-  participants[j].end;
+void uringCancel(int sd) {
+  struct io_uring_sqe *sqe = uringSqe();
+  sqe->opcode = IORING_OP_ASYNC_CANCEL;
+  sqe->fd = sd;
+  sqe->cancel_flags = IORING_ASYNC_CANCEL_FD | IORING_ASYNC_CANCEL_ALL;
+  sqe->user_data = URINGDATA(TAG_IGNORE, 0, 0);
+
+  // sd is about to be closed or given away, the kernel has to see this first
+  uringEnter(false, 0);
 }
 
-void initializeSDs() {
+void uringRecycle(int bid) {
+  struct io_uring_buf *b = &ring.bufRing->bufs[ring.bufTail & (RECVBUFS - 1)];
+  b->addr = (uint64_t)(ring.bufs + bid * RECVBUFSIZE);
+  b->len = RECVBUFSIZE;
+  b->bid = bid;
+  ring.bufTail++;
+  __atomic_store_n(&ring.bufRing->tail, ring.bufTail, __ATOMIC_RELEASE);
+}
 
-  for (int i = 0; i < 255; i++) {
-    participants[i].sdparts = 0;
-    participants[i].sdobs = 0;
-    memset(participants[i].name, 0, sizeof(participants[i].name));
-    participants[i].state = -1;
-    participants[i].time = TIMER;
-    participants[i].start;
-    participants[i].end;
+void uringFlush(int j) {
+  client *c = &observers[j];
+  clientCold *k = &obsCold[j];
+
+  // one chain at a time keeps the frames in order
+  if (c->sdobs == 0 || k->outSending > 0 || c->outCount == 0) {
+    return;
   }
 
-  for (int i = 0; i < 255; i++) {
-    observers[i].sdparts = 0;
-    observers[i].sdobs = 0;
-    memset(observers[i].name, 0, sizeof(observers[i].name));
-    observers[i].state = -1;
-    observers[i].time = TIMER;
-    observers[i].start;
-    observers[i].end;
+  // nothing is in flight, so the iovecs can move
+  int count = c->outCount;
+  if (k->iovCap < count) {
+    free(k->iov);
+    k->iovCap = c->outCap;
+    k->iov = malloc(sizeof(struct iovec) * k->iovCap);
+    if (k->iov == NULL) {
+      printf("out of memory\n");
+      exit(1);
+    }
+  }
+  for (int i = 0; i < count; i++) {
+    frame *f = c->outq[(c->outHead + i) % c->outCap];
+    k->iov[i].iov_base = f->data;
+    k->iov[i].iov_len = f->len;
+  }
+  k->iov[0].iov_base = (char *)k->iov[0].iov_base + c->outOffset;
+  k->iov[0].iov_len -= c->outOffset;
+  k->outSending = count;
+  k->outPieces = (count + URINGIOV - 1) / URINGIOV;
+  k->outWritten = 0;
+
+  // a chain cut in two by a full ring would lose its ordering
+  if (ring.tail - __atomic_load_n(ring.sqHead, __ATOMIC_ACQUIRE) + k->outPieces > ring.sqEntries) {
+    uringEnter(false, 0);
+  }
 
+  // a short write cancels the rest of the chain, which goes again next pass
+  for (int i = 0; i < count; i += URINGIOV) {
+    struct io_uring_sqe *sqe = uringSqe();
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = c->sdobs;
+    sqe->addr = (uint64_t)(k->iov + i);
+    sqe->len = count - i < URINGIOV ? count - i : URINGIOV;
+    sqe->flags = i + URINGIOV < count ? IOSQE_IO_LINK : 0;
+    sqe->user_data = URINGDATA(TAG_OBSWRITE, j, c->gen);
   }
 }
 
-char* concat(const char *str1, const char *str2, const char *str3) {
+void uringComplete(struct io_uring_cqe *cqe) {
+  int tag = (int)(cqe->user_data >> 56);
+  int slot = (int)((cqe->user_data >> 32) & 0xffffff);
+  unsigned int gen = (uint32_t)cqe->user_data;
+  bool more = (cqe->flags & IORING_CQE_F_MORE) != 0;
+  int res = cqe->res;
+
+  // reads land in a provided buffer, which goes back once it is parsed
+  int bid = -1;
+  if (cqe->flags & IORING_CQE_F_BUFFER) {
+    bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  }
 
-  char* result = malloc (sizeof(char) * (strlen(str1) + strlen(str2) + strlen(str3) + 1)); //+1 for null terminator
-  if (result == NULL) {
-    printf("out of memory\n");
-    exit(1);
+  switch (tag) {
+
+    // A participant or observer connected
+    case TAG_PARTLISTEN:
+    case TAG_OBSLISTEN:
+      if (res >= 0 && tag == TAG_PARTLISTEN) {
+        admitPart(res);
+      }
+      else if (res >= 0) {
+        admitObs(res);
+      }
+      else if (res == -EMFILE || res == -ENFILE) {
+        refuseSpare(tag == TAG_PARTLISTEN ? ring.partListen : ring.obsListen, tag == TAG_PARTLISTEN ? 0 : 1);
+      }
+      if (!more) {
+        uringAdd(tag == TAG_PARTLISTEN ? ring.partListen : ring.obsListen, tag, 0);
+      }
+      break;
+
+    // Another shard left mail
+    case TAG_WAKE:
+      drainMail();
+      if (!more) {
+        uringAdd(me->wake[0], TAG_WAKE, 0);
+      }
+      break;
+
+    // Input from a participant or observer
+    case TAG_PART:
+    case TAG_OBS: {
+      bool part = tag == TAG_PART;
+      client *c = part ? &participants[slot] : &observers[slot];
+      int sd = part ? c->sdparts : c->sdobs;
+
+      // meant for whoever had the slot before
+      if (sd == 0 || c->gen != gen) {
+        break;
+      }
+
+      // every buffer is in use, read again once some come back
+      if (res == -ENOBUFS) {
+        if (!more) {
+          uringAdd(sd, tag, slot);
+        }
+        break;
+      }
+
+      //someone quit
+      if (res <= 0) {
+        if (part) {
+          dropPart(slot);
+        }
+        else {
+          TRACE(TRACE_INFO, "an observer quit", NULL, 0, 0);
+          disconnectObs(slot);
+        }
+        break;
+      }
+
+      uringRead(c, slot, part, ring.bufs + bid * RECVBUFSIZE, res);
+      if (!more && (part ? c->sdparts : c->sdobs) == sd && c->gen == gen) {
+        uringAdd(sd, tag, slot);
+      }
+      break;
+    }
+
+    // Queued frames went out
+    case TAG_OBSWRITE: {
+      client *c = &observers[slot];
+      clientCold *k = &obsCold[slot];
+      if (c->sdobs == 0 || c->gen != gen) {
+        break;
+      }
+
+      // a failed piece means the peer is gone (its read side will notice
+      // the close) or an earlier piece was short
+      if (res > 0) {
+        k->outWritten += res;
+      }
+      else if (res != -ECANCELED) {
+        COUNT(sendErrors, 1);
+      }
+      if (--k->outPieces > 0) {
+        break;
+      }
+      k->outSending = 0;
+      retireFrames(slot, k->outWritten);
+
+      // the rest goes with everything else at the end of the pass
+      if (c->outCount > 0 && !c->dirty) {
+        c->dirty = true;
+        dirty[dirtyCount++] = slot;
+      }
+      break;
+    }
   }
 
-  strcpy(result, str1);
-  strcat(result, str2);
-  strcat(result, str3);
+  if (bid >= 0) {
+    uringRecycle(bid);
+  }
+}
 
-  return result;
+void uringRead(client *c, int j, bool part, const char *data, int n) {
+  int sd = part ? c->sdparts : c->sdobs;
+  clientCold *k = part ? &partCold[j] : &obsCold[j];
+  const char *buf = data;
+  int len = n;
+
+  // a frame was cut off last time, the new bytes go behind it
+  if (k->partialLen > 0) {
+    len = restorePartial(k);
+    memcpy(readBuf + len, data, n);
+    len += n;
+    buf = readBuf;
+  }
+
+  int used = part ? parsePart(j, sd, buf, len) : parseObs(j, sd, buf, len);
+
+  // a handler may have disconnected it
+  if ((part ? c->sdparts : c->sdobs) == sd) {
+    stashPartial(k, buf + used, len - used);
+  }
+}
+
+void runUring() {
+  while(1){
+
+    // submits everything the last pass queued and waits for completions
+    uringEnter(true, timerTimeout());
+    uint64_t passStart = monoNs();
+    timerAdvance();
+
+    if (shardId == 0 && statsRequested) {
+      printStats();
+    }
+
+    unsigned head = *ring.cqHead;
+    unsigned tail = __atomic_load_n(ring.cqTail, __ATOMIC_ACQUIRE);
+    TRACE(TRACE_DEBUG, "status:%d", NULL, tail - head, 0);
+    while (head != tail) {
+      uringComplete(&ring.cqes[head & *ring.cqMask]);
+      head++;
+      __atomic_store_n(ring.cqHead, head, __ATOMIC_RELEASE);
+    }
+
+    // leave notices built outside parsePart
+    arenaReset();
+
+    // everything v2 observers got this pass goes out as one frame each
+    flushBatches();
+
+    // every observer that got frames this pass starts a writev, the whole
+    // fan-out reaches the kernel with the next io_uring_enter
+    for (int i = 0; i < dirtyCount; i++) {
+      client *c = &observers[dirty[i]];
+      clientCold *k = &obsCold[dirty[i]];
+      c->dirty = false;
+
+      // a writable socket finishes its writes by the next pass, so frames
+      // waiting behind ones still going from an earlier pass are backlog,
+      // and that is what the high-water mark applies to
+      uringFlush(dirty[i]);
+      if (c->sdobs != 0 && c->outCount - k->outSending > queueMax) {
+        shedFrames(dirty[i], c->outCount - k->outSending - queueMax);
+      }
+    }
+    dirtyCount = 0;
+
+    // hand this pass's broadcasts to the other shards
+    flushMail();
+
+    __atomic_store_n(&me->stats.participants, pSize, __ATOMIC_RELAXED);
+    __atomic_store_n(&me->stats.observers, oSize, __ATOMIC_RELAXED);
+    histRecord(&me->stats.loopTime, monoNs() - passStart);
+  }
 }